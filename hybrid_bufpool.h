@@ -0,0 +1,181 @@
+#ifndef HYBRID_BUFPOOL_H
+#define HYBRID_BUFPOOL_H
+
+// Stage69 record buffer pool (ASCII only)
+// One size class: APP_BUF_SIZE bytes, enough for a full stream frame (16 KB
+// chunk plus header and tag, i.e. a TLS max record worth of payload). Buffers
+// come from 64-byte aligned slabs and are recycled through a per-thread free
+// list, so the record path does no malloc/free and no locking. Released
+// buffers are zeroized first, so plaintext never lingers in free memory.
+//
+// A buffer may be released on any thread; it joins that thread's list. When
+// a thread exits, its list moves to a shared list that new threads draw from.
+// Slabs live until app_buf_pool_free_all() at process exit.
+//
+// NUMA: a thread's slabs are placed on its node (hybrid_numa.h, pin the
+// thread first), and the shared list is kept per node, so a pinned worker
+// only ever recycles buffers from its own node. A buffer released on another
+// node's thread counts as that node's from then on.
+
+#include <openssl/crypto.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hybrid_numa.h"
+
+#define APP_BUF_SIZE 16448          // >= APP_STREAM_FRAME_MAX, multiple of 64
+#define APP_BUF_PER_SLAB 16
+#define APP_BUF_CACHE_MAX 64        // per-thread free buffers kept before spilling
+
+typedef struct app_buf_free {
+    struct app_buf_free* next;
+} app_buf_free;
+
+typedef struct app_buf_slab {
+    struct app_buf_slab* next;
+    unsigned char* mem;
+} app_buf_slab;
+
+typedef struct {
+    app_buf_free* head;
+    int count;
+    int registered;
+    int node;
+} app_buf_cache;
+
+static struct {
+    pthread_mutex_t mu;
+    pthread_once_t once;
+    pthread_key_t key;
+    app_buf_free* spill[APP_NUMA_MAX_NODES];   // buffers from exited or overfull threads
+    app_buf_slab* slabs;
+    uint64_t nslabs;
+} g_app_buf = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_ONCE_INIT, 0, {NULL}, NULL, 0 };
+
+static __thread app_buf_cache g_app_buf_tls;
+
+static void app_buf_spill(int node, app_buf_free* head, app_buf_free* tail) {
+    pthread_mutex_lock(&g_app_buf.mu);
+    tail->next = g_app_buf.spill[node];
+    g_app_buf.spill[node] = head;
+    pthread_mutex_unlock(&g_app_buf.mu);
+}
+
+static void app_buf_thread_exit(void* p) {
+    app_buf_cache* c = (app_buf_cache*)p;
+    if (!c->head) return;
+    app_buf_free* tail = c->head;
+    while (tail->next) tail = tail->next;
+    app_buf_spill(c->node, c->head, tail);
+    c->head = NULL;
+    c->count = 0;
+}
+
+static void app_buf_key_init(void) {
+    pthread_key_create(&g_app_buf.key, app_buf_thread_exit);
+}
+
+// Move up to APP_BUF_PER_SLAB buffers of a node's shared list to c.
+static void app_buf_take_spill(app_buf_cache* c, int node) {
+    pthread_mutex_lock(&g_app_buf.mu);
+    for (int i = 0; i < APP_BUF_PER_SLAB && g_app_buf.spill[node]; i++) {
+        app_buf_free* f = g_app_buf.spill[node];
+        g_app_buf.spill[node] = f->next;
+        f->next = c->head;
+        c->head = f;
+        c->count++;
+    }
+    pthread_mutex_unlock(&g_app_buf.mu);
+}
+
+// Refill the calling thread's list from its node's shared list or a new
+// slab on its node; other nodes' buffers only when memory runs out.
+static int app_buf_refill(app_buf_cache* c) {
+    app_buf_take_spill(c, c->node);
+    if (c->head) return 1;
+
+    app_buf_slab* s = (app_buf_slab*)malloc(sizeof(*s));
+    void* mem = NULL;
+    if (!s || posix_memalign(&mem, APP_NUMA_PAGE, (size_t)APP_BUF_PER_SLAB * APP_BUF_SIZE) != 0) {
+        free(s);
+        for (int n = 0; n < APP_NUMA_MAX_NODES && !c->head; n++) app_buf_take_spill(c, n);
+        return c->head != NULL;
+    }
+    app_numa_bind(mem, (size_t)APP_BUF_PER_SLAB * APP_BUF_SIZE, c->node);
+    memset(mem, 0, (size_t)APP_BUF_PER_SLAB * APP_BUF_SIZE);   // first touch on this thread
+    s->mem = (unsigned char*)mem;
+    for (int i = APP_BUF_PER_SLAB - 1; i >= 0; i--) {
+        app_buf_free* f = (app_buf_free*)(s->mem + (size_t)i * APP_BUF_SIZE);
+        f->next = c->head;
+        c->head = f;
+        c->count++;
+    }
+    pthread_mutex_lock(&g_app_buf.mu);
+    s->next = g_app_buf.slabs;
+    g_app_buf.slabs = s;
+    g_app_buf.nslabs++;
+    pthread_mutex_unlock(&g_app_buf.mu);
+    return 1;
+}
+
+// Returns an APP_BUF_SIZE byte buffer, or NULL if out of memory.
+static unsigned char* app_buf_get(void) {
+    app_buf_cache* c = &g_app_buf_tls;
+    if (!c->registered) {
+        pthread_once(&g_app_buf.once, app_buf_key_init);
+        pthread_setspecific(g_app_buf.key, c);
+        c->node = app_numa_self_node();
+        c->registered = 1;
+    }
+    if (!c->head && !app_buf_refill(c)) return NULL;
+    app_buf_free* f = c->head;
+    c->head = f->next;
+    c->count--;
+    f->next = NULL;
+    return (unsigned char*)f;
+}
+
+// Zeroize the first used bytes (APP_BUF_SIZE if unsure) and release b. NULL is ignored.
+static void app_buf_put(unsigned char* b, size_t used) {
+    if (!b) return;
+    OPENSSL_cleanse(b, used < APP_BUF_SIZE ? used : APP_BUF_SIZE);
+    app_buf_cache* c = &g_app_buf_tls;
+    app_buf_free* f = (app_buf_free*)b;
+    if (c->registered && c->count < APP_BUF_CACHE_MAX) {
+        f->next = c->head;
+        c->head = f;
+        c->count++;
+        return;
+    }
+    f->next = NULL;
+    app_buf_spill(c->registered ? c->node : app_numa_self_node(), f, f);
+}
+
+// Bytes held in slabs (in use or free).
+static uint64_t app_buf_pool_bytes(void) {
+    pthread_mutex_lock(&g_app_buf.mu);
+    uint64_t n = g_app_buf.nslabs * (uint64_t)APP_BUF_PER_SLAB * APP_BUF_SIZE;
+    pthread_mutex_unlock(&g_app_buf.mu);
+    return n;
+}
+
+// Frees every slab. Only at process exit, after all users have stopped.
+static void app_buf_pool_free_all(void) {
+    pthread_mutex_lock(&g_app_buf.mu);
+    while (g_app_buf.slabs) {
+        app_buf_slab* s = g_app_buf.slabs;
+        g_app_buf.slabs = s->next;
+        OPENSSL_cleanse(s->mem, (size_t)APP_BUF_PER_SLAB * APP_BUF_SIZE);
+        free(s->mem);
+        free(s);
+    }
+    g_app_buf.nslabs = 0;
+    memset(g_app_buf.spill, 0, sizeof(g_app_buf.spill));
+    pthread_mutex_unlock(&g_app_buf.mu);
+    g_app_buf_tls.head = NULL;
+    g_app_buf_tls.count = 0;
+}
+
+#endif // HYBRID_BUFPOOL_H
@@ -3,82 +3,1244 @@
 #define HYBRID_COMMON_H
 
 // Stage69 common helper (ASCII only)
-// AES-GCM helpers using OpenSSL EVP. Tag is appended to the end of ciphertext.
+// AEAD record layer (AES-GCM or ChaCha20-Poly1305) and HKDF key schedule
+// using OpenSSL EVP. Tag is appended to the end of ciphertext. This header is
+// the only copy: qkd69_s, qkd69_c, qkd69_bench and qkd69_pool all include it.
 
 #include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#include <openssl/provider.h>
+#include <openssl/ssl.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
 
+#include "hybrid_bufpool.h"
+
+// ---- Compile-time AEAD suite --------------------------------------------
+// The default cipher and every length are fixed at build time, so size
+// arithmetic folds to constants and the EVP calls that only matter for
+// non-default sizes drop out of the record path. They are part of the wire
+// format: both peers must be built with the same values. Select with
+//   -DAPP_SUITE=APP_SUITE_AES_256_GCM (default) | _AES_128_GCM | _CHACHA20_POLY1305
+//   -DAPP_TAG_LEN=12..16   truncated tags (default 16)
+//   -DAPP_IV_LEN=8..16     GCM only (default 12, the only fast GCM size)
+// Other suites with the same key length can still be negotiated per
+// connection (see "Runtime suite selection"); APP_SUITE is what a peer gets
+// when nothing was negotiated.
+#define APP_SUITE_AES_256_GCM       1
+#define APP_SUITE_AES_128_GCM       2
+#define APP_SUITE_CHACHA20_POLY1305 3
+#define APP_SUITE_AES_256_GCM_SIV   4   // runtime only (OpenSSL 3.2+)
+#define APP_SUITE_COUNT             4
+
+#ifndef APP_SUITE
+#define APP_SUITE APP_SUITE_AES_256_GCM
+#endif
+
+#if APP_SUITE == APP_SUITE_AES_256_GCM
+#define APP_AEAD_NAME "AES-256-GCM"
+#define APP_AEAD_EVP  EVP_aes_256_gcm
+#define APP_KEY_LEN   32
+#elif APP_SUITE == APP_SUITE_AES_128_GCM
+#define APP_AEAD_NAME "AES-128-GCM"
+#define APP_AEAD_EVP  EVP_aes_128_gcm
+#define APP_KEY_LEN   16
+#elif APP_SUITE == APP_SUITE_CHACHA20_POLY1305
+#define APP_AEAD_NAME "ChaCha20-Poly1305"
+#define APP_AEAD_EVP  EVP_chacha20_poly1305
+#define APP_KEY_LEN   32
+#else
+#error "unknown APP_SUITE"
+#endif
+
+#ifndef APP_IV_LEN
 #define APP_IV_LEN 12
+#endif
+#ifndef APP_TAG_LEN
 #define APP_TAG_LEN 16
+#endif
 
-// AEAD encrypt: out_ct = ciphertext || tag(16)
-// returns 1 on success, 0 on failure.
-static int aead_encrypt(const unsigned char* key,
-                        const unsigned char* aad, int aadlen,
-                        const unsigned char* nonce12,
-                        const unsigned char* pt, int ptlen,
-                        unsigned char* out_ct, int* outlen) {
+// The record number fills the last 8 nonce bytes (aead_nonce_xor).
+_Static_assert(APP_IV_LEN >= 8 && APP_IV_LEN <= 16, "APP_IV_LEN must be 8..16");
+_Static_assert(APP_TAG_LEN >= 12 && APP_TAG_LEN <= 16, "APP_TAG_LEN must be 12..16");
+#if APP_SUITE == APP_SUITE_CHACHA20_POLY1305 && APP_IV_LEN != 12
+#error "ChaCha20-Poly1305 needs APP_IV_LEN 12"
+#endif
+
+// ---- Runtime suite selection --------------------------------------------
+// Every suite whose sizes match this build can be chosen per connection.
+// crypto_rt_init() fetches the usable ones and orders them by CPU: with AES
+// and carry-less multiply instructions AES-GCM comes first, without them
+// (small ARM boxes) ChaCha20-Poly1305, which is several times faster there
+// in software. AES-GCM-SIV is only used when listed explicitly
+// (crypto_rt_set_prefer): record nonces are counters, so nonce-misuse
+// resistance costs a second pass for nothing unless a deployment wants it.
+typedef struct {
+    int id;
+    const char* name;       // OpenSSL fetch name
+    const char* tag;        // short name for options and ALPN ("stage69-" tag)
+    int key_len;
+    int iv12_only;          // nonce must be 12 bytes
+    int tag16_only;         // tag must be 16 bytes
+} app_suite_info;
+
+static const app_suite_info k_app_suites[APP_SUITE_COUNT] = {
+    { APP_SUITE_AES_256_GCM,       "AES-256-GCM",       "aes256gcm",    32, 0, 0 },
+    { APP_SUITE_AES_128_GCM,       "AES-128-GCM",       "aes128gcm",    16, 0, 0 },
+    { APP_SUITE_CHACHA20_POLY1305, "ChaCha20-Poly1305", "chacha20",     32, 1, 0 },
+    { APP_SUITE_AES_256_GCM_SIV,   "AES-256-GCM-SIV",   "aes256gcmsiv", 32, 1, 1 },
+};
+
+static const app_suite_info* app_suite_get(int id) {
+    return id >= 1 && id <= APP_SUITE_COUNT ? &k_app_suites[id - 1] : NULL;
+}
+
+static int app_suite_by_tag(const char* tag, size_t len) {
+    for (int i = 0; i < APP_SUITE_COUNT; i++) {
+        if (strlen(k_app_suites[i].tag) == len && memcmp(k_app_suites[i].tag, tag, len) == 0) {
+            return k_app_suites[i].id;
+        }
+    }
+    return 0;
+}
+
+// Sizes of this build allow the suite (its EVP object may still be missing).
+static int app_suite_fits(const app_suite_info* si) {
+    return si->key_len == APP_KEY_LEN && (!si->iv12_only || APP_IV_LEN == 12) &&
+           (!si->tag16_only || APP_TAG_LEN == 16);
+}
+
+// 1 if the CPU has AES and GHASH instructions OpenSSL will use.
+static int crypto_rt_cpu_has_aes(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul");
+#elif defined(__aarch64__) && defined(__linux__)
+    unsigned long hw = getauxval(AT_HWCAP);
+    return (hw & HWCAP_AES) && (hw & HWCAP_PMULL);
+#else
+    return 0;   // unknown: ChaCha20 is never slow in software
+#endif
+}
+
+// ---- Crypto runtime -----------------------------------------------------
+// OpenSSL 3 algorithm objects fetched once at startup. The implicit helpers
+// (EVP_aes_256_gcm() etc., digest names in KDF params) do a provider-store lookup
+// under a lock on every init, which serializes multi-threaded session setup.
+// Call crypto_rt_init() once from main before starting threads; without it
+// every path falls back to implicit fetches and still works.
+typedef struct {
+    EVP_CIPHER*  aead;          // APP_AEAD_NAME (= suites[APP_SUITE])
+    EVP_CIPHER*  suites[APP_SUITE_COUNT + 1];   // by id, NULL = unavailable
+    int prefer[APP_SUITE_COUNT];                // ids, most preferred first
+    int nprefer;
+    EVP_MD*      md;            // SHA-256
+    EVP_KDF*     hkdf;
+    EVP_KDF_CTX* hkdf_extract;  // templates with digest + mode already set;
+    EVP_KDF_CTX* hkdf_expand;   // sessions EVP_KDF_CTX_dup() them
+    int ready;
+} crypto_rt;
+
+static crypto_rt g_crypto_rt;
+
+// ---- Provider offload ---------------------------------------------------
+// An accelerator (e.g. the QAT provider) is an OpenSSL 3 provider: load it
+// with crypto_rt_load_providers() and give crypto_rt_set_propq() a property
+// query such as "?provider=qatprovider" before crypto_rt_init(). The record
+// ciphers, SHA-256 and HKDF are then fetched from it where it has them and
+// from the default provider elsewhere ("?" makes the query a preference).
+// Providers stay loaded for the life of the process.
+static char g_crypto_rt_propq[128];
+
+static const char* crypto_rt_propq(void) {
+    return g_crypto_rt_propq[0] ? g_crypto_rt_propq : NULL;
+}
+
+// 1 if fetches are steered to a provider; the in-tree multi-buffer kernel
+// would bypass it, so aead_ctx_mb_init() leaves contexts on EVP then.
+static int crypto_rt_offloaded(void) {
+    return g_crypto_rt_propq[0] != '\0';
+}
+
+// returns 1 on success, 0 if the query does not fit.
+static int crypto_rt_set_propq(const char* propq) {
+    size_t len = propq ? strlen(propq) : 0;
+    if (len >= sizeof(g_crypto_rt_propq)) return 0;
+    memcpy(g_crypto_rt_propq, propq ? propq : "", len + 1);
+    return 1;
+}
+
+// Load a comma separated list of providers ("qatprovider") plus "default",
+// which an explicit load would otherwise keep from loading implicitly.
+// returns 1 on success, 0 on the first provider that fails (OpenSSL error queued).
+static int crypto_rt_load_providers(const char* list) {
+    char name[64];
+    if (!OSSL_PROVIDER_load(NULL, "default")) return 0;
+    while (*list) {
+        const char* end = strchr(list, ',');
+        size_t len = end ? (size_t)(end - list) : strlen(list);
+        if (len == 0 || len >= sizeof(name)) return 0;
+        memcpy(name, list, len);
+        name[len] = '\0';
+        if (!OSSL_PROVIDER_load(NULL, name)) return 0;
+        list += len + (end ? 1 : 0);
+    }
+    return 1;
+}
+
+static EVP_KDF_CTX* crypto_rt_new_hkdf(EVP_KDF* kdf, int mode) {
+    EVP_KDF_CTX* k = EVP_KDF_CTX_new(kdf);
+    OSSL_PARAM p[4], *q = p;
+    *q++ = OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST, (char*)"SHA256", 0);
+    *q++ = OSSL_PARAM_construct_int(OSSL_KDF_PARAM_MODE, &mode);
+    if (crypto_rt_offloaded()) {
+        *q++ = OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_PROPERTIES, g_crypto_rt_propq, 0);
+    }
+    *q = OSSL_PARAM_construct_end();
+    if (k && EVP_KDF_CTX_set_params(k, p) != 1) { EVP_KDF_CTX_free(k); k = NULL; }
+    return k;
+}
+
+static void crypto_rt_cleanup(void) {
+    EVP_KDF_CTX_free(g_crypto_rt.hkdf_extract);
+    EVP_KDF_CTX_free(g_crypto_rt.hkdf_expand);
+    EVP_KDF_free(g_crypto_rt.hkdf);
+    EVP_MD_free(g_crypto_rt.md);
+    for (int i = 1; i <= APP_SUITE_COUNT; i++) EVP_CIPHER_free(g_crypto_rt.suites[i]);
+    memset(&g_crypto_rt, 0, sizeof(g_crypto_rt));
+}
+
+static int crypto_rt_has_suite(int id) {
+    if (!g_crypto_rt.ready) return id == APP_SUITE;
+    return id >= 1 && id <= APP_SUITE_COUNT && g_crypto_rt.suites[id] != NULL;
+}
+
+// Replace the preference order with a comma separated list of suite tags
+// ("chacha20,aes256gcm"). Call after crypto_rt_init() and before threads
+// start. returns 1 on success, 0 on an unknown or unavailable suite.
+static int crypto_rt_set_prefer(const char* list) {
+    int ids[APP_SUITE_COUNT], n = 0;
+    while (*list) {
+        const char* end = strchr(list, ',');
+        size_t len = end ? (size_t)(end - list) : strlen(list);
+        int id = app_suite_by_tag(list, len);
+        if (!id || !crypto_rt_has_suite(id) || n == APP_SUITE_COUNT) return 0;
+        for (int i = 0; i < n; i++) if (ids[i] == id) return 0;
+        ids[n++] = id;
+        list += len + (end ? 1 : 0);
+    }
+    if (n == 0 || !g_crypto_rt.ready) return 0;
+    memcpy(g_crypto_rt.prefer, ids, sizeof(int) * (size_t)n);
+    g_crypto_rt.nprefer = n;
+    return 1;
+}
+
+// Not thread-safe; call once before any worker starts. returns 1 on success, 0 on failure.
+static int crypto_rt_init(void) {
+    if (g_crypto_rt.ready) return 1;
+    for (int i = 0; i < APP_SUITE_COUNT; i++) {
+        const app_suite_info* si = &k_app_suites[i];
+        EVP_CIPHER* c = app_suite_fits(si) ? EVP_CIPHER_fetch(NULL, si->name, crypto_rt_propq()) : NULL;
+        if (c && EVP_CIPHER_get_key_length(c) != APP_KEY_LEN) { EVP_CIPHER_free(c); c = NULL; }
+        g_crypto_rt.suites[si->id] = c;
+    }
+    g_crypto_rt.aead = g_crypto_rt.suites[APP_SUITE];
+    g_crypto_rt.md   = EVP_MD_fetch(NULL, "SHA256", crypto_rt_propq());
+    g_crypto_rt.hkdf = EVP_KDF_fetch(NULL, "HKDF", crypto_rt_propq());
+    if (!g_crypto_rt.aead || !g_crypto_rt.md || !g_crypto_rt.hkdf) goto err;
+    g_crypto_rt.hkdf_extract = crypto_rt_new_hkdf(g_crypto_rt.hkdf, EVP_KDF_HKDF_MODE_EXTRACT_ONLY);
+    g_crypto_rt.hkdf_expand  = crypto_rt_new_hkdf(g_crypto_rt.hkdf, EVP_KDF_HKDF_MODE_EXPAND_ONLY);
+    if (!g_crypto_rt.hkdf_extract || !g_crypto_rt.hkdf_expand) goto err;
+
+    static const int order_aes[]    = { APP_SUITE_AES_256_GCM, APP_SUITE_AES_128_GCM, APP_SUITE_CHACHA20_POLY1305 };
+    static const int order_no_aes[] = { APP_SUITE_CHACHA20_POLY1305, APP_SUITE_AES_256_GCM, APP_SUITE_AES_128_GCM };
+    const int* order = crypto_rt_cpu_has_aes() ? order_aes : order_no_aes;
+    for (int i = 0; i < 3; i++) {
+        if (g_crypto_rt.suites[order[i]]) g_crypto_rt.prefer[g_crypto_rt.nprefer++] = order[i];
+    }
+    g_crypto_rt.ready = 1;
+    return 1;
+err:
+    crypto_rt_cleanup();
+    return 0;
+}
+
+static const EVP_CIPHER* crypto_rt_aead(void) {
+    return g_crypto_rt.ready ? g_crypto_rt.aead : APP_AEAD_EVP();
+}
+
+// Cipher for a suite id, NULL if it is not available. Without crypto_rt_init()
+// only the build default exists.
+static const EVP_CIPHER* crypto_rt_cipher(int id) {
+    if (!g_crypto_rt.ready) return id == APP_SUITE ? APP_AEAD_EVP() : NULL;
+    return crypto_rt_has_suite(id) ? g_crypto_rt.suites[id] : NULL;
+}
+
+// Most preferred suite of this process.
+static int crypto_rt_best_suite(void) {
+    return g_crypto_rt.ready && g_crypto_rt.nprefer > 0 ? g_crypto_rt.prefer[0] : APP_SUITE;
+}
+
+static const EVP_MD* crypto_rt_md(void) {
+    return g_crypto_rt.ready ? g_crypto_rt.md : EVP_sha256();
+}
+
+// New HKDF context in the given mode: a dup of the cached template, or a
+// one-off fetch when the runtime is not initialized. Providers without HKDF
+// dup support (OpenSSL 3.0) get a fresh context from the cached EVP_KDF.
+static EVP_KDF_CTX* crypto_rt_hkdf(int mode) {
+    if (g_crypto_rt.ready) {
+        EVP_KDF_CTX* k = EVP_KDF_CTX_dup(mode == EVP_KDF_HKDF_MODE_EXTRACT_ONLY ? g_crypto_rt.hkdf_extract
+                                                                                : g_crypto_rt.hkdf_expand);
+        return k ? k : crypto_rt_new_hkdf(g_crypto_rt.hkdf, mode);
+    }
+    EVP_KDF* kdf = EVP_KDF_fetch(NULL, "HKDF", crypto_rt_propq());
+    if (!kdf) return NULL;
+    EVP_KDF_CTX* k = crypto_rt_new_hkdf(kdf, mode);
+    EVP_KDF_free(kdf);
+    return k;
+}
+
+// ---- Keyed AEAD context ----------------------------------------------
+// One EVP_CIPHER_CTX per key. The key schedule is expanded once in
+// aead_ctx_init(); each record only re-arms the context with a new nonce.
+// After aead_ctx_set_iv() the context also owns a per-direction nonce
+// sequence (see aead_ctx_seal_next / aead_ctx_open_next).
+typedef struct {
+    EVP_CIPHER_CTX* ctx;
+    unsigned char iv[APP_IV_LEN];   // fixed per-direction prefix (HKDF output)
+    uint64_t seq;                   // next record number
+    int has_iv;
+    int suite;                      // APP_SUITE_*; later epochs keep it
+    void* mb;                       // hybrid_mb.h key schedule, NULL = EVP only
+    uint64_t log_id;                // record sink stream (set after init), 0 = not logged
+} aead_ctx;
+
+#define AEAD_MB_KEY_SIZE 320        // 15 AES-256 round keys + 4 GHASH key powers
+
+// Key a context for the given suite. returns 1 on success, 0 on failure
+// (including a suite this process does not have).
+static int aead_ctx_init_suite(aead_ctx* a, int suite, const unsigned char* key) {
+    memset(a, 0, sizeof(*a));
+    const EVP_CIPHER* c = crypto_rt_cipher(suite);
+    if (!c) return 0;
+    a->ctx = EVP_CIPHER_CTX_new();
+    if (!a->ctx) return 0;
+    a->suite = suite;
+
+    if (EVP_CipherInit_ex(a->ctx, c, NULL, NULL, NULL, 1) != 1) goto err;
+#if APP_IV_LEN != 12
+    if (EVP_CIPHER_CTX_ctrl(a->ctx, EVP_CTRL_AEAD_SET_IVLEN, APP_IV_LEN, NULL) != 1) goto err;
+#endif
+    if (EVP_CipherInit_ex(a->ctx, NULL, NULL, key, NULL, 1) != 1) goto err;
+    return 1;
+err:
+    EVP_CIPHER_CTX_free(a->ctx);
+    a->ctx = NULL;
+    return 0;
+}
+
+// Build default suite (APP_SUITE). returns 1 on success, 0 on failure.
+static int aead_ctx_init(aead_ctx* a, const unsigned char* key) {
+    return aead_ctx_init_suite(a, APP_SUITE, key);
+}
+
+static void aead_ctx_free(aead_ctx* a) {
+    if (a->ctx) EVP_CIPHER_CTX_free(a->ctx);
+    a->ctx = NULL;
+    if (a->mb) {
+        OPENSSL_cleanse(a->mb, AEAD_MB_KEY_SIZE);
+        free(a->mb);
+        a->mb = NULL;
+    }
+    OPENSSL_cleanse(a->iv, sizeof(a->iv));
+    a->has_iv = 0;
+}
+
+// Arm the nonce sequence: record n uses iv XOR n. Resets the counter.
+static void aead_ctx_set_iv(aead_ctx* a, const unsigned char* iv12) {
+    memcpy(a->iv, iv12, APP_IV_LEN);
+    a->seq = 0;
+    a->has_iv = 1;
+}
+
+// out12 = iv12 XOR seq (seq as 64-bit big endian in the last 8 bytes, TLS 1.3 style)
+static void aead_nonce_xor(const unsigned char* iv12, uint64_t seq, unsigned char* out12) {
+    memcpy(out12, iv12, APP_IV_LEN);
+    for (int i = 0; i < 8; i++) out12[APP_IV_LEN - 1 - i] ^= (unsigned char)(seq >> (8 * i));
+}
+
+// ---- Observer hook ------------------------------------------------------
+// Optional per-record timing callback (hybrid_metrics.h installs one). While
+// it is NULL, seal/open pay one predictable branch and read no clock.
+// Set it before threads start. op is 0 for seal, 1 for open.
+typedef void (*aead_observer_fn)(int op, int bytes, int ok, uint64_t ns);
+
+static aead_observer_fn g_aead_observer;
+
+// ---- Record sink -------------------------------------------------------
+// Optional copy of every sealed frame of a stream whose context has a
+// log_id (hybrid_reclog.h installs one for the audit log). The frame is
+// hdr || ct || tag exactly as sent; counter is the record number that made
+// its nonce and epoch the stream epoch of its key. A sink may be called from
+// several threads at once. When it fails the seal fails, so nothing goes out
+// unlogged. Set it before threads start.
+typedef int (*aead_record_sink_fn)(uint64_t stream, uint32_t epoch, uint64_t counter,
+                                   const unsigned char* frame, int len);
+
+static aead_record_sink_fn g_aead_record_sink;
+
+// returns 1 if the frame was logged or needs no logging, 0 on failure.
+static int aead_record_log(const aead_ctx* a, uint32_t epoch, uint64_t counter,
+                           const unsigned char* frame, int len) {
+    return !a->log_id || !g_aead_record_sink || g_aead_record_sink(a->log_id, epoch, counter, frame, len);
+}
+
+static uint64_t aead_clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int aead_ctx_seal_raw(aead_ctx* a,
+                         const unsigned char* aad, int aadlen,
+                         const unsigned char* nonce12,
+                         const unsigned char* pt, int ptlen,
+                         unsigned char* out_ct, int* outlen) {
     int len = 0, c_len = 0;
-    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-    if (!ctx) return 0;
 
-    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL) != 1) { EVP_CIPHER_CTX_free(ctx); return 0; }
-    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, APP_IV_LEN, NULL) != 1) { EVP_CIPHER_CTX_free(ctx); return 0; }
-    if (EVP_EncryptInit_ex(ctx, NULL, NULL, key, nonce12) != 1) { EVP_CIPHER_CTX_free(ctx); return 0; }
+    if (EVP_CipherInit_ex(a->ctx, NULL, NULL, NULL, nonce12, 1) != 1) return 0;
 
     if (aad && aadlen > 0) {
-        if (EVP_EncryptUpdate(ctx, NULL, &len, aad, aadlen) != 1) { EVP_CIPHER_CTX_free(ctx); return 0; }
+        if (EVP_EncryptUpdate(a->ctx, NULL, &len, aad, aadlen) != 1) return 0;
     }
-    if (EVP_EncryptUpdate(ctx, out_ct, &len, pt, ptlen) != 1) { EVP_CIPHER_CTX_free(ctx); return 0; }
+    if (EVP_EncryptUpdate(a->ctx, out_ct, &len, pt, ptlen) != 1) return 0;
     c_len = len;
 
-    if (EVP_EncryptFinal_ex(ctx, out_ct + c_len, &len) != 1) { EVP_CIPHER_CTX_free(ctx); return 0; }
+    if (EVP_EncryptFinal_ex(a->ctx, out_ct + c_len, &len) != 1) return 0;
     c_len += len;
 
-    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, APP_TAG_LEN, out_ct + c_len) != 1) { EVP_CIPHER_CTX_free(ctx); return 0; }
+    if (EVP_CIPHER_CTX_ctrl(a->ctx, EVP_CTRL_AEAD_GET_TAG, APP_TAG_LEN, out_ct + c_len) != 1) return 0;
     c_len += APP_TAG_LEN;
 
-    EVP_CIPHER_CTX_free(ctx);
     if (outlen) *outlen = c_len;
     return 1;
 }
 
-// AEAD decrypt: input ct includes tag at tail (last 16 bytes).
-// out_pt receives plaintext. returns 1 on success, 0 on failure.
-static int aead_decrypt(const unsigned char* key,
-                        const unsigned char* aad, int aadlen,
-                        const unsigned char* nonce12,
-                        const unsigned char* ct, int ctlen,
-                        unsigned char* out_pt, int* outlen) {
+static int aead_ctx_open_raw(aead_ctx* a,
+                         const unsigned char* aad, int aadlen,
+                         const unsigned char* nonce12,
+                         const unsigned char* ct, int ctlen,
+                         unsigned char* out_pt, int* outlen) {
     if (ctlen < APP_TAG_LEN) return 0;
 
     int ptlen = 0, len = 0;
     const unsigned char* tag = ct + (ctlen - APP_TAG_LEN);
     int clen_wo_tag = ctlen - APP_TAG_LEN;
 
-    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-    if (!ctx) return 0;
-
-    if (EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL) != 1) { EVP_CIPHER_CTX_free(ctx); return 0; }
-    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, APP_IV_LEN, NULL) != 1) { EVP_CIPHER_CTX_free(ctx); return 0; }
-    if (EVP_DecryptInit_ex(ctx, NULL, NULL, key, nonce12) != 1) { EVP_CIPHER_CTX_free(ctx); return 0; }
+    if (EVP_CipherInit_ex(a->ctx, NULL, NULL, NULL, nonce12, 0) != 1) return 0;
 
     if (aad && aadlen > 0) {
-        if (EVP_DecryptUpdate(ctx, NULL, &len, aad, aadlen) != 1) { EVP_CIPHER_CTX_free(ctx); return 0; }
+        if (EVP_DecryptUpdate(a->ctx, NULL, &len, aad, aadlen) != 1) return 0;
     }
-    if (EVP_DecryptUpdate(ctx, out_pt, &len, ct, clen_wo_tag) != 1) { EVP_CIPHER_CTX_free(ctx); return 0; }
+    if (EVP_DecryptUpdate(a->ctx, out_pt, &len, ct, clen_wo_tag) != 1) return 0;
     ptlen = len;
 
-    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, APP_TAG_LEN, (void*)tag) != 1) { EVP_CIPHER_CTX_free(ctx); return 0; }
+    if (EVP_CIPHER_CTX_ctrl(a->ctx, EVP_CTRL_AEAD_SET_TAG, APP_TAG_LEN, (void*)tag) != 1) return 0;
 
     // Returns 1 only if tag is valid.
-    int ok = EVP_DecryptFinal_ex(ctx, out_pt + ptlen, &len);
-    EVP_CIPHER_CTX_free(ctx);
-    if (ok <= 0) return 0;
+    if (EVP_DecryptFinal_ex(a->ctx, out_pt + ptlen, &len) <= 0) return 0;
 
     ptlen += len;
     if (outlen) *outlen = ptlen;
     return 1;
 }
 
+// Seal one record: out_ct = ciphertext || tag(APP_TAG_LEN)
+// returns 1 on success, 0 on failure.
+static int aead_ctx_seal(aead_ctx* a,
+                         const unsigned char* aad, int aadlen,
+                         const unsigned char* nonce12,
+                         const unsigned char* pt, int ptlen,
+                         unsigned char* out_ct, int* outlen) {
+    if (!g_aead_observer) return aead_ctx_seal_raw(a, aad, aadlen, nonce12, pt, ptlen, out_ct, outlen);
+    uint64_t t0 = aead_clock_ns();
+    int ok = aead_ctx_seal_raw(a, aad, aadlen, nonce12, pt, ptlen, out_ct, outlen);
+    g_aead_observer(0, ptlen, ok, aead_clock_ns() - t0);
+    return ok;
+}
+
+// Open one record: ct includes tag at tail (last APP_TAG_LEN bytes).
+// The context stays usable after a tag failure. returns 1 on success, 0 on failure.
+static int aead_ctx_open(aead_ctx* a,
+                         const unsigned char* aad, int aadlen,
+                         const unsigned char* nonce12,
+                         const unsigned char* ct, int ctlen,
+                         unsigned char* out_pt, int* outlen) {
+    if (!g_aead_observer) return aead_ctx_open_raw(a, aad, aadlen, nonce12, ct, ctlen, out_pt, outlen);
+    uint64_t t0 = aead_clock_ns();
+    int ok = aead_ctx_open_raw(a, aad, aadlen, nonce12, ct, ctlen, out_pt, outlen);
+    g_aead_observer(1, ctlen - APP_TAG_LEN, ok, aead_clock_ns() - t0);
+    return ok;
+}
+
+// ---- Sequenced records (implicit nonce) ---------------------------------
+// Both ends derive the same iv and count records, so no nonce travels on the
+// wire and no RNG call sits on the hot path. The counter only advances on
+// success; a failed open should be treated as fatal for the connection.
+
+// returns 1 on success, 0 on failure (no iv set or sequence exhausted).
+static int aead_ctx_seal_next(aead_ctx* a,
+                              const unsigned char* aad, int aadlen,
+                              const unsigned char* pt, int ptlen,
+                              unsigned char* out_ct, int* outlen) {
+    unsigned char nonce[APP_IV_LEN];
+    if (!a->has_iv || a->seq == UINT64_MAX) return 0;
+    aead_nonce_xor(a->iv, a->seq, nonce);
+    if (!aead_ctx_seal(a, aad, aadlen, nonce, pt, ptlen, out_ct, outlen)) return 0;
+    a->seq++;
+    return 1;
+}
+
+// returns 1 on success, 0 on failure.
+static int aead_ctx_open_next(aead_ctx* a,
+                              const unsigned char* aad, int aadlen,
+                              const unsigned char* ct, int ctlen,
+                              unsigned char* out_pt, int* outlen) {
+    unsigned char nonce[APP_IV_LEN];
+    if (!a->has_iv || a->seq == UINT64_MAX) return 0;
+    aead_nonce_xor(a->iv, a->seq, nonce);
+    if (!aead_ctx_open(a, aad, aadlen, nonce, ct, ctlen, out_pt, outlen)) return 0;
+    a->seq++;
+    return 1;
+}
+
+// ---- Explicit record numbers (anti-replay window) -------------------------
+// For transports that may drop or reorder records, the sender puts the record
+// number on the wire and the receiver opens at iv XOR n. aead_replay is a
+// fixed-size sliding window over the numbers already accepted (RFC 6479
+// style): a ring of 64-bit words indexed by n / 64, so moving the window
+// forward clears whole words instead of shifting the bitmap. Checks and
+// updates are O(1) with constant memory per connection.
+//   n above the highest accepted number: new, the window moves up
+//   n in the window: accepted once, then its bit is set
+//   n below the window: rejected as too old
+// The window covers at least APP_REPLAY_WINDOW - 64 numbers below the top.
+#define APP_REPLAY_WINDOW 1024
+#define APP_REPLAY_WORDS (APP_REPLAY_WINDOW / 64)
+
+typedef struct {
+    uint64_t next;                      // highest accepted number + 1, 0 = none yet
+    uint64_t bits[APP_REPLAY_WORDS];
+} aead_replay;
+
+static void aead_replay_reset(aead_replay* r) {
+    memset(r, 0, sizeof(*r));
+}
+
+// returns 1 if n has not been accepted yet and is not too old, 0 otherwise.
+static int aead_replay_check(const aead_replay* r, uint64_t n) {
+    if (n == UINT64_MAX) return 0;
+    if (n >= r->next) return 1;
+    if ((r->next - 1) / 64 - n / 64 >= APP_REPLAY_WORDS) return 0;   // word already reused
+    return !((r->bits[(n / 64) % APP_REPLAY_WORDS] >> (n % 64)) & 1);
+}
+
+// Mark n as accepted. Call only after aead_replay_check() and a good tag,
+// so forged records never move the window.
+static void aead_replay_update(aead_replay* r, uint64_t n) {
+    if (n >= r->next) {
+        uint64_t from = r->next ? (r->next - 1) / 64 + 1 : 0;   // first word not in use
+        uint64_t to = n / 64;
+        if (to >= from) {
+            uint64_t words = to - from + 1;
+            if (words > APP_REPLAY_WORDS) words = APP_REPLAY_WORDS;
+            for (uint64_t i = 0; i < words; i++) r->bits[(from + i) % APP_REPLAY_WORDS] = 0;
+        }
+        r->next = n + 1;
+    }
+    r->bits[(n / 64) % APP_REPLAY_WORDS] |= (uint64_t)1 << (n % 64);
+}
+
+// Open record number n (nonce = iv XOR n) and reject replays and records
+// older than the window. a->seq is not used or changed.
+// returns 1 on success, 0 on failure (replay, too old, bad tag, no iv set).
+static int aead_ctx_open_at(aead_ctx* a, aead_replay* r, uint64_t n,
+                            const unsigned char* aad, int aadlen,
+                            const unsigned char* ct, int ctlen,
+                            unsigned char* out_pt, int* outlen) {
+    unsigned char nonce[APP_IV_LEN];
+    if (!a->has_iv || !aead_replay_check(r, n)) return 0;
+    aead_nonce_xor(a->iv, n, nonce);
+    if (!aead_ctx_open(a, aad, aadlen, nonce, ct, ctlen, out_pt, outlen)) return 0;
+    aead_replay_update(r, n);
+    return 1;
+}
+
+// ---- One-shot helpers (key schedule per call) ---------------------------
+// Kept for single messages; use aead_ctx for anything that repeats.
+
+// AEAD encrypt: out_ct = ciphertext || tag(APP_TAG_LEN)
+// returns 1 on success, 0 on failure.
+static int aead_encrypt(const unsigned char* key,
+                        const unsigned char* aad, int aadlen,
+                        const unsigned char* nonce12,
+                        const unsigned char* pt, int ptlen,
+                        unsigned char* out_ct, int* outlen) {
+    aead_ctx a;
+    if (!aead_ctx_init(&a, key)) return 0;
+    int ok = aead_ctx_seal(&a, aad, aadlen, nonce12, pt, ptlen, out_ct, outlen);
+    aead_ctx_free(&a);
+    return ok;
+}
+
+// AEAD decrypt: input ct includes tag at tail (last APP_TAG_LEN bytes).
+// out_pt receives plaintext. returns 1 on success, 0 on failure.
+static int aead_decrypt(const unsigned char* key,
+                        const unsigned char* aad, int aadlen,
+                        const unsigned char* nonce12,
+                        const unsigned char* ct, int ctlen,
+                        unsigned char* out_pt, int* outlen) {
+    aead_ctx a;
+    if (!aead_ctx_init(&a, key)) return 0;
+    int ok = aead_ctx_open(&a, aad, aadlen, nonce12, ct, ctlen, out_pt, outlen);
+    aead_ctx_free(&a);
+    return ok;
+}
+
+// ---- Key derivation -----------------------------------------------------
+// HKDF-SHA256 split into its two halves: one Extract per QKD secret gives a
+// PRK that stays in a KDF context; every labelled sub-key (traffic keys, nonce
+// prefixes, rekey secrets) is then a single cheap Expand. Contexts come from
+// the crypto runtime templates, so no provider fetch happens per session.
+//   PRK       = HKDF-Extract(salt="", qkd)
+//   sub-key   = HKDF-Expand(PRK, info=label, len)
+// The output equals one-shot HKDF(qkd, salt="", info=label, len).
+typedef struct {
+    EVP_KDF_CTX* kctx;  // HKDF in EXPAND_ONLY mode, keyed with the PRK
+} key_schedule;
+
+// PRK = HKDF-Extract(salt, secret). returns 1 on success, 0 on failure.
+static int key_schedule_init_salt(key_schedule* ks, const unsigned char* salt, size_t salt_len,
+                                  const unsigned char* secret, size_t secret_len) {
+    unsigned char prk[EVP_MAX_MD_SIZE];
+    size_t prk_len = (size_t)EVP_MD_get_size(crypto_rt_md());
+    int ok = 0;
+    EVP_KDF_CTX* ext = crypto_rt_hkdf(EVP_KDF_HKDF_MODE_EXTRACT_ONLY);
+
+    ks->kctx = crypto_rt_hkdf(EVP_KDF_HKDF_MODE_EXPAND_ONLY);
+    if (!ext || !ks->kctx) goto done;
+
+    OSSL_PARAM p[3];
+    p[0] = OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_KEY, (void*)secret, secret_len);
+    p[1] = OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SALT, (void*)salt, salt_len);
+    p[2] = OSSL_PARAM_construct_end();
+    if (EVP_KDF_derive(ext, prk, prk_len, p) != 1) goto done;
+
+    p[0] = OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_KEY, prk, prk_len);
+    p[1] = OSSL_PARAM_construct_end();
+    if (EVP_KDF_CTX_set_params(ks->kctx, p) != 1) goto done;
+    ok = 1;
+done:
+    OPENSSL_cleanse(prk, sizeof(prk));
+    EVP_KDF_CTX_free(ext);
+    if (!ok) { EVP_KDF_CTX_free(ks->kctx); ks->kctx = NULL; }
+    return ok;
+}
+
+// returns 1 on success, 0 on failure.
+static int key_schedule_init(key_schedule* ks, const unsigned char* secret, size_t secret_len) {
+    return key_schedule_init_salt(ks, (const unsigned char*)"", 0, secret, secret_len);
+}
+
+// out = HKDF-Expand(PRK, info=label, outlen). returns 1 on success, 0 on failure.
+static int key_schedule_expand(key_schedule* ks, const char* label,
+                               unsigned char* out, size_t outlen) {
+    OSSL_PARAM p[2];
+    p[0] = OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_INFO, (void*)label, strlen(label));
+    p[1] = OSSL_PARAM_construct_end();
+    return EVP_KDF_derive(ks->kctx, out, outlen, p) == 1;
+}
+
+// Frees the context; the PRK inside is cleansed by OpenSSL.
+static void key_schedule_free(key_schedule* ks) {
+    EVP_KDF_CTX_free(ks->kctx);
+    ks->kctx = NULL;
+}
+
+// Application keys from the QKD secret. Labels are from the server's view:
+//   tx    = HKDF-SHA256(qkd, salt="", info="stage69 tx",    len=32)   server -> client
+//   rx    = HKDF-SHA256(qkd, salt="", info="stage69 rx",    len=32)   client -> server
+//   tx_iv = HKDF-SHA256(qkd, salt="", info="stage69 tx iv", len=12)
+//   rx_iv = HKDF-SHA256(qkd, salt="", info="stage69 rx iv", len=12)
+// The iv values are the fixed per-direction nonce prefixes (aead_ctx_set_iv).
+// The client passes its buffers swapped: its receive key is "stage69 tx".
+// One Extract, four Expands.
+static int derive_app_keys(const unsigned char* qkd, size_t qkd_len,
+                           unsigned char* tx32, unsigned char* rx32,
+                           unsigned char* tx_iv12, unsigned char* rx_iv12);
+
+// Same, plus the per-direction epoch chain secrets that seed in-band rekeying
+// (see aead_rekey); either chain pointer may be NULL.
+//   tx_chain = HKDF-SHA256(qkd, salt="", info="stage69 tx chain", len=32)
+//   rx_chain = HKDF-SHA256(qkd, salt="", info="stage69 rx chain", len=32)
+#define APP_CHAIN_LEN 32
+
+static int derive_app_keys_chained(const unsigned char* qkd, size_t qkd_len,
+                                   unsigned char* tx32, unsigned char* rx32,
+                                   unsigned char* tx_iv12, unsigned char* rx_iv12,
+                                   unsigned char* tx_chain32, unsigned char* rx_chain32) {
+    key_schedule ks;
+    if (!key_schedule_init(&ks, qkd, qkd_len)) return 0;
+    int ok = key_schedule_expand(&ks, "stage69 tx",    tx32,    APP_KEY_LEN) &&
+             key_schedule_expand(&ks, "stage69 rx",    rx32,    APP_KEY_LEN) &&
+             key_schedule_expand(&ks, "stage69 tx iv", tx_iv12, APP_IV_LEN)  &&
+             key_schedule_expand(&ks, "stage69 rx iv", rx_iv12, APP_IV_LEN)  &&
+             (!tx_chain32 || key_schedule_expand(&ks, "stage69 tx chain", tx_chain32, APP_CHAIN_LEN)) &&
+             (!rx_chain32 || key_schedule_expand(&ks, "stage69 rx chain", rx_chain32, APP_CHAIN_LEN));
+    key_schedule_free(&ks);
+    return ok;
+}
+
+static int derive_app_keys(const unsigned char* qkd, size_t qkd_len,
+                           unsigned char* tx32, unsigned char* rx32,
+                           unsigned char* tx_iv12, unsigned char* rx_iv12) {
+    return derive_app_keys_chained(qkd, qkd_len, tx32, rx32, tx_iv12, rx_iv12, NULL, NULL);
+}
+
+// Next epoch of one direction. The chain secret advances in place; new QKD
+// material is mixed in when there is some (mlen > 0), otherwise it is a plain
+// ratchet. Old epoch keys cannot be recomputed from the new chain.
+//   PRK   = HKDF-Extract(salt=chain, material)
+//   key   = HKDF-Expand(PRK, "stage69 epoch key",   32)
+//   iv    = HKDF-Expand(PRK, "stage69 epoch iv",    12)
+//   chain = HKDF-Expand(PRK, "stage69 epoch chain", 32)
+// returns 1 on success, 0 on failure.
+static int derive_epoch_keys(unsigned char* chain32, const unsigned char* material, size_t mlen,
+                             unsigned char* key32, unsigned char* iv12) {
+    static const unsigned char ratchet[] = "stage69 ratchet";
+    key_schedule ks;
+    if (mlen == 0) { material = ratchet; mlen = sizeof(ratchet) - 1; }
+    if (!key_schedule_init_salt(&ks, chain32, APP_CHAIN_LEN, material, mlen)) return 0;
+    int ok = key_schedule_expand(&ks, "stage69 epoch key",   key32,   APP_KEY_LEN) &&
+             key_schedule_expand(&ks, "stage69 epoch iv",    iv12,    APP_IV_LEN)  &&
+             key_schedule_expand(&ks, "stage69 epoch chain", chain32, APP_CHAIN_LEN);
+    key_schedule_free(&ks);
+    return ok;
+}
+
+// Demo QKD stand-in: both ends export the same secret from the TLS session,
+// since the demo has no QKD link. returns 1 on success, 0 on failure.
+#define QKD_STANDIN_LABEL "EXPORTER-stage69-qkd-standin"
+static int qkd_standin_from_tls(SSL* ssl, unsigned char* out, size_t outlen) {
+    return SSL_export_keying_material(ssl, out, outlen,
+                                      QKD_STANDIN_LABEL, sizeof(QKD_STANDIN_LABEL) - 1,
+                                      NULL, 0, 0) == 1;
+}
+
+// ---- Suite negotiation (TLS ALPN) ---------------------------------------
+// The client offers "stage69-<tag>" for each suite in its preference order
+// and the server picks one during the handshake: no extra round trip, and
+// the choice is covered by the transcript the exporter keys come from. Only
+// suites in the server's preference order are ever picked. A client that
+// lists ChaCha20 first (no AES hardware) gets it if the server allows it;
+// otherwise the server's own order wins. No ALPN on either side means
+// APP_SUITE.
+#define APP_ALPN_PREFIX "stage69-"
+#define APP_ALPN_MAX 128
+
+// Protocol list (ALPN wire format) from the preference order.
+// returns its length, 0 on failure.
+static int app_suite_alpn_list(unsigned char* out, size_t cap) {
+    const size_t pl = sizeof(APP_ALPN_PREFIX) - 1;
+    size_t n = 0;
+    for (int i = 0; i < g_crypto_rt.nprefer; i++) {
+        const char* tag = app_suite_get(g_crypto_rt.prefer[i])->tag;
+        size_t tl = strlen(tag);
+        if (n + 1 + pl + tl > cap) return 0;
+        out[n++] = (unsigned char)(pl + tl);
+        memcpy(out + n, APP_ALPN_PREFIX, pl);
+        memcpy(out + n + pl, tag, tl);
+        n += pl + tl;
+    }
+    return (int)n;
+}
+
+// Suite id of one ALPN protocol name, 0 if it is not ours.
+static int app_suite_from_alpn(const unsigned char* p, size_t len) {
+    const size_t pl = sizeof(APP_ALPN_PREFIX) - 1;
+    if (len <= pl || memcmp(p, APP_ALPN_PREFIX, pl) != 0) return 0;
+    return app_suite_by_tag((const char*)p + pl, len - pl);
+}
+
+// Client: offer our suites. returns 1 on success, 0 on failure.
+static int app_suite_offer(SSL_CTX* ctx) {
+    unsigned char list[APP_ALPN_MAX];
+    int n = app_suite_alpn_list(list, sizeof(list));
+    return n > 0 && SSL_CTX_set_alpn_protos(ctx, list, (unsigned int)n) == 0;
+}
+
+// Server: SSL_CTX_set_alpn_select_cb() callback.
+static int app_suite_alpn_select(SSL* ssl, const unsigned char** out, unsigned char* outlen,
+                                 const unsigned char* in, unsigned int inlen, void* arg) {
+    (void)ssl;
+    (void)arg;
+    const unsigned char* best = NULL;
+    int best_rank = g_crypto_rt.nprefer;
+    for (unsigned int i = 0; i < inlen && i + 1u + in[i] <= inlen; i += 1u + in[i]) {
+        int id = app_suite_from_alpn(in + i + 1, in[i]), rank = 0;
+        while (rank < g_crypto_rt.nprefer && g_crypto_rt.prefer[rank] != id) rank++;
+        if (!id || rank == g_crypto_rt.nprefer) continue;   // not offered by this server
+        // ChaCha20 first means the client has no AES hardware: its speed wins over our order
+        if (i == 0 && id == APP_SUITE_CHACHA20_POLY1305) { best = in; break; }
+        if (rank < best_rank) { best = in + i; best_rank = rank; }
+    }
+    if (!best) return SSL_TLSEXT_ERR_NOACK;
+    *out = best + 1;
+    *outlen = best[0];
+    return SSL_TLSEXT_ERR_OK;
+}
+
+// Suite agreed for this connection; 0 if the peer picked one we lack.
+static int app_suite_negotiated(const SSL* ssl) {
+    const unsigned char* p = NULL;
+    unsigned int len = 0;
+    SSL_get0_alpn_selected(ssl, &p, &len);
+    if (!p || len == 0) return APP_SUITE;
+    int id = app_suite_from_alpn(p, len);
+    return id && crypto_rt_has_suite(id) ? id : 0;
+}
+
+// ---- Streaming record layer ---------------------------------------------
+// Stream  = chunk || chunk || ... || final chunk
+// Chunk   = len(4, big endian, = ct||tag length) || flags(1) || ct || tag(16)
+// Nonce   = the aead_ctx sequence (iv XOR record number), never sent
+// AAD     = stream aad || len(4) || flags(1)
+// The header is authenticated, so a reordered, dropped or truncated stream
+// (missing APP_REC_FINAL) fails. Memory use is one chunk regardless of size.
+//
+// Epochs: a stream with an aead_rekey attached can switch keys in-band. The
+// sender seals an APP_REC_REKEY chunk (payload = the material id from the
+// rekey callback) under the current key, then moves to the next epoch
+// (derive_epoch_keys). Every chunk carries the parity of its epoch in
+// APP_REC_EPOCH. A REKEY chunk states its own record number in clear
+// (authenticated), so it may overtake chunks sealed before it: the receiver
+// switches at once and keeps the previous epoch's context for the old-epoch
+// chunks still in flight, up to that number. REKEY chunks are consumed by
+// the stream and surface to callers as empty records.
+//   REKEY chunk = len(4) || flags(1) || seq(8) || ct(info) || tag(16)
+//   REKEY AAD   = stream aad || len(4) || flags(1) || seq(8)
+
+#define APP_REC_HDR_LEN 5
+#define APP_REC_FINAL 0x01
+#define APP_REC_EPOCH 0x02              // epoch parity of the sealing key
+#define APP_REC_REKEY 0x04              // switch to the next epoch after this chunk
+#define APP_REC_ENVELOPE 0x08           // payload = key || iv || suite(1) of a pre-sealed stream that follows
+#define APP_ENVELOPE_LEN (APP_KEY_LEN + APP_IV_LEN + 1)
+#define APP_REKEY_INFO_MAX 32           // REKEY chunk payload
+#define APP_REKEY_MATERIAL_MAX 128
+#define APP_REKEY_SEQ_LEN 8
+#define APP_REKEY_FRAME_LEN (APP_REC_HDR_LEN + APP_REKEY_SEQ_LEN + APP_REKEY_INFO_MAX + APP_TAG_LEN)
+#define APP_STREAM_CHUNK 16384          // max plaintext per chunk
+#define APP_STREAM_AAD_MAX 64
+#define APP_STREAM_FRAME_MAX (APP_REC_HDR_LEN + APP_STREAM_CHUNK + APP_TAG_LEN)
+_Static_assert(APP_BUF_SIZE >= APP_STREAM_FRAME_MAX, "pool buffers must hold a full frame");
+
+// Stream AAD used by the Stage69 server and client.
+static const unsigned char APP_AAD[] = "Stage69-AAD";
+// Request/response streams that follow the server hello on the same
+// connection: client requests under the client->server key, server replies
+// continuing the server->client sequence. Each request gets one reply; the
+// FINAL request gets the FINAL reply.
+static const unsigned char APP_RPC_AAD[] = "Stage69-RPC";
+
+static void aead_rec_put_hdr(unsigned char* hdr, int ctlen, unsigned char flags) {
+    hdr[0] = (unsigned char)(ctlen >> 24);
+    hdr[1] = (unsigned char)(ctlen >> 16);
+    hdr[2] = (unsigned char)(ctlen >> 8);
+    hdr[3] = (unsigned char)ctlen;
+    hdr[4] = flags;
+}
+
+// Parse a chunk header. returns 1 if the length is within [tag, max frame], 0 otherwise.
+static int aead_rec_get_hdr(const unsigned char* hdr, int* ctlen, unsigned char* flags) {
+    uint32_t n = ((uint32_t)hdr[0] << 24) | ((uint32_t)hdr[1] << 16) |
+                 ((uint32_t)hdr[2] << 8) | (uint32_t)hdr[3];
+    if (n < APP_TAG_LEN || n > APP_STREAM_CHUNK + APP_TAG_LEN) return 0;
+    *ctlen = (int)n;
+    *flags = hdr[4];
+    return 1;
+}
+
+// Rekey material source, called once per epoch switch on each side.
+// enc=1 (sender): write up to APP_REKEY_INFO_MAX bytes of info (sent in the
+// REKEY chunk, e.g. a QKD key id) and the material it names.
+// enc=0 (receiver): info/infolen are what the sender wrote; fill material.
+// *mlen may be left 0 for a ratchet without new material. At most
+// APP_REKEY_MATERIAL_MAX bytes. returns 1 on success, 0 on failure.
+typedef int (*aead_rekey_fn)(void* arg, int enc, unsigned char* info, int* infolen,
+                             unsigned char* material, size_t* mlen);
+
+typedef struct {
+    aead_rekey_fn fn;
+    void* arg;
+    unsigned char chain[APP_CHAIN_LEN]; // this direction's chain (derive_app_keys_chained)
+    uint64_t every;                     // sender: rekey after this many chunks, 0 = manual
+} aead_rekey;
+
+typedef struct {
+    aead_ctx* a;    // must have an iv set; chunks consume its sequence
+    unsigned char aad[APP_STREAM_AAD_MAX + APP_REC_HDR_LEN + APP_REKEY_SEQ_LEN];
+    int aadlen;     // caller part; the chunk header follows it
+    int done;       // final chunk sealed / opened
+    // epochs (only used once aead_stream_set_rekey() was called)
+    aead_rekey rk;
+    int has_rk;
+    uint32_t epoch;
+    uint64_t since;     // chunks sealed in this epoch
+    aead_ctx* prev;     // previous epoch (receiver side), NULL if none
+    uint64_t prev_end;  // prev opens record numbers below this (its REKEY chunk)
+    aead_ctx own[2];    // contexts of epochs >= 1, indexed by parity
+} aead_stream;
+
+// returns 1 on success, 0 if a has no iv or aad is longer than APP_STREAM_AAD_MAX.
+static int aead_stream_init(aead_stream* s, aead_ctx* a,
+                            const unsigned char* aad, int aadlen) {
+    if (!a->has_iv || aadlen < 0 || aadlen > APP_STREAM_AAD_MAX) return 0;
+    memset(s, 0, sizeof(*s));
+    s->a = a;
+    if (aadlen > 0) memcpy(s->aad, aad, aadlen);
+    s->aadlen = aadlen;
+    return 1;
+}
+
+// Enable in-band rekeying. The chain is copied. returns 1.
+static int aead_stream_set_rekey(aead_stream* s, const aead_rekey* rk) {
+    s->rk = *rk;
+    s->has_rk = 1;
+    return 1;
+}
+
+// Frees the contexts the stream created for later epochs. The caller's
+// epoch 0 context is left alone.
+static void aead_stream_free(aead_stream* s) {
+    aead_ctx_free(&s->own[0]);
+    aead_ctx_free(&s->own[1]);
+    OPENSSL_cleanse(&s->rk, sizeof(s->rk));
+    s->a = s->prev = NULL;
+}
+
+// Move to the next epoch with the given material. The old context becomes prev;
+// the one before it is freed. returns 1 on success, 0 on failure.
+static int aead_stream_next_epoch(aead_stream* s, const unsigned char* material, size_t mlen) {
+    unsigned char key[APP_KEY_LEN], iv[APP_IV_LEN];
+    aead_ctx* next = &s->own[(s->epoch + 1) & 1];
+    int ok = 0;
+
+    if (s->epoch == UINT32_MAX) return 0;
+    if (!derive_epoch_keys(s->rk.chain, material, mlen, key, iv)) goto done;
+    aead_ctx_free(next);
+    if (!aead_ctx_init_suite(next, s->a->suite, key)) goto done;
+    aead_ctx_set_iv(next, iv);
+    next->log_id = s->a->log_id;
+    s->prev = s->a;
+    s->prev_end = s->a->seq;
+    s->a = next;
+    s->epoch++;
+    s->since = 0;
+    ok = 1;
+done:
+    OPENSSL_cleanse(key, sizeof(key));
+    OPENSSL_cleanse(iv, sizeof(iv));
+    return ok;
+}
+
+static unsigned char aead_stream_epoch_flag(const aead_stream* s) {
+    return (s->epoch & 1) ? APP_REC_EPOCH : 0;
+}
+
+// Sender: seal a REKEY chunk into out_frame (APP_REKEY_FRAME_LEN bytes) and
+// switch to the next epoch. The frame must go out before any chunk sealed
+// after this call; it may go ahead of chunks sealed before it.
+// returns 1 on success, 0 on failure.
+static int aead_stream_rekey(aead_stream* s, unsigned char* out_frame, int* outlen) {
+    unsigned char info[APP_REKEY_INFO_MAX];
+    unsigned char material[APP_REKEY_MATERIAL_MAX];
+    int infolen = 0, ctlen = 0, ok = 0;
+    size_t mlen = 0;
+
+    if (!s->has_rk || s->done) return 0;
+    if (!s->rk.fn(s->rk.arg, 1, info, &infolen, material, &mlen) ||
+        infolen < 0 || infolen > APP_REKEY_INFO_MAX || mlen > sizeof(material)) goto done;
+
+    unsigned char* hdr = s->aad + s->aadlen;
+    unsigned char* seq = hdr + APP_REC_HDR_LEN;
+    aead_rec_put_hdr(hdr, APP_REKEY_SEQ_LEN + infolen + APP_TAG_LEN,
+                     APP_REC_REKEY | aead_stream_epoch_flag(s));
+    for (int i = 0; i < APP_REKEY_SEQ_LEN; i++) seq[i] = (unsigned char)(s->a->seq >> (56 - 8 * i));
+    if (!aead_ctx_seal_next(s->a, s->aad, s->aadlen + APP_REC_HDR_LEN + APP_REKEY_SEQ_LEN,
+                            info, infolen, out_frame + APP_REC_HDR_LEN + APP_REKEY_SEQ_LEN,
+                            &ctlen)) goto done;
+    memcpy(out_frame, hdr, APP_REC_HDR_LEN + APP_REKEY_SEQ_LEN);
+    if (!aead_record_log(s->a, s->epoch, s->a->seq - 1, out_frame,
+                         APP_REC_HDR_LEN + APP_REKEY_SEQ_LEN + ctlen)) goto done;
+    if (!aead_stream_next_epoch(s, material, mlen)) goto done;
+    if (outlen) *outlen = APP_REC_HDR_LEN + APP_REKEY_SEQ_LEN + ctlen;
+    ok = 1;
+done:
+    OPENSSL_cleanse(material, sizeof(material));
+    return ok;
+}
+
+// Sender: whether the automatic rekey interval (aead_rekey.every) is reached.
+static int aead_stream_rekey_due(const aead_stream* s) {
+    return s->has_rk && s->rk.every && s->since >= s->rk.every;
+}
+
+// out_frame = hdr(5) || ct || tag; needs APP_REC_HDR_LEN + ptlen + APP_TAG_LEN bytes.
+// flags may hold APP_REC_FINAL and APP_REC_ENVELOPE. returns 1 on success, 0 on failure.
+static int aead_stream_seal_chunk_flags(aead_stream* s, const unsigned char* pt, int ptlen,
+                                        unsigned char flags, unsigned char* out_frame, int* outlen) {
+    if (s->done || ptlen < 0 || ptlen > APP_STREAM_CHUNK ||
+        (flags & ~(APP_REC_FINAL | APP_REC_ENVELOPE))) return 0;
+    int final = flags & APP_REC_FINAL;
+
+    unsigned char* hdr = s->aad + s->aadlen;
+    aead_rec_put_hdr(hdr, ptlen + APP_TAG_LEN, flags | aead_stream_epoch_flag(s));
+
+    int ctlen = 0;
+    if (!aead_ctx_seal_next(s->a, s->aad, s->aadlen + APP_REC_HDR_LEN,
+                            pt, ptlen, out_frame + APP_REC_HDR_LEN, &ctlen)) return 0;
+    memcpy(out_frame, hdr, APP_REC_HDR_LEN);
+    if (!aead_record_log(s->a, s->epoch, s->a->seq - 1, out_frame, APP_REC_HDR_LEN + ctlen)) return 0;
+
+    s->since++;
+    if (final) s->done = 1;
+    if (outlen) *outlen = APP_REC_HDR_LEN + ctlen;
+    return 1;
+}
+
+static int aead_stream_seal_chunk(aead_stream* s, const unsigned char* pt, int ptlen, int final,
+                                  unsigned char* out_frame, int* outlen) {
+    return aead_stream_seal_chunk_flags(s, pt, ptlen, final ? APP_REC_FINAL : 0, out_frame, outlen);
+}
+
+// Receiver side of a REKEY chunk (ct = seq || ct || tag); the stream aad
+// already ends with its header. Opens it at its stated record number and
+// moves to the next epoch. returns 1 on success, 0 on failure.
+static int aead_stream_open_rekey(aead_stream* s, const unsigned char* ct, int ctlen) {
+    unsigned char info[APP_REKEY_INFO_MAX];
+    unsigned char material[APP_REKEY_MATERIAL_MAX];
+    unsigned char nonce[APP_IV_LEN];
+    int infolen = 0, ok = 0;
+    size_t mlen = 0;
+    uint64_t seq = 0;
+
+    if (!s->has_rk || ctlen < APP_REKEY_SEQ_LEN + APP_TAG_LEN ||
+        ctlen > APP_REKEY_SEQ_LEN + APP_REKEY_INFO_MAX + APP_TAG_LEN) return 0;
+    for (int i = 0; i < APP_REKEY_SEQ_LEN; i++) seq = (seq << 8) | ct[i];
+    if (seq < s->a->seq || seq == UINT64_MAX) return 0;
+
+    memcpy(s->aad + s->aadlen + APP_REC_HDR_LEN, ct, APP_REKEY_SEQ_LEN);
+    aead_nonce_xor(s->a->iv, seq, nonce);
+    if (!aead_ctx_open(s->a, s->aad, s->aadlen + APP_REC_HDR_LEN + APP_REKEY_SEQ_LEN, nonce,
+                       ct + APP_REKEY_SEQ_LEN, ctlen - APP_REKEY_SEQ_LEN, info, &infolen)) goto done;
+    if (!s->rk.fn(s->rk.arg, 0, info, &infolen, material, &mlen) || mlen > sizeof(material)) goto done;
+
+    // Old-epoch chunks numbered below seq may still arrive; the rest of the
+    // old sequence is used up.
+    uint64_t in_flight = s->a->seq;
+    s->a->seq = seq;
+    if (!aead_stream_next_epoch(s, material, mlen)) goto done;
+    s->prev->seq = in_flight;
+    ok = 1;
+done:
+    OPENSSL_cleanse(info, sizeof(info));
+    OPENSSL_cleanse(material, sizeof(material));
+    return ok;
+}
+
+// hdr = the 5 header bytes, ct = ct||tag of the length given in hdr.
+// *final is set when this was the last chunk. A REKEY chunk switches epochs
+// and reports *outlen = 0. returns 1 on success, 0 on failure.
+static int aead_stream_open_chunk(aead_stream* s, const unsigned char* hdr,
+                                  const unsigned char* ct, int ctlen,
+                                  unsigned char* out_pt, int* outlen, int* final) {
+    int n = 0, ptlen = 0;
+    unsigned char flags = 0;
+    if (s->done || !aead_rec_get_hdr(hdr, &n, &flags) || n != ctlen) return 0;
+
+    memcpy(s->aad + s->aadlen, hdr, APP_REC_HDR_LEN);
+
+    // Chunks of the previous epoch may still follow a switch.
+    int cur = (flags & APP_REC_EPOCH) == aead_stream_epoch_flag(s);
+    if (flags & APP_REC_REKEY) {
+        if (!cur || (flags & APP_REC_FINAL) || !aead_stream_open_rekey(s, ct, ctlen)) return 0;
+    } else {
+        aead_ctx* a = cur ? s->a : s->prev;
+        if (!a || (!cur && a->seq >= s->prev_end)) return 0;
+        if (!aead_ctx_open_next(a, s->aad, s->aadlen + APP_REC_HDR_LEN,
+                                ct, ctlen, out_pt, &ptlen)) return 0;
+    }
+
+    if (outlen) *outlen = ptlen;
+    if (flags & APP_REC_FINAL) s->done = 1;
+    if (final) *final = s->done;
+    return 1;
+}
+
+// ---- Batched in-place records -------------------------------------------
+// Each record buffer reserves APP_REC_HDR_LEN bytes of headroom and
+// APP_TAG_LEN bytes of tailroom around the plaintext:
+//   base -> [ hdr(5) ][ plaintext (len) ][ tag(16) ]
+// Sealing rewrites the plaintext with ciphertext in place and fills in the
+// header and tag, so records laid out back to back in one buffer can go to a
+// single SSL_write (or one iovec each to writev) without any copy.
+
+#define APP_REC_OVERHEAD (APP_REC_HDR_LEN + APP_TAG_LEN)
+#define APP_REC_PAYLOAD(base) ((base) + APP_REC_HDR_LEN)
+#define APP_REC_FLAGS(base) ((base)[APP_REC_HDR_LEN - 1])   // still readable after open
+
+typedef struct {
+    unsigned char* base;    // start of headroom
+    int len;                // plaintext length in, plaintext length after open
+} aead_rec;
+
+// Sealed size of a record carrying ptlen bytes.
+static int aead_rec_frame_len(int ptlen) {
+    return APP_REC_OVERHEAD + ptlen;
+}
+
+// Seal n records in place as consecutive stream chunks. final marks the last
+// one with APP_REC_FINAL. *total receives the sum of frame sizes.
+// returns 1 on success, 0 on failure (records before the failing one are sealed).
+static int aead_stream_seal_batch(aead_stream* s, aead_rec* recs, int n, int final, int* total) {
+    int sum = 0;
+    for (int i = 0; i < n; i++) {
+        int flen = 0;
+        if (!aead_stream_seal_chunk(s, APP_REC_PAYLOAD(recs[i].base), recs[i].len,
+                                    final && i == n - 1, recs[i].base, &flen)) return 0;
+        sum += flen;
+    }
+    if (total) *total = sum;
+    return 1;
+}
+
+// Open every complete frame at the front of buf in place. recs[i].base points
+// at each frame and recs[i].len is set to its plaintext length; plaintext
+// lives at APP_REC_PAYLOAD(base). Stops at a partial frame, after max records
+// or after the final chunk. *consumed = bytes used, so the caller can keep the
+// tail for the next read. returns the number of records opened, -1 on failure.
+static int aead_stream_open_batch(aead_stream* s, unsigned char* buf, int len,
+                                  aead_rec* recs, int max, int* consumed) {
+    int off = 0, n = 0;
+    while (n < max && !s->done && len - off >= APP_REC_HDR_LEN) {
+        int ctlen = 0, ptlen = 0;
+        unsigned char flags = 0;
+        unsigned char* f = buf + off;
+        if (!aead_rec_get_hdr(f, &ctlen, &flags)) return -1;
+        if (len - off < APP_REC_HDR_LEN + ctlen) break;
+        if (!aead_stream_open_chunk(s, f, APP_REC_PAYLOAD(f), ctlen,
+                                    APP_REC_PAYLOAD(f), &ptlen, NULL)) return -1;
+        recs[n].base = f;
+        recs[n].len = ptlen;
+        n++;
+        off += APP_REC_HDR_LEN + ctlen;
+    }
+    if (consumed) *consumed = off;
+    return n;
+}
+
+// I/O callbacks for the whole-stream helpers.
+// read: returns bytes read (may be short), 0 on EOF, <0 on error.
+// write: writes all len bytes, returns 1 on success, 0 on failure.
+typedef int (*aead_read_fn)(void* io, unsigned char* buf, int len);
+typedef int (*aead_write_fn)(void* io, const unsigned char* buf, int len);
+
+// Read up to len bytes, retrying short reads. returns bytes read, <0 on error.
+static int aead_read_full(aead_read_fn rd, void* io, unsigned char* buf, int len) {
+    int got = 0;
+    while (got < len) {
+        int r = rd(io, buf + got, len - got);
+        if (r < 0) return -1;
+        if (r == 0) break;
+        got += r;
+    }
+    return got;
+}
+
+// Encrypt everything rd yields into a stream written chunk by chunk to wr.
+// a must have an iv set. rk (may be NULL) enables rekeying every rk->every
+// chunks. returns 1 on success, 0 on failure.
+static int aead_encrypt_stream(aead_ctx* a, const unsigned char* aad, int aadlen,
+                               aead_read_fn rd, void* rd_io,
+                               aead_write_fn wr, void* wr_io,
+                               const aead_rekey* rk) {
+    unsigned char* frame;
+    aead_stream s;
+    int ok = 0;
+
+    if (!aead_stream_init(&s, a, aad, aadlen) || !(frame = app_buf_get())) return 0;
+    if (rk) aead_stream_set_rekey(&s, rk);
+
+    // Read straight into the payload slot and seal in place.
+    // A short read means EOF; a full chunk may be followed by an empty final one.
+    while (!s.done) {
+        if (aead_stream_rekey_due(&s)) {
+            int flen = 0;
+            if (!aead_stream_rekey(&s, frame, &flen) || !wr(wr_io, frame, flen)) goto done;
+        }
+        aead_rec r = { frame, 0 };
+        r.len = aead_read_full(rd, rd_io, APP_REC_PAYLOAD(frame), APP_STREAM_CHUNK);
+        if (r.len < 0) goto done;
+        int flen = 0;
+        if (!aead_stream_seal_batch(&s, &r, 1, r.len < APP_STREAM_CHUNK, &flen)) goto done;
+        if (!wr(wr_io, frame, flen)) goto done;
+    }
+    ok = 1;
+done:
+    app_buf_put(frame, APP_STREAM_FRAME_MAX);
+    aead_stream_free(&s);
+    return ok;
+}
+
+// Inverse of aead_encrypt_stream. Stops after the final chunk; EOF before it
+// is a truncation and fails. rk (may be NULL) accepts REKEY chunks.
+// returns 1 on success, 0 on failure.
+static int aead_decrypt_stream(aead_ctx* a, const unsigned char* aad, int aadlen,
+                               aead_read_fn rd, void* rd_io,
+                               aead_write_fn wr, void* wr_io,
+                               const aead_rekey* rk) {
+    unsigned char* frame;
+    aead_stream s;
+    int ok = 0;
+
+    if (!aead_stream_init(&s, a, aad, aadlen) || !(frame = app_buf_get())) return 0;
+    if (rk) aead_stream_set_rekey(&s, rk);
+
+    while (!s.done) {
+        int ctlen = 0, consumed = 0;
+        unsigned char flags = 0;
+        aead_rec r;
+        if (aead_read_full(rd, rd_io, frame, APP_REC_HDR_LEN) != APP_REC_HDR_LEN) goto done;
+        if (!aead_rec_get_hdr(frame, &ctlen, &flags)) goto done;
+        if (aead_read_full(rd, rd_io, APP_REC_PAYLOAD(frame), ctlen) != ctlen) goto done;
+        if (aead_stream_open_batch(&s, frame, APP_REC_HDR_LEN + ctlen, &r, 1, &consumed) != 1) goto done;
+        if (r.len > 0 && !wr(wr_io, APP_REC_PAYLOAD(frame), r.len)) goto done;
+    }
+    ok = 1;
+done:
+    app_buf_put(frame, APP_STREAM_FRAME_MAX);
+    aead_stream_free(&s);
+    return ok;
+}
+
 #endif // HYBRID_COMMON_H
@@ -0,0 +1,135 @@
+#ifndef HYBRID_CONFIG_H
+#define HYBRID_CONFIG_H
+
+// Stage69 runtime configuration (ASCII only)
+// Every tunable of a program is one of its options. A config file (-C) sets
+// the same options by long name, one "name = value" per line, '#' starts a
+// comment; -O name=value does the same on the command line for settings that
+// have no short option. Flags take yes/no (also true/false, on/off, 1/0).
+// The file is read first and the command line after it, so command-line
+// options win and a benchmark run is reproduced by its file plus the
+// effective settings each program logs at startup.
+//
+// A program lists its settings in an app_cfg_key table and handles them in
+// one app_cfg_set_fn, the same function its getopt loop calls. Values read
+// from a file stay allocated for the life of the process.
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define APP_CFG_LINE_MAX 512
+#define APP_CFG_OPT_LONG 256        // first option code for settings without a short option
+
+typedef struct {
+    const char* name;
+    int opt;                        // getopt letter or APP_CFG_OPT_LONG + n
+    int flag;                       // takes no value on the command line
+} app_cfg_key;
+
+// Apply one option: val is the argument (NULL for a flag).
+// returns 1 on success, 0 on a bad value.
+typedef int (*app_cfg_set_fn)(int opt, const char* val, void* arg);
+
+static int app_cfg_bool(const char* v, int* out) {
+    static const char* const yes[] = { "yes", "true", "on", "1" };
+    static const char* const no[] = { "no", "false", "off", "0" };
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(v, yes[i]) == 0) { *out = 1; return 1; }
+        if (strcmp(v, no[i]) == 0) { *out = 0; return 1; }
+    }
+    return 0;
+}
+
+// Set the named option. A flag set to no is left at its default.
+// returns 1 on success, 0 on an unknown name or a bad value (reported).
+static int app_cfg_apply(const app_cfg_key* keys, const char* name, const char* val,
+                         app_cfg_set_fn set, void* arg) {
+    for (const app_cfg_key* k = keys; k->name; k++) {
+        if (strcmp(k->name, name) != 0) continue;
+        if (k->flag) {
+            int on;
+            if (!app_cfg_bool(val, &on)) {
+                fprintf(stderr, "config: %s takes yes or no, not %s\n", name, val);
+                return 0;
+            }
+            return on ? set(k->opt, NULL, arg) : 1;
+        }
+        if (!set(k->opt, val, arg)) {
+            fprintf(stderr, "config: bad value for %s: %s\n", name, val);
+            return 0;
+        }
+        return 1;
+    }
+    fprintf(stderr, "config: unknown setting %s\n", name);
+    return 0;
+}
+
+// -O name=value. returns 1 on success, 0 on failure (reported).
+static int app_cfg_apply_pair(const app_cfg_key* keys, const char* pair, app_cfg_set_fn set, void* arg) {
+    const char* eq = strchr(pair, '=');
+    char name[64];
+    if (!eq || eq == pair || (size_t)(eq - pair) >= sizeof(name)) {
+        fprintf(stderr, "config: expected name=value, got %s\n", pair);
+        return 0;
+    }
+    memcpy(name, pair, (size_t)(eq - pair));
+    name[eq - pair] = '\0';
+    return app_cfg_apply(keys, name, eq + 1, set, arg);
+}
+
+static char* app_cfg_trim(char* s) {
+    while (isspace((unsigned char)*s)) s++;
+    char* e = s + strlen(s);
+    while (e > s && isspace((unsigned char)e[-1])) *--e = '\0';
+    return s;
+}
+
+// Read a config file. returns 1 on success, 0 on failure (file:line reported).
+static int app_cfg_load(const char* path, const app_cfg_key* keys, app_cfg_set_fn set, void* arg) {
+    FILE* f = fopen(path, "r");
+    if (!f) { perror(path); return 0; }
+    char line[APP_CFG_LINE_MAX];
+    int lineno = 0, ok = 1;
+    while (ok && fgets(line, sizeof(line), f)) {
+        lineno++;
+        char* hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        char* s = app_cfg_trim(line);
+        if (!*s) continue;
+        char* eq = strchr(s, '=');
+        if (!eq) {
+            fprintf(stderr, "%s:%d: expected name = value\n", path, lineno);
+            ok = 0;
+            break;
+        }
+        *eq = '\0';
+        char* name = app_cfg_trim(s);
+        char* val = strdup(app_cfg_trim(eq + 1));
+        if (!val) { ok = 0; break; }
+        if (!app_cfg_apply(keys, name, val, set, arg)) {
+            fprintf(stderr, "%s:%d: setting rejected\n", path, lineno);
+            ok = 0;
+        }
+    }
+    fclose(f);
+    return ok;
+}
+
+// The -C argument, found with the program's own optstring before the real
+// getopt loop (which must skip 'C'). NULL if there is none.
+static const char* app_cfg_prescan(int argc, char** argv, const char* optstring) {
+    const char* path = NULL;
+    int opt, saved = opterr;
+    opterr = 0;
+    while ((opt = getopt(argc, argv, optstring)) != -1) {
+        if (opt == 'C') path = optarg;
+    }
+    opterr = saved;
+    optind = 1;
+    return path;
+}
+
+#endif // HYBRID_CONFIG_H
@@ -0,0 +1,472 @@
+#ifndef HYBRID_MB_H
+#define HYBRID_MB_H
+
+// Stage69 multi-buffer AES-256-GCM (ASCII only)
+// For sub-256-byte records the EVP path is mostly per-call cost: re-arming
+// the context with a nonce, GHASH finalization, provider dispatch. The
+// kernel here seals or opens records from many sessions in one call: up to
+// AEAD_MB_LANES records advance four blocks at a time in lock step, so the
+// AES rounds and carry-less multiplies of independent records overlap in the
+// pipeline instead of waiting on each other's latency.
+//
+// Output is byte-for-byte what aead_ctx_seal_next() / aead_ctx_open_next()
+// produce. A context takes part once aead_ctx_mb_init() gave it a key
+// schedule; that needs AES-256-GCM with a 12-byte nonce and a CPU with
+// AES-NI and PCLMULQDQ. Every other job (other suites, other CPUs, records
+// above AEAD_MB_MAX_LEN) goes through the EVP path inside the same call, so
+// callers need no fallback.
+
+#include <openssl/crypto.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hybrid_common.h"
+
+#if defined(__x86_64__) && APP_IV_LEN == 12 && APP_KEY_LEN == 32
+#define AEAD_MB_KERNEL 1
+#include <immintrin.h>
+#else
+#define AEAD_MB_KERNEL 0
+#endif
+
+#define AEAD_MB_LANES 8
+#define AEAD_MB_MAX_LEN 1024        // larger records go to EVP (its stitched loop wins there)
+
+// One record. seal: in = plaintext (inlen), out = ct || tag (inlen + APP_TAG_LEN).
+// open: in = ct || tag, out = plaintext (inlen - APP_TAG_LEN). out may equal in.
+typedef struct {
+    aead_ctx* a;                // iv set; the job takes its next sequence number
+    const unsigned char* aad;
+    int aadlen;
+    const unsigned char* in;
+    int inlen;
+    unsigned char* out;
+    int outlen;                 // set on success
+    int ok;                     // set by the batch call
+    unsigned char* frame;       // aead_mb_job_chunk: the whole frame, for the record sink
+    uint32_t epoch;
+    uint64_t seq;               // record number the seal used
+    unsigned char aadbuf[APP_STREAM_AAD_MAX + APP_REC_HDR_LEN];   // stream jobs: aad || hdr
+} aead_mb_job;
+
+#if AEAD_MB_KERNEL
+#define AEAD_MB_TARGET __attribute__((target("aes,pclmul,sse4.1")))
+
+typedef struct {
+    __m128i rk[15];
+    __m128i h[4];               // H, H^2, H^3, H^4, byte-reflected
+} aead_mb_key;
+
+_Static_assert(sizeof(aead_mb_key) <= AEAD_MB_KEY_SIZE, "AEAD_MB_KEY_SIZE too small");
+
+#define AEAD_MB_EXPAND_A(t1, t3, rcon) do {                     \
+        __m128i g_ = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(t3, rcon), 0xff); \
+        t1 = _mm_xor_si128(t1, _mm_slli_si128(t1, 4));          \
+        t1 = _mm_xor_si128(t1, _mm_slli_si128(t1, 4));          \
+        t1 = _mm_xor_si128(t1, _mm_slli_si128(t1, 4));          \
+        t1 = _mm_xor_si128(t1, g_);                             \
+    } while (0)
+#define AEAD_MB_EXPAND_B(t1, t3) do {                           \
+        __m128i g_ = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(t1, 0), 0xaa); \
+        t3 = _mm_xor_si128(t3, _mm_slli_si128(t3, 4));          \
+        t3 = _mm_xor_si128(t3, _mm_slli_si128(t3, 4));          \
+        t3 = _mm_xor_si128(t3, _mm_slli_si128(t3, 4));          \
+        t3 = _mm_xor_si128(t3, g_);                             \
+    } while (0)
+
+AEAD_MB_TARGET static void aead_mb_expand(aead_mb_key* k, const unsigned char* key) {
+    __m128i t1 = _mm_loadu_si128((const __m128i*)key);
+    __m128i t3 = _mm_loadu_si128((const __m128i*)(key + 16));
+    k->rk[0] = t1;
+    k->rk[1] = t3;
+    AEAD_MB_EXPAND_A(t1, t3, 0x01); k->rk[2]  = t1; AEAD_MB_EXPAND_B(t1, t3); k->rk[3]  = t3;
+    AEAD_MB_EXPAND_A(t1, t3, 0x02); k->rk[4]  = t1; AEAD_MB_EXPAND_B(t1, t3); k->rk[5]  = t3;
+    AEAD_MB_EXPAND_A(t1, t3, 0x04); k->rk[6]  = t1; AEAD_MB_EXPAND_B(t1, t3); k->rk[7]  = t3;
+    AEAD_MB_EXPAND_A(t1, t3, 0x08); k->rk[8]  = t1; AEAD_MB_EXPAND_B(t1, t3); k->rk[9]  = t3;
+    AEAD_MB_EXPAND_A(t1, t3, 0x10); k->rk[10] = t1; AEAD_MB_EXPAND_B(t1, t3); k->rk[11] = t3;
+    AEAD_MB_EXPAND_A(t1, t3, 0x20); k->rk[12] = t1; AEAD_MB_EXPAND_B(t1, t3); k->rk[13] = t3;
+    AEAD_MB_EXPAND_A(t1, t3, 0x40); k->rk[14] = t1;
+}
+
+AEAD_MB_TARGET static __m128i aead_mb_bswap(__m128i x) {
+    return _mm_shuffle_epi8(x, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+// GF(2^128) arithmetic on byte-reflected operands (Intel CLMUL white paper,
+// alg. 5). Products are accumulated unreduced in lo/hi; the shift and the
+// reduction are linear, so a sum of products needs only one of them.
+AEAD_MB_TARGET static void aead_mb_clmul(__m128i a, __m128i b, __m128i* lo, __m128i* hi) {
+    __m128i mid = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+    *lo = _mm_xor_si128(*lo, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x00), _mm_slli_si128(mid, 8)));
+    *hi = _mm_xor_si128(*hi, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x11), _mm_srli_si128(mid, 8)));
+}
+
+AEAD_MB_TARGET static __m128i aead_mb_reduce(__m128i t3, __m128i t6) {
+    // shift the 256-bit product left by one (bit reflection)
+    __m128i t7 = _mm_srli_epi32(t3, 31);
+    __m128i t8 = _mm_srli_epi32(t6, 31);
+    t3 = _mm_slli_epi32(t3, 1);
+    t6 = _mm_slli_epi32(t6, 1);
+    __m128i t9 = _mm_srli_si128(t7, 12);
+    t8 = _mm_slli_si128(t8, 4);
+    t7 = _mm_slli_si128(t7, 4);
+    t3 = _mm_or_si128(t3, t7);
+    t6 = _mm_or_si128(t6, t8);
+    t6 = _mm_or_si128(t6, t9);
+
+    // reduce modulo x^128 + x^7 + x^2 + x + 1
+    t7 = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(t3, 31), _mm_slli_epi32(t3, 30)), _mm_slli_epi32(t3, 25));
+    t8 = _mm_srli_si128(t7, 4);
+    t3 = _mm_xor_si128(t3, _mm_slli_si128(t7, 12));
+    __m128i t2 = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(t3, 1), _mm_srli_epi32(t3, 2)), _mm_srli_epi32(t3, 7));
+    t2 = _mm_xor_si128(t2, t8);
+    t3 = _mm_xor_si128(t3, t2);
+    return _mm_xor_si128(t6, t3);
+}
+
+AEAD_MB_TARGET static __m128i aead_mb_gfmul(__m128i a, __m128i b) {
+    __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+    aead_mb_clmul(a, b, &lo, &hi);
+    return aead_mb_reduce(lo, hi);
+}
+
+// Zero-padded load of a final partial block.
+AEAD_MB_TARGET static __m128i aead_mb_load_partial(const unsigned char* p, int n) {
+    unsigned char b[16] = {0};
+    memcpy(b, p, (size_t)n);
+    return _mm_loadu_si128((const __m128i*)b);
+}
+
+AEAD_MB_TARGET static __m128i aead_mb_ghash_bytes(__m128i x, __m128i h, const unsigned char* p, int n) {
+    for (; n >= 16; p += 16, n -= 16) {
+        x = aead_mb_gfmul(_mm_xor_si128(x, aead_mb_bswap(_mm_loadu_si128((const __m128i*)p))), h);
+    }
+    if (n > 0) x = aead_mb_gfmul(_mm_xor_si128(x, aead_mb_bswap(aead_mb_load_partial(p, n))), h);
+    return x;
+}
+
+// Lane state for one record.
+typedef struct {
+    const aead_mb_key* k;
+    const unsigned char* src;
+    unsigned char* dst;
+    int len;                    // payload bytes (no tag)
+    int nblocks;
+    __m128i ctr;                // J0, counter in the last 4 bytes (big endian)
+    __m128i x;                  // GHASH accumulator
+    __m128i ekj0;               // E_K(J0)
+} aead_mb_lane;
+
+// Runs n <= AEAD_MB_LANES lanes, four blocks per lane per step: the AES
+// rounds of all lanes interleave, and four GHASH blocks share one reduction
+// (X' = (X ^ C1) H^4 ^ C2 H^3 ^ C3 H^2 ^ C4 H). dec = 1 hashes the input.
+AEAD_MB_TARGET static void aead_mb_run(aead_mb_lane* L, int n, int dec) {
+    __m128i b[AEAD_MB_LANES][4];
+    const __m128i one = _mm_set_epi32(0x01000000, 0, 0, 0);   // +1 on the big-endian counter word
+    int maxb = 0;
+
+    // E_K(J0) for every lane
+    for (int l = 0; l < n; l++) b[l][0] = _mm_xor_si128(L[l].ctr, L[l].k->rk[0]);
+    for (int r = 1; r < 14; r++) {
+        for (int l = 0; l < n; l++) b[l][0] = _mm_aesenc_si128(b[l][0], L[l].k->rk[r]);
+    }
+    for (int l = 0; l < n; l++) {
+        L[l].ekj0 = _mm_aesenclast_si128(b[l][0], L[l].k->rk[14]);
+        if (L[l].nblocks > maxb) maxb = L[l].nblocks;
+    }
+
+    for (int j = 0; j < maxb; j += 4) {
+        int act[AEAD_MB_LANES], na = 0;
+        for (int l = 0; l < n; l++) {
+            if (j >= L[l].nblocks) continue;
+            __m128i rk0 = L[l].k->rk[0];
+            for (int q = 0; q < 4; q++) {
+                L[l].ctr = _mm_add_epi32(L[l].ctr, one);   // counters stay far below 2^32
+                b[na][q] = _mm_xor_si128(L[l].ctr, rk0);
+            }
+            act[na++] = l;
+        }
+        for (int r = 1; r < 14; r++) {
+            for (int i = 0; i < na; i++) {
+                __m128i rk = L[act[i]].k->rk[r];
+                b[i][0] = _mm_aesenc_si128(b[i][0], rk);
+                b[i][1] = _mm_aesenc_si128(b[i][1], rk);
+                b[i][2] = _mm_aesenc_si128(b[i][2], rk);
+                b[i][3] = _mm_aesenc_si128(b[i][3], rk);
+            }
+        }
+        for (int i = 0; i < na; i++) {
+            aead_mb_lane* q = &L[act[i]];
+            const __m128i* h = q->k->h;
+            __m128i rk = q->k->rk[14];
+            int nb = q->nblocks - j < 4 ? q->nblocks - j : 4;
+            __m128i c[4];
+            for (int k = 0; k < nb; k++) {
+                int off = (j + k) * 16, m = q->len - off < 16 ? q->len - off : 16;
+                __m128i ks = _mm_aesenclast_si128(b[i][k], rk);
+                __m128i in = m == 16 ? _mm_loadu_si128((const __m128i*)(q->src + off)) : aead_mb_load_partial(q->src + off, m);
+                __m128i out = _mm_xor_si128(in, ks);
+                if (m == 16) {
+                    _mm_storeu_si128((__m128i*)(q->dst + off), out);
+                } else {
+                    unsigned char t[16];
+                    _mm_storeu_si128((__m128i*)t, out);
+                    memcpy(q->dst + off, t, (size_t)m);
+                    out = aead_mb_load_partial(t, m);  // GHASH pads the ciphertext with zeros
+                }
+                c[k] = aead_mb_bswap(dec ? in : out);
+            }
+            if (nb == 4) {
+                __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+                aead_mb_clmul(_mm_xor_si128(q->x, c[0]), h[3], &lo, &hi);
+                aead_mb_clmul(c[1], h[2], &lo, &hi);
+                aead_mb_clmul(c[2], h[1], &lo, &hi);
+                aead_mb_clmul(c[3], h[0], &lo, &hi);
+                q->x = aead_mb_reduce(lo, hi);
+            } else {
+                for (int k = 0; k < nb; k++) q->x = aead_mb_gfmul(_mm_xor_si128(q->x, c[k]), h[0]);
+            }
+        }
+    }
+}
+
+// Lengths block, final multiply and E_K(J0); tag_out gets APP_TAG_LEN bytes.
+AEAD_MB_TARGET static void aead_mb_finish(aead_mb_lane* q, int aadlen, unsigned char* tag_out) {
+    __m128i lens = _mm_set_epi64x((long long)((uint64_t)aadlen * 8), (long long)((uint64_t)q->len * 8));
+    __m128i x = aead_mb_gfmul(_mm_xor_si128(q->x, lens), q->k->h[0]);
+    unsigned char t[16];
+    _mm_storeu_si128((__m128i*)t, _mm_xor_si128(aead_mb_bswap(x), q->ekj0));
+    memcpy(tag_out, t, APP_TAG_LEN);
+    OPENSSL_cleanse(t, sizeof(t));
+}
+
+AEAD_MB_TARGET static void aead_mb_lane_init(aead_mb_lane* q, const aead_ctx* a, uint64_t seq,
+                                             const unsigned char* aad, int aadlen) {
+    unsigned char j0[16];
+    aead_nonce_xor(a->iv, seq, j0);
+    j0[12] = 0; j0[13] = 0; j0[14] = 0; j0[15] = 1;
+    q->k = (const aead_mb_key*)a->mb;
+    q->ctr = _mm_loadu_si128((const __m128i*)j0);
+    q->nblocks = (q->len + 15) / 16;
+    q->x = aead_mb_ghash_bytes(_mm_setzero_si128(), q->k->h[0], aad, aad ? aadlen : 0);
+}
+
+AEAD_MB_TARGET static void aead_mb_hkey(aead_mb_key* k) {
+    __m128i z = _mm_xor_si128(_mm_setzero_si128(), k->rk[0]);
+    for (int r = 1; r < 14; r++) z = _mm_aesenc_si128(z, k->rk[r]);
+    k->h[0] = aead_mb_bswap(_mm_aesenclast_si128(z, k->rk[14]));
+    for (int i = 1; i < 4; i++) k->h[i] = aead_mb_gfmul(k->h[i - 1], k->h[0]);
+}
+#endif // AEAD_MB_KERNEL
+
+// 1 if this process can run the kernel.
+static int aead_mb_available(void) {
+#if AEAD_MB_KERNEL
+    static int cached = -1;
+    if (cached < 0) {
+        __builtin_cpu_init();
+        cached = __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul") &&
+                 __builtin_cpu_supports("sse4.1");
+    }
+    return cached;
+#else
+    return 0;
+#endif
+}
+
+// Attach a kernel key schedule to a context keyed with the same key. A no-op
+// (returns 1, EVP path stays) when the suite or CPU does not fit, or when
+// record crypto is offloaded to a provider (crypto_rt_set_propq).
+// returns 1 on success, 0 on failure.
+static int aead_ctx_mb_init(aead_ctx* a, const unsigned char* key) {
+#if AEAD_MB_KERNEL
+    if (a->mb || a->suite != APP_SUITE_AES_256_GCM || !aead_mb_available() || crypto_rt_offloaded()) return 1;
+    void* m = NULL;
+    if (posix_memalign(&m, 16, AEAD_MB_KEY_SIZE) != 0) return 0;
+    memset(m, 0, AEAD_MB_KEY_SIZE);
+    aead_mb_expand((aead_mb_key*)m, key);
+    aead_mb_hkey((aead_mb_key*)m);
+    a->mb = m;
+#else
+    (void)a;
+    (void)key;
+#endif
+    return 1;
+}
+
+#if AEAD_MB_KERNEL
+// Runs the pending lanes and completes their jobs. Reports each record to the
+// aead observer with an equal share of the batch time.
+static void aead_mb_flush(aead_mb_lane* lanes, aead_mb_job** lj, int nl, int dec) {
+    uint64_t t0 = g_aead_observer ? aead_clock_ns() : 0;
+    aead_mb_run(lanes, nl, dec);
+    for (int l = 0; l < nl; l++) {
+        aead_mb_job* j = lj[l];
+        if (dec) {
+            unsigned char tag[APP_TAG_LEN];
+            aead_mb_finish(&lanes[l], j->aadlen, tag);
+            j->ok = CRYPTO_memcmp(tag, j->in + lanes[l].len, APP_TAG_LEN) == 0 ? 1 : -1;
+        } else {
+            aead_mb_finish(&lanes[l], j->aadlen, j->out + lanes[l].len);
+            j->ok = 1;
+        }
+        j->outlen = lanes[l].len + (dec ? 0 : APP_TAG_LEN);
+    }
+    if (g_aead_observer) {
+        uint64_t share = (aead_clock_ns() - t0) / (uint64_t)nl;
+        for (int l = 0; l < nl; l++) g_aead_observer(dec, lanes[l].len, lj[l]->ok == 1, share);
+    }
+    OPENSSL_cleanse(lanes, sizeof(aead_mb_lane) * (size_t)nl);
+}
+
+// Queue job j as a lane if its context has a kernel key and the record is
+// small. returns 1 if queued.
+static int aead_mb_queue(aead_mb_lane* lanes, aead_mb_job** lj, int* nl, aead_mb_job* j, int dec) {
+    int len = j->inlen - (dec ? APP_TAG_LEN : 0);
+    if (!j->a->mb || j->aadlen < 0 || len > AEAD_MB_MAX_LEN) return 0;
+    aead_mb_lane* q = &lanes[*nl];
+    q->src = j->in;
+    q->dst = j->out;
+    q->len = len;
+    aead_mb_lane_init(q, j->a, j->a->seq++, j->aad, j->aadlen);
+    lj[(*nl)++] = j;
+    if (*nl == AEAD_MB_LANES) {
+        aead_mb_flush(lanes, lj, *nl, dec);
+        *nl = 0;
+    }
+    return 1;
+}
+#endif
+
+// Seal every job with its context's next sequence number (jobs on the same
+// context are numbered in array order). Sets ok/outlen per job.
+// returns the number of jobs sealed.
+static int aead_mb_seal(aead_mb_job* jobs, int n) {
+#if AEAD_MB_KERNEL
+    aead_mb_lane lanes[AEAD_MB_LANES];
+    aead_mb_job* lj[AEAD_MB_LANES];
+    int nl = 0;
+#endif
+    for (int i = 0; i < n; i++) {
+        aead_mb_job* j = &jobs[i];
+        j->ok = 0;
+        if (!j->a->has_iv || j->a->seq == UINT64_MAX || j->inlen < 0) continue;
+        j->seq = j->a->seq;
+#if AEAD_MB_KERNEL
+        if (aead_mb_queue(lanes, lj, &nl, j, 0)) continue;
+#endif
+        j->ok = aead_ctx_seal_next(j->a, j->aad, j->aadlen, j->in, j->inlen, j->out, &j->outlen);
+    }
+#if AEAD_MB_KERNEL
+    if (nl > 0) aead_mb_flush(lanes, lj, nl, 0);
+#endif
+    int done = 0;
+    for (int i = 0; i < n; i++) {
+        aead_mb_job* j = &jobs[i];
+        if (j->ok == 1 && j->frame &&
+            !aead_record_log(j->a, j->epoch, j->seq, j->frame, APP_REC_HDR_LEN + j->outlen)) j->ok = 0;
+        done += j->ok == 1;
+    }
+    return done;
+}
+
+// Open every job at its context's next sequence number. As with repeated
+// aead_ctx_open_next() calls, a context stops at its first failure: that
+// job and every later job on the same context fail, and the context's
+// sequence stays at the failed record. Failed outputs are zeroized.
+// returns the number of jobs opened, -1 if out of memory.
+static int aead_mb_open(aead_mb_job* jobs, int n) {
+    if (n <= 0) return 0;
+    uint64_t* seqs = (uint64_t*)malloc(sizeof(uint64_t) * (size_t)n);
+    if (!seqs) return -1;
+#if AEAD_MB_KERNEL
+    aead_mb_lane lanes[AEAD_MB_LANES];
+    aead_mb_job* lj[AEAD_MB_LANES];
+    int nl = 0;
+#endif
+    for (int i = 0; i < n; i++) {
+        aead_mb_job* j = &jobs[i];
+        j->ok = -1;
+        seqs[i] = j->a->seq;
+        if (!j->a->has_iv || j->a->seq == UINT64_MAX || j->inlen < APP_TAG_LEN) continue;
+#if AEAD_MB_KERNEL
+        if (aead_mb_queue(lanes, lj, &nl, j, 1)) continue;
+#endif
+        // advance even on failure so that later jobs keep their numbers; rewound below
+        j->ok = aead_ctx_open_next(j->a, j->aad, j->aadlen, j->in, j->inlen, j->out, &j->outlen) ? 1 : -1;
+        if (j->ok < 0) j->a->seq++;
+    }
+#if AEAD_MB_KERNEL
+    if (nl > 0) aead_mb_flush(lanes, lj, nl, 1);
+#endif
+
+    int done = 0;
+    for (int i = 0; i < n; i++) {
+        aead_mb_job* j = &jobs[i];
+        int first_fail = j->ok != 1;
+        for (int k = 0; k < i; k++) {
+            if (jobs[k].a == j->a && jobs[k].ok != 1) { first_fail = 0; j->ok = -1; break; }
+        }
+        if (j->ok == 1) { done++; continue; }
+        if (j->inlen > APP_TAG_LEN) OPENSSL_cleanse(j->out, (size_t)(j->inlen - APP_TAG_LEN));
+        if (first_fail) j->a->seq = seqs[i];
+    }
+    for (int i = 0; i < n; i++) if (jobs[i].ok != 1) jobs[i].ok = 0;
+    free(seqs);
+    return done;
+}
+
+// Prepare a job for the next chunk of a stream, as aead_stream_seal_chunk()
+// would seal it: writes the header into frame and gives the job its own copy
+// of the stream's AAD, so one batch may hold several chunks of a stream (in
+// order). The payload must already sit at APP_REC_PAYLOAD(frame); it is
+// sealed in place. The job must not move until the batch call.
+// returns 1 on success, 0 on failure.
+static int aead_mb_job_chunk(aead_mb_job* j, aead_stream* s, unsigned char* frame, int ptlen, int final) {
+    if (s->done || ptlen < 0 || ptlen > APP_STREAM_CHUNK) return 0;
+    memset(j, 0, sizeof(*j));
+    aead_rec_put_hdr(frame, ptlen + APP_TAG_LEN, (final ? APP_REC_FINAL : 0) | aead_stream_epoch_flag(s));
+    memcpy(j->aadbuf, s->aad, (size_t)s->aadlen);
+    memcpy(j->aadbuf + s->aadlen, frame, APP_REC_HDR_LEN);
+    j->a = s->a;
+    j->aad = j->aadbuf;
+    j->aadlen = s->aadlen + APP_REC_HDR_LEN;
+    j->in = APP_REC_PAYLOAD(frame);
+    j->inlen = ptlen;
+    j->out = APP_REC_PAYLOAD(frame);
+    j->frame = frame;
+    j->epoch = s->epoch;
+    s->since++;
+    if (final) s->done = 1;
+    return 1;
+}
+
+// Prepare a job to open the complete frame at frame in place, as
+// aead_stream_open_chunk() would for a stream without epoch switches
+// (REKEY chunks and chunks of another epoch are refused). The plaintext
+// ends up at APP_REC_PAYLOAD(frame), its length in outlen after the batch
+// call. A FINAL chunk marks the stream done as soon as it is queued; a
+// failed open leaves the stream unusable, as with the serial path.
+// returns 1 on success, 0 on a bad header or a stream that has ended.
+static int aead_mb_job_open_chunk(aead_mb_job* j, aead_stream* s, unsigned char* frame, int ctlen) {
+    int n = 0;
+    unsigned char flags = 0;
+    if (s->done || !aead_rec_get_hdr(frame, &n, &flags) || n != ctlen) return 0;
+    if ((flags & APP_REC_REKEY) || (flags & APP_REC_EPOCH) != aead_stream_epoch_flag(s)) return 0;
+    memset(j, 0, sizeof(*j));
+    memcpy(j->aadbuf, s->aad, (size_t)s->aadlen);
+    memcpy(j->aadbuf + s->aadlen, frame, APP_REC_HDR_LEN);
+    j->a = s->a;
+    j->aad = j->aadbuf;
+    j->aadlen = s->aadlen + APP_REC_HDR_LEN;
+    j->in = APP_REC_PAYLOAD(frame);
+    j->inlen = ctlen;
+    j->out = APP_REC_PAYLOAD(frame);
+    j->frame = frame;
+    j->epoch = s->epoch;
+    if (flags & APP_REC_FINAL) s->done = 1;
+    return 1;
+}
+
+#endif // HYBRID_MB_H
@@ -0,0 +1,342 @@
+#ifndef HYBRID_METRICS_H
+#define HYBRID_METRICS_H
+
+// Stage69 metrics (ASCII only)
+// Counters and latency histograms for the hot path, exported in the
+// Prometheus text format on a small HTTP listener (GET /metrics).
+//
+// Every thread writes only its own shard (relaxed load + store, no locked
+// instructions and no shared cache lines); a scrape walks all shards and
+// sums them. Shards are linked into the registry on a thread's first update.
+// When a thread exits, a pthread key destructor adds its shard into a
+// retired total and frees it, so counters stay monotonic and a scrape only
+// walks live threads. Histograms use
+// power-of-two microsecond buckets (1 us .. 8.4 s, then +Inf).
+//
+// app_metrics_enable() also installs the aead observer, so every seal/open
+// in hybrid_common.h is timed and counted, including pstream workers.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hybrid_common.h"
+
+enum {
+    APP_M_CONNECTIONS,          // accepted TLS handshakes
+    APP_M_HANDSHAKE_FAILURES,
+    APP_M_RECORDS_SEALED,
+    APP_M_RECORDS_OPENED,
+    APP_M_AUTH_FAILURES,        // open failed (tag mismatch)
+    APP_M_BYTES_SEALED,         // plaintext bytes
+    APP_M_BYTES_OPENED,
+    APP_M_TLS_BYTES_IN,         // socket bytes, handshake included
+    APP_M_TLS_BYTES_OUT,
+    APP_M_COUNTERS
+};
+
+enum {
+    APP_H_HANDSHAKE,
+    APP_H_KEY_DERIVATION,
+    APP_H_SEAL,
+    APP_H_OPEN,
+    APP_H_COUNT
+};
+
+#define APP_H_BUCKETS 24            // le = 2^k us, k = 0..23; one more for +Inf
+
+typedef struct {
+    _Atomic uint64_t bucket[APP_H_BUCKETS + 1];
+    _Atomic uint64_t sum_ns;
+    _Atomic uint64_t count;
+} app_hist;
+
+typedef struct app_metrics_shard {
+    _Atomic uint64_t counter[APP_M_COUNTERS];
+    app_hist hist[APP_H_COUNT];
+    struct app_metrics_shard* next;
+} __attribute__((aligned(64))) app_metrics_shard;
+
+// Extra gauges written at scrape time (pool depth, queue depth, ...).
+typedef void (*app_metrics_gauge_fn)(FILE* out, void* arg);
+
+static const char* const k_app_counter_names[APP_M_COUNTERS][2] = {
+    { "stage69_connections_total",          "TLS handshakes completed" },
+    { "stage69_handshake_failures_total",   "TLS handshakes that failed" },
+    { "stage69_records_sealed_total",       "AEAD records sealed" },
+    { "stage69_records_opened_total",       "AEAD records opened" },
+    { "stage69_auth_failures_total",        "AEAD opens that failed authentication" },
+    { "stage69_plaintext_sealed_bytes_total", "Plaintext bytes sealed" },
+    { "stage69_plaintext_opened_bytes_total", "Plaintext bytes opened" },
+    { "stage69_tls_received_bytes_total",   "Bytes read from client sockets" },
+    { "stage69_tls_sent_bytes_total",       "Bytes written to client sockets" },
+};
+
+static const char* const k_app_hist_names[APP_H_COUNT][2] = {
+    { "stage69_handshake_seconds",      "TLS handshake duration" },
+    { "stage69_key_derivation_seconds", "Session key setup (exporter, pool key, HKDF, AEAD key)" },
+    { "stage69_aead_seal_seconds",      "AEAD seal time per record" },
+    { "stage69_aead_open_seconds",      "AEAD open time per record" },
+};
+
+static struct {
+    pthread_mutex_t mu;             // registry only, never on the update path
+    int enabled;
+    app_metrics_gauge_fn gauges;
+    void* gauge_arg;
+    int listen_fd;
+    pthread_once_t key_once;
+    pthread_key_t key;              // destructor retires the shard of an exiting thread
+    int key_ok;
+    app_metrics_shard shards;       // head: sum of exited threads; next: live threads (under mu)
+} g_app_metrics = { .mu = PTHREAD_MUTEX_INITIALIZER, .listen_fd = -1, .key_once = PTHREAD_ONCE_INIT };
+
+static __thread app_metrics_shard* g_app_metrics_tls;
+
+// Owner-only increment: no other thread writes this word.
+static void app_metrics_bump(_Atomic uint64_t* c, uint64_t v) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + v, memory_order_relaxed);
+}
+
+// a += b for every counter and histogram word (a under mu or private).
+static void app_metrics_shard_add(app_metrics_shard* a, app_metrics_shard* b) {
+    for (int i = 0; i < APP_M_COUNTERS; i++) {
+        app_metrics_bump(&a->counter[i], atomic_load_explicit(&b->counter[i], memory_order_relaxed));
+    }
+    for (int h = 0; h < APP_H_COUNT; h++) {
+        for (int k = 0; k <= APP_H_BUCKETS; k++) {
+            app_metrics_bump(&a->hist[h].bucket[k], atomic_load_explicit(&b->hist[h].bucket[k], memory_order_relaxed));
+        }
+        app_metrics_bump(&a->hist[h].sum_ns, atomic_load_explicit(&b->hist[h].sum_ns, memory_order_relaxed));
+        app_metrics_bump(&a->hist[h].count, atomic_load_explicit(&b->hist[h].count, memory_order_relaxed));
+    }
+}
+
+// Thread exit: fold the shard into the retired total, unlink and free it.
+static void app_metrics_shard_retire(void* arg) {
+    app_metrics_shard* s = (app_metrics_shard*)arg;
+    pthread_mutex_lock(&g_app_metrics.mu);
+    app_metrics_shard_add(&g_app_metrics.shards, s);
+    for (app_metrics_shard** pp = &g_app_metrics.shards.next; *pp; pp = &(*pp)->next) {
+        if (*pp == s) { *pp = s->next; break; }
+    }
+    pthread_mutex_unlock(&g_app_metrics.mu);
+    g_app_metrics_tls = NULL;
+    free(s);
+}
+
+static void app_metrics_key_init(void) {
+    g_app_metrics.key_ok = pthread_key_create(&g_app_metrics.key, app_metrics_shard_retire) == 0;
+}
+
+static app_metrics_shard* app_metrics_shard_get(void) {
+    app_metrics_shard* s = g_app_metrics_tls;
+    if (s) return s;
+    pthread_once(&g_app_metrics.key_once, app_metrics_key_init);
+    if (posix_memalign((void**)&s, 64, sizeof(*s)) != 0) return NULL;
+    memset(s, 0, sizeof(*s));
+    pthread_mutex_lock(&g_app_metrics.mu);
+    s->next = g_app_metrics.shards.next;
+    g_app_metrics.shards.next = s;
+    pthread_mutex_unlock(&g_app_metrics.mu);
+    // Without the key the shard is simply kept, as before.
+    if (g_app_metrics.key_ok) pthread_setspecific(g_app_metrics.key, s);
+    g_app_metrics_tls = s;
+    return s;
+}
+
+static void app_metric_add(int id, uint64_t v) {
+    if (!g_app_metrics.enabled) return;
+    app_metrics_shard* s = app_metrics_shard_get();
+    if (s) app_metrics_bump(&s->counter[id], v);
+}
+
+static int app_hist_bucket(uint64_t ns) {
+    uint64_t us = (ns + 999) / 1000;
+    if (us <= 1) return 0;
+    int k = 64 - __builtin_clzll(us - 1);
+    return k < APP_H_BUCKETS ? k : APP_H_BUCKETS;
+}
+
+static void app_metric_observe(int id, uint64_t ns) {
+    if (!g_app_metrics.enabled) return;
+    app_metrics_shard* s = app_metrics_shard_get();
+    if (!s) return;
+    app_hist* h = &s->hist[id];
+    app_metrics_bump(&h->bucket[app_hist_bucket(ns)], 1);
+    app_metrics_bump(&h->sum_ns, ns);
+    app_metrics_bump(&h->count, 1);
+}
+
+static uint64_t app_metrics_now_ns(void) {
+    return g_app_metrics.enabled ? aead_clock_ns() : 0;
+}
+
+// Observe the time since t0 (from app_metrics_now_ns()).
+static void app_metric_since(int id, uint64_t t0) {
+    if (g_app_metrics.enabled) app_metric_observe(id, aead_clock_ns() - t0);
+}
+
+static void app_metrics_aead_observer(int op, int bytes, int ok, uint64_t ns) {
+    app_metrics_shard* s = app_metrics_shard_get();
+    if (!s) return;
+    if (!ok) {
+        if (op) app_metrics_bump(&s->counter[APP_M_AUTH_FAILURES], 1);
+        return;
+    }
+    app_metrics_bump(&s->counter[op ? APP_M_RECORDS_OPENED : APP_M_RECORDS_SEALED], 1);
+    app_metrics_bump(&s->counter[op ? APP_M_BYTES_OPENED : APP_M_BYTES_SEALED], bytes > 0 ? (uint64_t)bytes : 0);
+    app_metric_observe(op ? APP_H_OPEN : APP_H_SEAL, ns);
+}
+
+// ---- Scrape ---------------------------------------------------------------
+static void app_metrics_write(FILE* out) {
+    uint64_t c[APP_M_COUNTERS] = {0};
+    uint64_t hb[APP_H_COUNT][APP_H_BUCKETS + 1], hsum[APP_H_COUNT], hcount[APP_H_COUNT];
+    memset(hb, 0, sizeof(hb));
+    memset(hsum, 0, sizeof(hsum));
+    memset(hcount, 0, sizeof(hcount));
+
+    pthread_mutex_lock(&g_app_metrics.mu);
+    for (app_metrics_shard* s = &g_app_metrics.shards; s; s = s->next) {
+        for (int i = 0; i < APP_M_COUNTERS; i++) c[i] += atomic_load_explicit(&s->counter[i], memory_order_relaxed);
+        for (int h = 0; h < APP_H_COUNT; h++) {
+            for (int b = 0; b <= APP_H_BUCKETS; b++) {
+                hb[h][b] += atomic_load_explicit(&s->hist[h].bucket[b], memory_order_relaxed);
+            }
+            hsum[h]   += atomic_load_explicit(&s->hist[h].sum_ns, memory_order_relaxed);
+            hcount[h] += atomic_load_explicit(&s->hist[h].count, memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&g_app_metrics.mu);
+
+    for (int i = 0; i < APP_M_COUNTERS; i++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", k_app_counter_names[i][0],
+                k_app_counter_names[i][1], k_app_counter_names[i][0], k_app_counter_names[i][0],
+                (unsigned long long)c[i]);
+    }
+    for (int h = 0; h < APP_H_COUNT; h++) {
+        const char* n = k_app_hist_names[h][0];
+        fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", n, k_app_hist_names[h][1], n);
+        // Shards are read without stopping writers; keep the output consistent.
+        uint64_t cum = 0;
+        for (int b = 0; b < APP_H_BUCKETS; b++) {
+            cum += hb[h][b];
+            fprintf(out, "%s_bucket{le=\"%g\"} %llu\n", n, (double)(1ull << b) * 1e-6, (unsigned long long)cum);
+        }
+        cum += hb[h][APP_H_BUCKETS];
+        if (cum < hcount[h]) cum = hcount[h];
+        fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n", n, (unsigned long long)cum,
+                n, (double)hsum[h] * 1e-9, n, (unsigned long long)cum);
+    }
+    if (g_app_metrics.gauges) g_app_metrics.gauges(out, g_app_metrics.gauge_arg);
+}
+
+// ---- HTTP listener ----------------------------------------------------------
+// One thread, one request per connection; scrapes are rare and tiny.
+static void app_metrics_reply(int fd, const char* status, const char* body, size_t len) {
+    char hdr[192];
+    int n = snprintf(hdr, sizeof(hdr),
+                     "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %zu\r\nConnection: close\r\n\r\n", status, len);
+    if (write(fd, hdr, (size_t)n) != n) return;
+    while (len > 0) {
+        ssize_t w = write(fd, body, len);
+        if (w <= 0) return;
+        body += w;
+        len -= (size_t)w;
+    }
+}
+
+static void* app_metrics_main(void* arg) {
+    (void)arg;
+    int failing = 0;    // accept errors in a row; logged once
+    for (;;) {
+        int fd = accept(g_app_metrics.listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            // EMFILE, ENFILE, ENOBUFS... last until something is freed: back off, don't spin
+            if (!failing++) perror("metrics accept");
+            struct timespec ts = { 0, 100 * 1000 * 1000 };
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        failing = 0;
+        struct timeval tv = { 2, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        char req[1024];
+        size_t got = 0;
+        while (got < sizeof(req) - 1) {     // request line is enough
+            ssize_t r = read(fd, req + got, sizeof(req) - 1 - got);
+            if (r <= 0) break;
+            got += (size_t)r;
+            if (memchr(req, '\n', got)) break;
+        }
+        req[got] = '\0';
+
+        if (strncmp(req, "GET /metrics ", 13) == 0 || strncmp(req, "GET /metrics?", 13) == 0) {
+            char* body = NULL;
+            size_t len = 0;
+            FILE* f = open_memstream(&body, &len);
+            if (f) {
+                app_metrics_write(f);
+                fclose(f);
+                app_metrics_reply(fd, "200 OK", body, len);
+            }
+            free(body);
+        } else {
+            app_metrics_reply(fd, "404 Not Found", "see /metrics\n", 13);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+// Turn collection on and install the aead observer. Call before threads start.
+static void app_metrics_enable(app_metrics_gauge_fn gauges, void* arg) {
+    g_app_metrics.gauges = gauges;
+    g_app_metrics.gauge_arg = arg;
+    g_app_metrics.enabled = 1;
+    g_aead_observer = app_metrics_aead_observer;
+}
+
+// Serve /metrics on host:port from a detached thread. returns 1 on success, 0 on failure.
+static int app_metrics_serve(const char* host, int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return 0;
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1 ||
+        bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+        close(fd);
+        return 0;
+    }
+    g_app_metrics.listen_fd = fd;
+
+    pthread_t th;
+    if (pthread_create(&th, NULL, app_metrics_main, NULL) != 0) {
+        close(fd);
+        g_app_metrics.listen_fd = -1;
+        return 0;
+    }
+    pthread_detach(th);
+    return 1;
+}
+
+#endif // HYBRID_METRICS_H
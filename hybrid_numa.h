@@ -0,0 +1,122 @@
+#ifndef HYBRID_NUMA_H
+#define HYBRID_NUMA_H
+
+// Stage69 CPU and NUMA placement (ASCII only)
+// Topology comes from sysfs and the raw getcpu / sched_setaffinity / mbind
+// syscalls, so there is no libnuma dependency and no _GNU_SOURCE requirement.
+// Everything is best effort: on a single-node box, in a container without
+// the sysfs files, or without permission the calls report failure and the
+// caller keeps the kernel's default first-touch placement.
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define APP_NUMA_MAX_NODES 64
+#define APP_NUMA_MAX_CPUS 1024
+#define APP_NUMA_PAGE 4096
+#define APP_MPOL_PREFERRED 1        // linux/mempolicy.h MPOL_PREFERRED
+
+static __thread int g_app_numa_node = -1;   // node of the pinned CPU, -1 = ask getcpu
+
+// Parse a CPU list such as "0-3,8,10-11" into cpus[0..max). returns the
+// number of CPUs, 0 on a syntax error or an empty list.
+static int app_cpu_list_parse(const char* spec, int* cpus, int max) {
+    int n = 0;
+    const char* p = spec;
+    while (*p) {
+        char* end;
+        long lo = strtol(p, &end, 10), hi;
+        if (end == p || lo < 0 || lo >= APP_NUMA_MAX_CPUS) return 0;
+        hi = lo;
+        p = end;
+        if (*p == '-') {
+            hi = strtol(p + 1, &end, 10);
+            if (end == p + 1 || hi < lo || hi >= APP_NUMA_MAX_CPUS) return 0;
+            p = end;
+        }
+        for (long c = lo; c <= hi; c++) {
+            if (n == max) return 0;
+            cpus[n++] = (int)c;
+        }
+        if (*p == ',') p++;
+        else if (*p) return 0;
+    }
+    return n;
+}
+
+// NUMA node of a CPU (the nodeN link in its sysfs directory), 0 if unknown.
+static int app_cpu_node(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR* d = opendir(path);
+    if (!d) return 0;
+    int node = 0;
+    struct dirent* e;
+    while ((e = readdir(d)) != NULL) {
+        if (strncmp(e->d_name, "node", 4) == 0 && e->d_name[4] >= '0' && e->d_name[4] <= '9') {
+            node = atoi(e->d_name + 4);
+            break;
+        }
+    }
+    closedir(d);
+    return node < APP_NUMA_MAX_NODES ? node : 0;
+}
+
+// Number of NUMA nodes (highest online node + 1), 1 if unknown. Read once.
+static int g_app_numa_nnodes;
+
+static int app_numa_nodes(void) {
+    if (g_app_numa_nnodes) return g_app_numa_nnodes;
+    FILE* f = fopen("/sys/devices/system/node/online", "r");
+    if (!f) return g_app_numa_nnodes = 1;
+    char buf[256];
+    int hi = 0;
+    if (fgets(buf, sizeof(buf), f)) {
+        // "0" or "0-1" or "0,2-3": the last number is the highest node
+        for (char* p = buf; *p; p++) {
+            if (*p >= '0' && *p <= '9' && (p == buf || p[-1] < '0' || p[-1] > '9')) hi = atoi(p);
+        }
+    }
+    fclose(f);
+    return g_app_numa_nnodes = hi + 1 <= APP_NUMA_MAX_NODES ? hi + 1 : APP_NUMA_MAX_NODES;
+}
+
+// Pin the calling thread to one CPU and remember its node.
+// returns 1 on success, 0 on failure.
+static int app_pin_thread(int cpu) {
+    unsigned long mask[APP_NUMA_MAX_CPUS / (8 * sizeof(unsigned long))];
+    if (cpu < 0 || cpu >= APP_NUMA_MAX_CPUS) return 0;
+    memset(mask, 0, sizeof(mask));
+    mask[cpu / (8 * sizeof(unsigned long))] = 1UL << (cpu % (8 * sizeof(unsigned long)));
+    if (syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) != 0) return 0;
+    g_app_numa_node = app_cpu_node(cpu);
+    return 1;
+}
+
+// Node the calling thread runs on: the pinned CPU's node, or where the
+// scheduler has it right now.
+static int app_numa_self_node(void) {
+    if (g_app_numa_node >= 0) return g_app_numa_node;
+    unsigned cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) return 0;
+    return node < APP_NUMA_MAX_NODES ? (int)node : 0;
+}
+
+// Prefer node for pages of [addr, addr+len) not faulted in yet. addr must be
+// page aligned. On shared memory the policy belongs to the object, so it
+// holds for whichever process touches the pages first.
+// returns 1 on success, 0 on failure (a single-node box does nothing).
+static int app_numa_bind(void* addr, size_t len, int node) {
+    unsigned long mask[APP_NUMA_MAX_NODES / (8 * sizeof(unsigned long))];
+    if (node < 0 || node >= APP_NUMA_MAX_NODES || app_numa_nodes() < 2) return 0;
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+    return syscall(SYS_mbind, addr, len, APP_MPOL_PREFERRED, mask,
+                   (unsigned long)APP_NUMA_MAX_NODES + 1, 0) == 0;
+}
+
+#endif // HYBRID_NUMA_H
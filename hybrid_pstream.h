@@ -0,0 +1,273 @@
+#ifndef HYBRID_PSTREAM_H
+#define HYBRID_PSTREAM_H
+
+// Stage69 parallel stream sealing (ASCII only)
+// Each chunk of the streaming record format has its own nonce (iv XOR record
+// number) and its own header in the AAD, so chunks can be sealed on any core
+// in any order. aead_encrypt_stream_mt() keeps a ring of chunk slots per
+// stream, its job queue:
+//   caller reads plaintext into free slots, in order
+//   pool workers claim the oldest unsealed slot and seal it in place
+//   caller writes sealed slots strictly in order (reassembly), frees them
+// The output is byte-for-byte what aead_encrypt_stream() produces, so the
+// receiver is unchanged.
+//
+// The workers belong to one process-wide pool (aead_spool_start() at
+// startup, aead_spool_stop() at exit) shared by every stream, so concurrent
+// transfers never run more than its N sealing threads between them and no
+// thread is created per connection. Workers take streams with queued chunks
+// round robin. Each worker keeps its own copy of a stream's keyed EVP
+// context, made on its first chunk of that stream, so the AES key schedule
+// is not expanded again.
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "hybrid_common.h"
+
+#define APP_PSTREAM_MAX_THREADS 64
+#define APP_PSTREAM_SLOTS_PER_THREAD 4
+
+enum { APP_PSLOT_FREE, APP_PSLOT_FILLED, APP_PSLOT_SEALING, APP_PSLOT_SEALED };
+
+typedef struct {
+    unsigned char* frame;       // pool buffer: hdr || payload || tag, sealed in place
+    int ptlen;
+    int flen;
+    int final;
+    uint64_t seq;
+    int state;
+} aead_pslot;
+
+// One stream's job queue. Claim state is guarded by the pool mutex.
+typedef struct aead_pstream {
+    pthread_cond_t ready;       // caller: a slot became SEALED
+    aead_pslot* slots;
+    int nslots;
+    uint64_t next_fill;         // owned by the caller, read by workers under mu
+    uint64_t next_seal;
+    int busy;                   // slots being sealed outside the lock
+    int failed;
+    const aead_ctx* a;          // keyed template, iv set
+    unsigned char aad[APP_STREAM_AAD_MAX];
+    int aadlen;
+    EVP_CIPHER_CTX* wctx[APP_PSTREAM_MAX_THREADS];   // per worker, touched by that worker only
+    struct aead_pstream* next;  // pool list of open streams
+} aead_pstream;
+
+typedef struct {
+    pthread_mutex_t mu;
+    pthread_cond_t work;        // workers: a slot became FILLED, or stop
+    aead_pstream* streams;      // open streams, rotated as workers take chunks
+    pthread_t th[APP_PSTREAM_MAX_THREADS];
+    int nthreads;
+    int stop;
+} aead_spool;
+
+static aead_spool g_aead_spool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, {0}, 0, 0 };
+
+typedef struct {
+    int index;
+} aead_spool_arg;
+
+static aead_spool_arg g_aead_spool_args[APP_PSTREAM_MAX_THREADS];
+
+// First open stream with a filled slot; moved to the tail so the next
+// claim starts at another stream. Called with mu held.
+static aead_pstream* aead_spool_take(aead_spool* sp) {
+    aead_pstream** pp = &sp->streams;
+    for (; *pp; pp = &(*pp)->next) {
+        aead_pstream* p = *pp;
+        if (p->failed || p->next_seal == p->next_fill) continue;
+        if (p->next) {
+            *pp = p->next;
+            aead_pstream** tail = pp;
+            while (*tail) tail = &(*tail)->next;
+            *tail = p;
+            p->next = NULL;
+        }
+        return p;
+    }
+    return NULL;
+}
+
+static void* aead_spool_worker(void* arg) {
+    aead_spool* sp = &g_aead_spool;
+    int me = ((aead_spool_arg*)arg)->index;
+    unsigned char aad[APP_STREAM_AAD_MAX + APP_REC_HDR_LEN];
+    unsigned char nonce[APP_IV_LEN];
+
+    pthread_mutex_lock(&sp->mu);
+    for (;;) {
+        aead_pstream* p = aead_spool_take(sp);
+        if (!p) {
+            if (sp->stop) break;
+            pthread_cond_wait(&sp->work, &sp->mu);
+            continue;
+        }
+        aead_pslot* s = &p->slots[p->next_seal++ % p->nslots];
+        s->state = APP_PSLOT_SEALING;
+        p->busy++;
+        pthread_mutex_unlock(&sp->mu);
+
+        aead_ctx w;
+        int ctlen = 0, ok = 1;
+        memset(&w, 0, sizeof(w));
+        if (!p->wctx[me]) {
+            p->wctx[me] = EVP_CIPHER_CTX_new();
+            if (!p->wctx[me] || EVP_CIPHER_CTX_copy(p->wctx[me], p->a->ctx) != 1) ok = 0;
+        }
+        w.ctx = p->wctx[me];
+        memcpy(aad, p->aad, p->aadlen);
+        aead_rec_put_hdr(s->frame, s->ptlen + APP_TAG_LEN, s->final ? APP_REC_FINAL : 0);
+        memcpy(aad + p->aadlen, s->frame, APP_REC_HDR_LEN);
+        aead_nonce_xor(p->a->iv, s->seq, nonce);
+        ok = ok && aead_ctx_seal(&w, aad, p->aadlen + APP_REC_HDR_LEN, nonce,
+                                 APP_REC_PAYLOAD(s->frame), s->ptlen, APP_REC_PAYLOAD(s->frame), &ctlen) &&
+             aead_record_log(p->a, 0, s->seq, s->frame, APP_REC_HDR_LEN + ctlen);
+        s->flen = APP_REC_HDR_LEN + ctlen;
+
+        pthread_mutex_lock(&sp->mu);
+        s->state = APP_PSLOT_SEALED;
+        p->busy--;
+        if (!ok) p->failed = 1;
+        pthread_cond_broadcast(&p->ready);
+    }
+    pthread_mutex_unlock(&sp->mu);
+    return NULL;
+}
+
+// Start the shared pool with nthreads workers (capped at
+// APP_PSTREAM_MAX_THREADS). A running pool is kept as it is.
+// returns 1 on success (at least one worker), 0 on failure.
+static int aead_spool_start(int nthreads) {
+    aead_spool* sp = &g_aead_spool;
+    if (nthreads > APP_PSTREAM_MAX_THREADS) nthreads = APP_PSTREAM_MAX_THREADS;
+    pthread_mutex_lock(&sp->mu);
+    sp->stop = 0;
+    while (sp->nthreads < nthreads) {
+        g_aead_spool_args[sp->nthreads].index = sp->nthreads;
+        if (pthread_create(&sp->th[sp->nthreads], NULL, aead_spool_worker, &g_aead_spool_args[sp->nthreads]) != 0) break;
+        sp->nthreads++;
+    }
+    int ok = sp->nthreads > 0;
+    pthread_mutex_unlock(&sp->mu);
+    return ok;
+}
+
+// Stop and join the pool workers. Streams still open finish their queued
+// chunks first; call it only when no new stream can start.
+static void aead_spool_stop(void) {
+    aead_spool* sp = &g_aead_spool;
+    pthread_mutex_lock(&sp->mu);
+    sp->stop = 1;
+    int n = sp->nthreads;
+    pthread_cond_broadcast(&sp->work);
+    pthread_mutex_unlock(&sp->mu);
+    for (int i = 0; i < n; i++) pthread_join(sp->th[i], NULL);
+    pthread_mutex_lock(&sp->mu);
+    sp->nthreads = 0;
+    pthread_mutex_unlock(&sp->mu);
+}
+
+// Same contract and output as aead_encrypt_stream() without epochs, sealing
+// on the shared pool with up to nthreads chunks per worker thread in flight
+// (nthreads <= 1 falls back to the serial path). The pool is started with
+// nthreads workers if the program has not started it.
+// a must have an iv set; its sequence advances by the number of chunks.
+// returns 1 on success, 0 on failure.
+static int aead_encrypt_stream_mt(aead_ctx* a, const unsigned char* aad, int aadlen,
+                                  aead_read_fn rd, void* rd_io,
+                                  aead_write_fn wr, void* wr_io, int nthreads) {
+    if (nthreads <= 1) return aead_encrypt_stream(a, aad, aadlen, rd, rd_io, wr, wr_io, NULL);
+    if (!a->has_iv || aadlen < 0 || aadlen > APP_STREAM_AAD_MAX) return 0;
+    if (nthreads > APP_PSTREAM_MAX_THREADS) nthreads = APP_PSTREAM_MAX_THREADS;
+
+    aead_spool* sp = &g_aead_spool;
+    pthread_mutex_lock(&sp->mu);
+    int running = sp->nthreads;
+    pthread_mutex_unlock(&sp->mu);
+    if (!running && !aead_spool_start(nthreads)) return 0;
+
+    aead_pstream p;
+    int ok = 0, eof = 0;
+    uint64_t next_write = 0;
+
+    memset(&p, 0, sizeof(p));
+    p.nslots = nthreads * APP_PSTREAM_SLOTS_PER_THREAD;
+    p.slots = (aead_pslot*)calloc((size_t)p.nslots, sizeof(aead_pslot));
+    if (!p.slots) return 0;
+    for (int i = 0; i < p.nslots; i++) {
+        if (!(p.slots[i].frame = app_buf_get())) {
+            while (i-- > 0) app_buf_put(p.slots[i].frame, 0);
+            free(p.slots);
+            return 0;
+        }
+    }
+    p.a = a;
+    if (aadlen > 0) memcpy(p.aad, aad, aadlen);
+    p.aadlen = aadlen;
+    pthread_cond_init(&p.ready, NULL);
+
+    pthread_mutex_lock(&sp->mu);
+    p.next = sp->streams;
+    sp->streams = &p;
+    pthread_mutex_unlock(&sp->mu);
+
+    for (;;) {
+        // Fill every free slot. A short read is the final chunk; a full chunk
+        // at EOF is followed by an empty final one, as in the serial path.
+        while (!eof && p.next_fill - next_write < (uint64_t)p.nslots) {
+            aead_pslot* s = &p.slots[p.next_fill % p.nslots];
+            int len = aead_read_full(rd, rd_io, APP_REC_PAYLOAD(s->frame), APP_STREAM_CHUNK);
+            if (len < 0 || a->seq + p.next_fill == UINT64_MAX) goto done;
+            s->ptlen = len;
+            s->final = len < APP_STREAM_CHUNK;
+            s->seq = a->seq + p.next_fill;
+            eof = s->final;
+
+            pthread_mutex_lock(&sp->mu);
+            s->state = APP_PSLOT_FILLED;
+            p.next_fill++;
+            pthread_cond_signal(&sp->work);
+            int head_ready = p.slots[next_write % p.nslots].state == APP_PSLOT_SEALED;
+            pthread_mutex_unlock(&sp->mu);
+            if (head_ready) break;   // keep the socket busy
+        }
+
+        // Write the oldest slot once it is sealed.
+        pthread_mutex_lock(&sp->mu);
+        while (!p.failed && next_write < p.next_fill &&
+               p.slots[next_write % p.nslots].state != APP_PSLOT_SEALED) {
+            pthread_cond_wait(&p.ready, &sp->mu);
+        }
+        int failed = p.failed;
+        pthread_mutex_unlock(&sp->mu);
+        if (failed) goto done;
+        if (next_write == p.next_fill) { ok = eof; break; }
+
+        aead_pslot* s = &p.slots[next_write % p.nslots];
+        if (!wr(wr_io, s->frame, s->flen)) goto done;
+        s->state = APP_PSLOT_FREE;   // the caller alone touches FREE slots
+        next_write++;
+    }
+
+done:
+    // Drop queued work, wait for chunks being sealed, then leave the pool.
+    pthread_mutex_lock(&sp->mu);
+    p.next_seal = p.next_fill;
+    while (p.busy) pthread_cond_wait(&p.ready, &sp->mu);
+    for (aead_pstream** pp = &sp->streams; *pp; pp = &(*pp)->next) {
+        if (*pp == &p) { *pp = p.next; break; }
+    }
+    pthread_mutex_unlock(&sp->mu);
+
+    a->seq += p.next_fill;
+    for (int i = 0; i < APP_PSTREAM_MAX_THREADS; i++) EVP_CIPHER_CTX_free(p.wctx[i]);
+    for (int i = 0; i < p.nslots; i++) app_buf_put(p.slots[i].frame, APP_STREAM_FRAME_MAX);
+    free(p.slots);
+    pthread_cond_destroy(&p.ready);
+    return ok;
+}
+
+#endif // HYBRID_PSTREAM_H
@@ -0,0 +1,354 @@
+#ifndef HYBRID_QKDPOOL_H
+#define HYBRID_QKDPOOL_H
+
+// Stage69 QKD key pool (ASCII only)
+// Shared-memory ring of pre-delivered QKD key material. One producer (the
+// QKD link feeder, qkd69_pool) appends keys; any number of server threads or
+// processes claim them without locks. A claimed key is identified by its
+// key id, which the server sends in-band; the peer copy of the pool looks
+// the same id up, so both ends feed identical material into
+// derive_app_keys(). When the pool is missing or empty the session falls
+// back to the TLS exporter stand-in, so setup never blocks on the key source;
+// such misses are counted in the header (stalls) for the feeder to react to.
+//
+// Slot life cycle (state word, CAS-guarded):
+//   EMPTY -> READY    producer wrote a key at position head
+//   READY -> CLAIMED  a consumer won the CAS on tail for that position
+//   CLAIMED -> EMPTY  the peer fetched the key by id (zeroized), or the
+//                     producer reclaimed it after QKD_POOL_CLAIM_TTL seconds
+//
+// Shards: the ring can be split into nshards independent rings, each with its
+// own head/tail lines and slots in its own page-aligned region, which the
+// producer binds to NUMA node (shard % nodes) at creation. The producer fills
+// shards round robin; a consumer thread claims from its home shard
+// (qkd_pool_set_home) and takes from the others only when that one is empty,
+// so a pinned worker's claims stay on its node. Key ids interleave the
+// shards (id = pos * nshards + shard), so with one shard nothing changes.
+
+#include <openssl/crypto.h>
+#include <openssl/ssl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hybrid_common.h"
+#include "hybrid_numa.h"
+
+#define QKD_POOL_NAME      "/stage69-qkd"
+#define QKD_POOL_MAGIC     0x5354363951504f4cULL   // "ST69QPOL"
+#define QKD_POOL_VERSION   3
+#define QKD_POOL_MAX_SHARDS 64
+#define QKD_POOL_KEY_LEN   64
+#define QKD_POOL_CLAIM_TTL 5
+
+#define QKD_KEYID_LEN  9            // 'Q' || key id (8 bytes, big endian)
+#define QKD_KEYID_NONE UINT64_MAX   // no pool key: exporter stand-in only
+
+enum { QKD_SLOT_EMPTY, QKD_SLOT_READY, QKD_SLOT_CLAIMED, QKD_SLOT_BUSY };
+
+typedef struct {
+    _Atomic uint32_t state;
+    uint32_t claimed_at;                 // CLOCK_MONOTONIC seconds
+    uint64_t key_id;
+    unsigned char key[QKD_POOL_KEY_LEN];
+    unsigned char pad[48];               // one slot per 128-byte pair of lines
+} qkd_pool_slot;
+
+// First page of the mapping; shard regions follow at QKD_POOL_REGION(i).
+typedef struct {
+    _Atomic uint64_t magic;              // written last on create
+    uint32_t version;
+    uint32_t nslots;                     // all shards
+    uint32_t nshards;
+    uint32_t shard_slots;                // slots per shard
+    uint64_t region_len;                 // bytes per shard region, page multiple
+    unsigned char pad[32];
+} qkd_pool_hdr;
+
+// Start of each shard region, followed by its shard_slots slots.
+typedef struct {
+    _Atomic uint64_t head;               // next position the producer fills
+    uint32_t node;                       // NUMA node the producer bound it to
+    unsigned char pad0[52];
+    _Atomic uint64_t tail;               // next position a consumer claims
+    _Atomic uint64_t claims;             // keys handed out
+    _Atomic uint64_t stalls;             // claims that found the pool empty (home shard)
+    unsigned char pad1[40];
+} qkd_pool_shard;
+
+typedef struct {
+    qkd_pool_hdr*  hdr;
+    size_t maplen;
+    uint32_t put_next;                   // producer only: next shard to fill
+} qkd_pool;
+
+static __thread uint32_t g_qkd_pool_home;   // consumer thread's home shard
+
+static qkd_pool_shard* qkd_pool_shard_at(const qkd_pool* p, uint32_t i) {
+    return (qkd_pool_shard*)((unsigned char*)p->hdr + APP_NUMA_PAGE + (size_t)i * p->hdr->region_len);
+}
+
+static qkd_pool_slot* qkd_pool_slot_at(const qkd_pool* p, uint32_t i, uint64_t pos) {
+    return (qkd_pool_slot*)(qkd_pool_shard_at(p, i) + 1) + pos % p->hdr->shard_slots;
+}
+
+static uint32_t qkd_pool_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec;
+}
+
+// Map the pool. create=1 makes (or resets) it with nslots slots split over
+// nshards shards (rounded up to a whole number per shard), binding shard i to
+// NUMA node i % nodes; create=0 attaches to an existing one and checks its
+// header.
+static int qkd_pool_open_shards(qkd_pool* p, const char* name, int create,
+                                uint32_t nslots, uint32_t nshards) {
+    memset(p, 0, sizeof(*p));
+    int fd = shm_open(name, create ? (O_RDWR | O_CREAT) : O_RDWR, 0600);
+    if (fd < 0) return 0;
+
+    uint32_t per = 0;
+    size_t region = 0;
+    if (create) {
+        if (nslots == 0 || nshards == 0 || nshards > QKD_POOL_MAX_SHARDS) { close(fd); return 0; }
+        per = (nslots + nshards - 1) / nshards;
+        region = sizeof(qkd_pool_shard) + (size_t)per * sizeof(qkd_pool_slot);
+        region = (region + APP_NUMA_PAGE - 1) / APP_NUMA_PAGE * APP_NUMA_PAGE;
+        p->maplen = APP_NUMA_PAGE + (size_t)nshards * region;
+        if (ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t)p->maplen) != 0) { close(fd); return 0; }
+    } else {
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < APP_NUMA_PAGE) { close(fd); return 0; }
+        p->maplen = (size_t)st.st_size;
+    }
+
+    void* m = mmap(NULL, p->maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) return 0;
+    p->hdr = (qkd_pool_hdr*)m;
+
+    if (create) {
+        int nodes = app_numa_nodes();
+        p->hdr->nslots      = per * nshards;
+        p->hdr->nshards     = nshards;
+        p->hdr->shard_slots = per;
+        p->hdr->region_len  = region;
+        p->hdr->version     = QKD_POOL_VERSION;
+        for (uint32_t i = 0; i < nshards; i++) {
+            qkd_pool_shard* sh = qkd_pool_shard_at(p, i);
+            uint32_t node = nodes > 1 ? i % (uint32_t)nodes : 0;
+            app_numa_bind(sh, region, (int)node);   // before the first touch below
+            atomic_store(&sh->head, 0);
+            atomic_store(&sh->tail, 0);
+            atomic_store(&sh->claims, 0);
+            atomic_store(&sh->stalls, 0);
+            sh->node = node;
+        }
+        atomic_store_explicit(&p->hdr->magic, QKD_POOL_MAGIC, memory_order_release);
+    } else if (atomic_load_explicit(&p->hdr->magic, memory_order_acquire) != QKD_POOL_MAGIC ||
+               p->hdr->version != QKD_POOL_VERSION ||
+               p->hdr->nshards == 0 || p->hdr->nshards > QKD_POOL_MAX_SHARDS || p->hdr->shard_slots == 0 ||
+               p->hdr->nslots != p->hdr->shard_slots * p->hdr->nshards ||
+               p->hdr->region_len < sizeof(qkd_pool_shard) + (size_t)p->hdr->shard_slots * sizeof(qkd_pool_slot) ||
+               p->maplen < APP_NUMA_PAGE + (size_t)p->hdr->nshards * p->hdr->region_len) {
+        munmap(m, p->maplen);
+        memset(p, 0, sizeof(*p));
+        return 0;
+    }
+    return 1;
+}
+
+static int qkd_pool_open(qkd_pool* p, const char* name, int create, uint32_t nslots) {
+    return qkd_pool_open_shards(p, name, create, nslots, 1);
+}
+
+static void qkd_pool_close(qkd_pool* p) {
+    if (p->hdr) munmap(p->hdr, p->maplen);
+    memset(p, 0, sizeof(*p));
+}
+
+// Zeroize every slot (producer, before removing the pool).
+static void qkd_pool_wipe(qkd_pool* p) {
+    for (uint32_t i = 0; i < p->hdr->nshards; i++) {
+        OPENSSL_cleanse(qkd_pool_slot_at(p, i, 0), (size_t)p->hdr->shard_slots * sizeof(qkd_pool_slot));
+    }
+}
+
+// Home shard for a consumer on NUMA node node: the ordinal-th shard bound to
+// that node, or any shard if none is.
+static uint32_t qkd_pool_home_for_node(const qkd_pool* p, int node, int ordinal) {
+    uint32_t local[QKD_POOL_MAX_SHARDS], n = 0;
+    for (uint32_t i = 0; i < p->hdr->nshards; i++) {
+        if (qkd_pool_shard_at(p, i)->node == (uint32_t)node) local[n++] = i;
+    }
+    if (ordinal < 0) ordinal = 0;
+    return n ? local[(uint32_t)ordinal % n] : (uint32_t)ordinal % p->hdr->nshards;
+}
+
+// Set the calling thread's home shard for qkd_pool_claim().
+static void qkd_pool_set_home(uint32_t shard) {
+    g_qkd_pool_home = shard;
+}
+
+// Keys waiting to be claimed in one shard (approximate under concurrency).
+static uint64_t qkd_pool_shard_available(const qkd_pool_shard* sh) {
+    uint64_t h = atomic_load_explicit(&sh->head, memory_order_acquire);
+    uint64_t t = atomic_load_explicit(&sh->tail, memory_order_acquire);
+    return h > t ? h - t : 0;
+}
+
+// Keys waiting to be claimed, all shards (approximate under concurrency).
+static uint64_t qkd_pool_available(const qkd_pool* p) {
+    uint64_t n = 0;
+    for (uint32_t i = 0; i < p->hdr->nshards; i++) n += qkd_pool_shard_available(qkd_pool_shard_at(p, i));
+    return n;
+}
+
+static uint64_t qkd_pool_claims(const qkd_pool* p) {
+    uint64_t n = 0;
+    for (uint32_t i = 0; i < p->hdr->nshards; i++) n += atomic_load(&qkd_pool_shard_at(p, i)->claims);
+    return n;
+}
+
+static uint64_t qkd_pool_stalls(const qkd_pool* p) {
+    uint64_t n = 0;
+    for (uint32_t i = 0; i < p->hdr->nshards; i++) n += atomic_load(&qkd_pool_shard_at(p, i)->stalls);
+    return n;
+}
+
+static int qkd_pool_put_shard(qkd_pool* p, uint32_t i, const unsigned char key[QKD_POOL_KEY_LEN]) {
+    qkd_pool_shard* sh = qkd_pool_shard_at(p, i);
+    uint64_t pos = atomic_load_explicit(&sh->head, memory_order_relaxed);
+    qkd_pool_slot* s = qkd_pool_slot_at(p, i, pos);
+
+    uint32_t st = atomic_load_explicit(&s->state, memory_order_acquire);
+    if (st == QKD_SLOT_CLAIMED && qkd_pool_now() - s->claimed_at >= QKD_POOL_CLAIM_TTL) {
+        // Peer never fetched it; take the slot back unless it is fetching right now.
+        if (!atomic_compare_exchange_strong(&s->state, &st, QKD_SLOT_BUSY)) return 0;
+        OPENSSL_cleanse(s->key, sizeof(s->key));
+    } else if (st != QKD_SLOT_EMPTY) {
+        return 0;
+    }
+
+    memcpy(s->key, key, QKD_POOL_KEY_LEN);
+    s->key_id = pos * p->hdr->nshards + i;
+    atomic_store_explicit(&s->state, QKD_SLOT_READY, memory_order_release);
+    atomic_store_explicit(&sh->head, pos + 1, memory_order_release);
+    return 1;
+}
+
+// Producer only. Appends to the next shard with room, round robin.
+// Returns 1 if the key was appended, 0 if every shard is full.
+static int qkd_pool_put(qkd_pool* p, const unsigned char key[QKD_POOL_KEY_LEN]) {
+    uint32_t n = p->hdr->nshards;
+    for (uint32_t k = 0; k < n; k++) {
+        uint32_t i = (p->put_next + k) % n;
+        if (qkd_pool_put_shard(p, i, key)) {
+            p->put_next = (i + 1) % n;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int qkd_pool_claim_shard(qkd_pool* p, uint32_t i, unsigned char out[QKD_POOL_KEY_LEN], uint64_t* key_id) {
+    qkd_pool_shard* sh = qkd_pool_shard_at(p, i);
+    uint64_t t = atomic_load_explicit(&sh->tail, memory_order_acquire);
+    for (;;) {
+        if (t >= atomic_load_explicit(&sh->head, memory_order_acquire)) return 0;
+        if (atomic_compare_exchange_weak_explicit(&sh->tail, &t, t + 1,
+                                                  memory_order_acq_rel, memory_order_acquire)) break;
+    }
+    // The slot stays READY until we mark it, so the producer cannot reuse it under us.
+    qkd_pool_slot* s = qkd_pool_slot_at(p, i, t);
+    memcpy(out, s->key, QKD_POOL_KEY_LEN);
+    *key_id = s->key_id;
+    atomic_fetch_add_explicit(&sh->claims, 1, memory_order_relaxed);
+    s->claimed_at = qkd_pool_now();
+    atomic_store_explicit(&s->state, QKD_SLOT_CLAIMED, memory_order_release);
+    return 1;
+}
+
+// Consumer (any thread/process). Claims the oldest key of the calling
+// thread's home shard, else of the next non-empty shard; 0 if all are empty.
+static int qkd_pool_claim(qkd_pool* p, unsigned char out[QKD_POOL_KEY_LEN], uint64_t* key_id) {
+    uint32_t n = p->hdr->nshards, home = g_qkd_pool_home % n;
+    for (uint32_t k = 0; k < n; k++) {
+        if (qkd_pool_claim_shard(p, (home + k) % n, out, key_id)) return 1;
+    }
+    atomic_fetch_add_explicit(&qkd_pool_shard_at(p, home)->stalls, 1, memory_order_relaxed);
+    return 0;
+}
+
+// Peer side: copy the key with this id and free its slot. 0 if it is gone.
+static int qkd_pool_fetch(qkd_pool* p, uint64_t key_id, unsigned char out[QKD_POOL_KEY_LEN]) {
+    uint32_t n = p->hdr->nshards;
+    qkd_pool_slot* s = qkd_pool_slot_at(p, (uint32_t)(key_id % n), key_id / n);
+    uint32_t st = QKD_SLOT_CLAIMED;
+    if (!atomic_compare_exchange_strong(&s->state, &st, QKD_SLOT_BUSY)) return 0;
+    if (s->key_id != key_id) {
+        atomic_store_explicit(&s->state, QKD_SLOT_CLAIMED, memory_order_release);
+        return 0;
+    }
+    memcpy(out, s->key, QKD_POOL_KEY_LEN);
+    OPENSSL_cleanse(s->key, sizeof(s->key));
+    atomic_store_explicit(&s->state, QKD_SLOT_EMPTY, memory_order_release);
+    return 1;
+}
+
+// ---- In-band key id -----------------------------------------------------
+static void qkd_keyid_put(unsigned char* p, uint64_t key_id) {
+    p[0] = 'Q';
+    for (int i = 0; i < 8; i++) p[1 + i] = (unsigned char)(key_id >> (56 - 8 * i));
+}
+
+static int qkd_keyid_get(const unsigned char* p, uint64_t* key_id) {
+    if (p[0] != 'Q') return 0;
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v = (v << 8) | p[1 + i];
+    *key_id = v;
+    return 1;
+}
+
+// aead_rekey_fn backed by the pool (arg = qkd_pool*, hdr may be NULL).
+// Sender: claims a fresh key and sends its id; falls back to a ratchet
+// (QKD_KEYID_NONE, no material) when there is no pool or it is empty.
+// Receiver: fetches the key named by the id.
+static int qkd_pool_rekey_cb(void* arg, int enc, unsigned char* info, int* infolen,
+                             unsigned char* material, size_t* mlen) {
+    qkd_pool* p = (qkd_pool*)arg;
+    uint64_t id = QKD_KEYID_NONE;
+    *mlen = 0;
+    if (enc) {
+        if (p->hdr && qkd_pool_claim(p, material, &id)) *mlen = QKD_POOL_KEY_LEN;
+        qkd_keyid_put(info, id);
+        *infolen = QKD_KEYID_LEN;
+        return 1;
+    }
+    if (*infolen != QKD_KEYID_LEN || !qkd_keyid_get(info, &id)) return 0;
+    if (id == QKD_KEYID_NONE) return 1;
+    if (!p->hdr || !qkd_pool_fetch(p, id, material)) return 0;
+    *mlen = QKD_POOL_KEY_LEN;
+    return 1;
+}
+
+// Session secret for derive_app_keys(): the TLS exporter, followed by the
+// pool key when one was claimed. Either half alone keeps the session keys
+// secret, which is the point of the hybrid. Returns the length, 0 on failure.
+#define QKD_SECRET_MAX (64 + QKD_POOL_KEY_LEN)
+
+static size_t qkd_session_secret(SSL* ssl, const unsigned char* pool_key,
+                                 unsigned char out[QKD_SECRET_MAX]) {
+    if (!qkd_standin_from_tls(ssl, out, 64)) return 0;
+    if (!pool_key) return 64;
+    memcpy(out + 64, pool_key, QKD_POOL_KEY_LEN);
+    return QKD_SECRET_MAX;
+}
+
+#endif // HYBRID_QKDPOOL_H
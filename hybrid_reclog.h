@@ -0,0 +1,389 @@
+#ifndef HYBRID_RECLOG_H
+#define HYBRID_RECLOG_H
+
+// Stage69 sealed record log (ASCII only)
+// Append-only binary log of every sealed frame, for audit and replay. The
+// file is mapped shared; senders copy a frame into it and return, and a
+// background flusher makes the written prefix durable with one msync per
+// interval for everything appended meanwhile (group commit). Nothing on the
+// send path waits for the disk: the file's blocks are reserved at open
+// (posix_fallocate) and the flusher maps the window ahead of the tail
+// writable in advance (MADV_POPULATE_WRITE), so a sender's copy does not
+// fault into the filesystem for block allocation or a page-cache fill. A
+// sender that outruns the window, or memory pressure that evicts it, can
+// still take such a fault.
+//
+// File   = header page (APP_RECLOG_DATA bytes) || entry || entry || ...
+// Entry  = app_reclog_entry (32 bytes) || frame (len bytes) || pad to 8
+// Frame  = hdr(5) || ct || tag as sealed (the record sink, hybrid_common.h)
+//
+// Writers reserve space with one atomic add and store len last (release),
+// so an entry with len 0 is not complete yet. The flusher walks complete
+// entries in file order, fills in their CRC-32C, msyncs them, then advances
+// committed in the header and msyncs the header. A reader trusts committed
+// only, so a crash loses at most the last interval and never yields a torn
+// entry. Reopening a log resumes after committed; the stale tail is cut off.
+// stream is an id the log hands out (app_reclog_stream), unique within the
+// file, and together with epoch and counter names the key and nonce of the
+// record. The capacity is fixed at creation: a full log fails the append,
+// and with the record sink that fails the seal, so nothing goes out unlogged.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hybrid_common.h"
+
+#define APP_RECLOG_MAGIC "S69RLOG1"
+#define APP_RECLOG_VERSION 1
+#define APP_RECLOG_DATA 4096            // header page; entries start here
+#define APP_RECLOG_COMMIT_MS 5          // default group commit interval
+#define APP_RECLOG_PREFAULT (4u << 20)  // bytes the flusher maps ahead of the tail
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_len;                 // sizeof(app_reclog_entry)
+    uint64_t capacity;                  // entry bytes after the header page
+    _Atomic uint64_t committed;         // entry bytes known durable
+    _Atomic uint64_t next_stream;       // last stream id handed out
+} app_reclog_hdr;
+
+typedef struct {
+    _Atomic uint32_t len;               // frame bytes, stored last; 0 = not complete
+    uint32_t epoch;
+    uint64_t stream;
+    uint64_t counter;
+    uint32_t crc;                       // CRC-32C of the entry (crc = 0) and frame, by the flusher
+    uint32_t pad;
+} app_reclog_entry;
+
+_Static_assert(sizeof(app_reclog_entry) == 32, "entry header layout");
+_Static_assert(sizeof(app_reclog_hdr) <= APP_RECLOG_DATA, "header fits its page");
+
+static size_t app_reclog_entry_size(uint32_t len) {
+    return (sizeof(app_reclog_entry) + len + 7) & ~(size_t)7;
+}
+
+// ---- CRC-32C ------------------------------------------------------------
+// SSE4.2 crc32 instruction when the CPU has it (several GB/s, so a scan runs
+// at disk speed), a byte table otherwise.
+static uint32_t g_app_crc32c_table[256];
+static pthread_once_t g_app_crc32c_once = PTHREAD_ONCE_INIT;
+static int g_app_crc32c_hw;
+
+static void app_crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c >> 1) ^ (0x82F63B78u & (0u - (c & 1)));
+        g_app_crc32c_table[i] = c;
+    }
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    g_app_crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t app_crc32c_hw(uint32_t crc, const unsigned char* p, size_t n) {
+    uint64_t c = crc;
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = __builtin_ia32_crc32di(c, v);
+    }
+    uint32_t c32 = (uint32_t)c;
+    for (; n; p++, n--) c32 = __builtin_ia32_crc32qi(c32, *p);
+    return c32;
+}
+#endif
+
+// Continue a CRC-32C (start with 0).
+static uint32_t app_crc32c(uint32_t crc, const void* data, size_t n) {
+    const unsigned char* p = (const unsigned char*)data;
+    pthread_once(&g_app_crc32c_once, app_crc32c_init);
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (g_app_crc32c_hw) return ~app_crc32c_hw(crc, p, n);
+#endif
+    for (; n; p++, n--) crc = g_app_crc32c_table[(crc ^ *p) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t app_reclog_entry_crc(const app_reclog_entry* e, uint32_t len) {
+    app_reclog_entry h = *e;
+    h.len = len;
+    h.crc = 0;
+    return app_crc32c(app_crc32c(0, &h, sizeof(h)), e + 1, len);
+}
+
+// ---- Writer -------------------------------------------------------------
+typedef struct {
+    int fd;
+    unsigned char* map;                 // whole file
+    app_reclog_hdr* hdr;
+    uint64_t cap;                       // = hdr->capacity
+    _Atomic uint64_t tail;              // entry bytes reserved
+    uint64_t scan;                      // flusher: end of the committed entries
+    uint64_t faulted;                   // flusher: entry bytes mapped writable so far
+    uintptr_t page;                     // msync alignment
+    _Atomic uint64_t full;              // appends refused for lack of space
+    int interval_ms;
+    _Atomic int stop;
+    int running;
+    pthread_t th;
+} app_reclog;
+
+// Commit every complete entry after the last commit: CRC, msync, then
+// advance committed. Single caller at a time (the flusher, or close).
+// returns the number of entries committed, -1 if msync failed.
+static long app_reclog_commit(app_reclog* l) {
+    uint64_t from = l->scan, at = from;
+    long n = 0;
+    while (at + sizeof(app_reclog_entry) <= l->cap) {
+        app_reclog_entry* e = (app_reclog_entry*)(l->map + APP_RECLOG_DATA + at);
+        uint32_t len = atomic_load_explicit(&e->len, memory_order_acquire);
+        if (!len) break;
+        e->crc = app_reclog_entry_crc(e, len);
+        at += app_reclog_entry_size(len);
+        n++;
+    }
+    if (!n) return 0;
+    uintptr_t lo = (uintptr_t)(APP_RECLOG_DATA + from) & ~(l->page - 1);
+    if (msync(l->map + lo, APP_RECLOG_DATA + at - lo, MS_SYNC) != 0) return -1;
+    atomic_store_explicit(&l->hdr->committed, at, memory_order_release);
+    if (msync(l->map, APP_RECLOG_DATA, MS_SYNC) != 0) return -1;
+    l->scan = at;
+    return n;
+}
+
+// Map entry bytes up to APP_RECLOG_PREFAULT past the tail writable, so the
+// appends that land there take no page fault. The populate does not change
+// the data, so writers already in the window are not disturbed. Single
+// caller at a time (open, then the flusher).
+static void app_reclog_prefault(app_reclog* l) {
+    uint64_t want = atomic_load_explicit(&l->tail, memory_order_relaxed) + APP_RECLOG_PREFAULT;
+    if (want > l->cap) want = l->cap;
+    if (want <= l->faulted) return;
+    uintptr_t lo = (uintptr_t)(APP_RECLOG_DATA + l->faulted) & ~(l->page - 1);
+    size_t len = (size_t)(APP_RECLOG_DATA + want - lo);
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(l->map + lo, len, MADV_POPULATE_WRITE) == 0) {
+        l->faulted = want;
+        return;
+    }
+#endif
+    madvise(l->map + lo, len, MADV_WILLNEED);   // older kernels: at least read the pages in
+    l->faulted = want;
+}
+
+static void* app_reclog_flusher(void* arg) {
+    app_reclog* l = (app_reclog*)arg;
+    struct timespec ts = { l->interval_ms / 1000, (long)(l->interval_ms % 1000) * 1000000L };
+    while (!atomic_load_explicit(&l->stop, memory_order_acquire)) {
+        nanosleep(&ts, NULL);
+        if (app_reclog_commit(l) < 0) perror("reclog msync");
+        app_reclog_prefault(l);
+    }
+    return NULL;
+}
+
+// Open or create a log file and start its flusher. capacity (entry bytes)
+// applies to a new file; an existing one keeps its own and resumes after its
+// committed entries. interval_ms <= 0 means APP_RECLOG_COMMIT_MS. The space
+// after committed is allocated on disk here, so a log that opens has room
+// for its whole capacity (ENOSPC otherwise).
+// returns 1 on success, 0 on failure (errno set; EINVAL = not a record log).
+static int app_reclog_open(app_reclog* l, const char* path, uint64_t capacity, int interval_ms) {
+    memset(l, 0, sizeof(*l));
+    l->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (l->fd < 0) return 0;
+    struct stat st;
+    app_reclog_hdr h;
+    if (fstat(l->fd, &st) != 0) goto err;
+    if (st.st_size == 0) {
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, APP_RECLOG_MAGIC, sizeof(h.magic));
+        h.version = APP_RECLOG_VERSION;
+        h.entry_len = sizeof(app_reclog_entry);
+        h.capacity = (capacity + 7) & ~(uint64_t)7;
+        if (h.capacity < sizeof(app_reclog_entry)) goto err_inval;
+        if (ftruncate(l->fd, (off_t)(APP_RECLOG_DATA + h.capacity)) != 0 ||
+            pwrite(l->fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) || fsync(l->fd) != 0) goto err;
+    } else {
+        if (pread(l->fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+            memcmp(h.magic, APP_RECLOG_MAGIC, sizeof(h.magic)) != 0 || h.version != APP_RECLOG_VERSION ||
+            h.entry_len != sizeof(app_reclog_entry) || (uint64_t)st.st_size != APP_RECLOG_DATA + h.capacity ||
+            h.committed > h.capacity) goto err_inval;
+        // the uncommitted tail may hold entries of a crashed run: zero it
+        if (ftruncate(l->fd, (off_t)(APP_RECLOG_DATA + h.committed)) != 0 ||
+            ftruncate(l->fd, st.st_size) != 0) goto err;
+    }
+    if (h.committed < h.capacity) {
+        int e = posix_fallocate(l->fd, (off_t)(APP_RECLOG_DATA + h.committed), (off_t)(h.capacity - h.committed));
+        if (e != 0) { errno = e; goto err; }
+    }
+    l->map = (unsigned char*)mmap(NULL, APP_RECLOG_DATA + h.capacity, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED, l->fd, 0);
+    if (l->map == MAP_FAILED) { l->map = NULL; goto err; }
+    l->hdr = (app_reclog_hdr*)l->map;
+    l->cap = h.capacity;
+    l->scan = h.committed;
+    l->page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    atomic_store(&l->tail, h.committed);
+    l->faulted = h.committed;
+    app_reclog_prefault(l);
+    l->interval_ms = interval_ms > 0 ? interval_ms : APP_RECLOG_COMMIT_MS;
+    if (pthread_create(&l->th, NULL, app_reclog_flusher, l) != 0) goto err;
+    l->running = 1;
+    return 1;
+err_inval:
+    errno = EINVAL;
+err:
+    {
+        int e = errno;
+        if (l->map) munmap(l->map, APP_RECLOG_DATA + l->cap);
+        close(l->fd);
+        memset(l, 0, sizeof(*l));
+        errno = e;
+    }
+    return 0;
+}
+
+// New stream id, unique within the file (also across reopens).
+static uint64_t app_reclog_stream(app_reclog* l) {
+    return atomic_fetch_add_explicit(&l->hdr->next_stream, 1, memory_order_relaxed) + 1;
+}
+
+// Copy one frame into the log. Thread-safe, never blocks on I/O.
+// returns 1 on success, 0 if the log is full (counted) or len is bad.
+static int app_reclog_append(app_reclog* l, uint64_t stream, uint32_t epoch, uint64_t counter,
+                             const unsigned char* frame, int len) {
+    if (len <= 0) return 0;
+    size_t need = app_reclog_entry_size((uint32_t)len);
+    uint64_t off = atomic_fetch_add_explicit(&l->tail, need, memory_order_relaxed);
+    if (off + need > l->cap) {
+        atomic_fetch_add_explicit(&l->full, 1, memory_order_relaxed);
+        return 0;
+    }
+    app_reclog_entry* e = (app_reclog_entry*)(l->map + APP_RECLOG_DATA + off);
+    e->epoch = epoch;
+    e->stream = stream;
+    e->counter = counter;
+    memcpy(e + 1, frame, (size_t)len);
+    atomic_store_explicit(&e->len, (uint32_t)len, memory_order_release);
+    return 1;
+}
+
+// Stop the flusher, commit what is complete and unmap. Appends must have stopped.
+// returns 1 on success, 0 if the final msync failed.
+static int app_reclog_close(app_reclog* l) {
+    int ok = 1;
+    if (!l->map) return 1;
+    if (l->running) {
+        atomic_store_explicit(&l->stop, 1, memory_order_release);
+        pthread_join(l->th, NULL);
+    }
+    ok = app_reclog_commit(l) >= 0;
+    munmap(l->map, APP_RECLOG_DATA + l->cap);
+    close(l->fd);
+    memset(l, 0, sizeof(*l));
+    return ok;
+}
+
+// ---- Record sink --------------------------------------------------------
+// One process-wide log behind g_aead_record_sink.
+static app_reclog* g_app_reclog;
+
+static int app_reclog_sink(uint64_t stream, uint32_t epoch, uint64_t counter,
+                           const unsigned char* frame, int len) {
+    return app_reclog_append(g_app_reclog, stream, epoch, counter, frame, len);
+}
+
+// Route sealed frames of contexts with a log_id into l. Call before threads start.
+static void app_reclog_install(app_reclog* l) {
+    g_app_reclog = l;
+    g_aead_record_sink = l ? app_reclog_sink : NULL;
+}
+
+// ---- Reader -------------------------------------------------------------
+typedef struct {
+    uint64_t entries;                   // committed entries checked
+    uint64_t bytes;                     // their frame bytes
+    uint64_t bad;                       // CRC or frame header mismatches
+    uint64_t bad_off;                   // entry offset of the first bad one
+    uint64_t committed, capacity;
+    uint64_t streams;                   // stream ids handed out
+} app_reclog_stats;
+
+// Visitor for app_reclog_scan: ok is 0 for a damaged entry. returns 1 to go on, 0 to stop.
+typedef int (*app_reclog_visit_fn)(void* arg, const app_reclog_entry* e, const unsigned char* frame, int ok);
+
+// Map a log read-only and verify every committed entry: CRC-32C and a frame
+// header whose length matches the entry. fn (may be NULL) sees each entry.
+// returns 1 if the file is a record log and was scanned to the end (check
+// st->bad), 0 if it could not be read (errno set; EINVAL = not a record log)
+// or the committed region is malformed (st->bad_off says where).
+static int app_reclog_scan(const char* path, app_reclog_visit_fn fn, void* arg, app_reclog_stats* st) {
+    memset(st, 0, sizeof(*st));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    struct stat sb;
+    if (fstat(fd, &sb) != 0 || (uint64_t)sb.st_size < APP_RECLOG_DATA) {
+        close(fd);
+        errno = EINVAL;
+        return 0;
+    }
+    size_t size = (size_t)sb.st_size;
+    unsigned char* map = (unsigned char*)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+    const app_reclog_hdr* h = (const app_reclog_hdr*)map;
+    int ok = 0;
+    if (memcmp(h->magic, APP_RECLOG_MAGIC, sizeof(h->magic)) != 0 || h->version != APP_RECLOG_VERSION ||
+        h->entry_len != sizeof(app_reclog_entry) || size != APP_RECLOG_DATA + h->capacity ||
+        h->committed > h->capacity) {
+        errno = EINVAL;
+        goto done;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    st->committed = h->committed;
+    st->capacity = h->capacity;
+    st->streams = h->next_stream;
+
+    uint64_t at = 0, end = h->committed;
+    while (at < end) {
+        const app_reclog_entry* e = (const app_reclog_entry*)(map + APP_RECLOG_DATA + at);
+        uint32_t len = e->len;
+        if (end - at < sizeof(*e) || len == 0 || app_reclog_entry_size(len) > end - at) {
+            st->bad++;
+            if (st->bad == 1) st->bad_off = at;
+            goto done;      // lengths are not trustworthy from here on
+        }
+        const unsigned char* frame = (const unsigned char*)(e + 1);
+        int ctlen = 0;
+        unsigned char flags = 0;
+        int good = e->crc == app_reclog_entry_crc(e, len) && len >= APP_REC_HDR_LEN &&
+                   aead_rec_get_hdr(frame, &ctlen, &flags) && (uint32_t)(APP_REC_HDR_LEN + ctlen) == len;
+        if (!good && st->bad++ == 0) st->bad_off = at;
+        st->entries++;
+        st->bytes += len;
+        if (fn && !fn(arg, e, frame, good)) break;
+        at += app_reclog_entry_size(len);
+    }
+    ok = 1;
+done:
+    munmap(map, size);
+    return ok;
+}
+
+#endif // HYBRID_RECLOG_H
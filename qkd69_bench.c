@@ -0,0 +1,471 @@
+// qkd69_bench.c  —  Stage69 TLS+QKDハイブリッド : ベンチマーク
+//   build: cc -O2 -pthread -o qkd69_bench qkd69_bench.c -lssl -lcrypto
+//
+// -m micro : hybrid_common.h のプリミティブ単体
+//            aead_encrypt / aead_decrypt（呼び出し毎に鍵展開）、
+//            aead_ctx_seal_next / aead_ctx_open（鍵コンテキスト再利用）、derive_app_keys、
+//            aead_mb_seal（AEAD_MB_LANES セッションの小レコードを 1 回で封印）、
+//            aead_replay_check（再送検出ウィンドウ）
+// -m tls   : プロセス内の TLS 接続（BIO ペア、ネットワークなし）で
+//            ハンドシェイク+鍵導出 /s と、レコード層込みの送受信スループット・遅延
+// 結果は records/s、MB/s、p50/p99/p999 遅延（us）。
+// サーバー証明書は qkd69_s.c と同じ server.crt / server.key を使う。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+
+#include "hybrid_common.h"
+#include "hybrid_mb.h"
+
+#define CERT_FILE "server.crt"
+#define KEY_FILE  "server.key"
+
+static const int k_sizes[] = { 64, 256, 1024, 4096, 16384, 65536, 262144, 1048576 };
+#define N_SIZES ((int)(sizeof(k_sizes) / sizeof(k_sizes[0])))
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// ---- 遅延サンプル（上限を超えたら古いものから上書きするリング） ----------------
+#define LAT_CAP (1u << 21)
+
+typedef struct {
+    uint64_t *v;
+    size_t    n;      // 書き込んだ総数
+} lat_hist;
+
+static void lat_add(lat_hist *h, uint64_t ns)
+{
+    if (!h->v) {
+        h->v = malloc(LAT_CAP * sizeof(uint64_t));
+        if (!h->v) { perror("malloc"); exit(1); }
+    }
+    h->v[h->n % LAT_CAP] = ns;
+    h->n++;
+}
+
+static size_t lat_len(const lat_hist *h) { return h->n < LAT_CAP ? h->n : LAT_CAP; }
+
+static void lat_merge(lat_hist *dst, const lat_hist *src)
+{
+    for (size_t i = 0; i < lat_len(src); i++) lat_add(dst, src->v[i]);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// p は 0..1。呼ぶ前に lat_sort。
+static double lat_pct_us(const lat_hist *h, double p)
+{
+    size_t n = lat_len(h);
+    if (n == 0) return 0.0;
+    size_t i = (size_t)(p * (double)(n - 1));
+    return h->v[i] / 1e3;
+}
+
+static void lat_sort(lat_hist *h) { qsort(h->v, lat_len(h), sizeof(uint64_t), cmp_u64); }
+static void lat_free(lat_hist *h) { free(h->v); h->v = NULL; h->n = 0; }
+
+static void report(const char *op, int size, uint64_t ops, double secs, lat_hist *h)
+{
+    lat_sort(h);
+    printf("%-22s %8d %12.0f %10.2f %9.2f %9.2f %9.2f\n",
+           op, size, ops / secs, (double)ops * size / secs / 1e6,
+           lat_pct_us(h, 0.50), lat_pct_us(h, 0.99), lat_pct_us(h, 0.999));
+}
+
+static void report_header(void)
+{
+    printf("%-22s %8s %12s %10s %9s %9s %9s\n",
+           "op", "size", "records/s", "MB/s", "p50(us)", "p99(us)", "p999(us)");
+}
+
+// ---- micro: プリミティブ単体 ----------------------------------------------
+enum { OP_ENCRYPT, OP_SEAL_CTX, OP_DECRYPT, OP_OPEN_CTX, OP_DERIVE };
+static const char *k_op_names[] = {
+    "aead_encrypt", "aead_ctx_seal_next", "aead_decrypt", "aead_ctx_open", "derive_app_keys"
+};
+
+static int bench_micro_op(int op, int size, double secs)
+{
+    unsigned char key[APP_KEY_LEN], iv[APP_IV_LEN], qkd[64];
+    unsigned char k1[APP_KEY_LEN], k2[APP_KEY_LEN], i1[APP_IV_LEN], i2[APP_IV_LEN];
+    unsigned char *pt  = malloc((size_t)size);
+    unsigned char *ct  = malloc((size_t)size + APP_TAG_LEN);
+    unsigned char *out = malloc((size_t)size + APP_TAG_LEN);
+    if (!pt || !ct || !out) { perror("malloc"); exit(1); }
+    RAND_bytes(key, sizeof(key));
+    RAND_bytes(iv, sizeof(iv));
+    RAND_bytes(qkd, sizeof(qkd));
+    RAND_bytes(pt, size);
+
+    aead_ctx a;
+    if (!aead_ctx_init_suite(&a, crypto_rt_best_suite(), key)) return 0;
+    aead_ctx_set_iv(&a, iv);
+    int ctlen = 0, len = 0;
+    // 開封用の暗号文は計測するのと同じスイートで作る
+    if (op == OP_OPEN_CTX ? !aead_ctx_seal(&a, APP_AAD, (int)sizeof(APP_AAD)-1, iv, pt, size, ct, &ctlen)
+                          : !aead_encrypt(key, APP_AAD, (int)sizeof(APP_AAD)-1, iv, pt, size, ct, &ctlen)) return 0;
+
+    lat_hist h = {0};
+    uint64_t ops = 0, t_end = now_ns() + (uint64_t)(secs * 1e9), t0 = now_ns(), t;
+    int ok = 1;
+    do {
+        uint64_t s = now_ns();
+        switch (op) {
+        case OP_ENCRYPT:  ok = aead_encrypt(key, APP_AAD, (int)sizeof(APP_AAD)-1, iv, pt, size, out, &len); break;
+        case OP_SEAL_CTX: ok = aead_ctx_seal_next(&a, APP_AAD, (int)sizeof(APP_AAD)-1, pt, size, out, &len); break;
+        case OP_DECRYPT:  ok = aead_decrypt(key, APP_AAD, (int)sizeof(APP_AAD)-1, iv, ct, ctlen, out, &len); break;
+        case OP_OPEN_CTX: ok = aead_ctx_open(&a, APP_AAD, (int)sizeof(APP_AAD)-1, iv, ct, ctlen, out, &len); break;
+        default:          ok = derive_app_keys(qkd, sizeof(qkd), k1, k2, i1, i2); break;
+        }
+        t = now_ns();
+        lat_add(&h, t - s);
+        ops++;
+    } while (ok && t < t_end);
+
+    if (ok) report(k_op_names[op], op == OP_DERIVE ? 0 : size, ops, (t - t0) / 1e9, &h);
+    else    fprintf(stderr, "%s failed\n", k_op_names[op]);
+
+    lat_free(&h);
+    aead_ctx_free(&a);
+    free(pt); free(ct); free(out);
+    return ok;
+}
+
+// ---- micro: マルチバッファ封印（各セッション 1 レコード × AEAD_MB_LANES）----
+// 遅延は 1 バッチ分。records/s と MB/s はレコード単位。
+#define MB_MAX_SIZE 1024   // 小レコード向けなのでこの大きさまで
+
+static int bench_micro_mb(int size, double secs)
+{
+    aead_ctx a[AEAD_MB_LANES];
+    aead_mb_job jobs[AEAD_MB_LANES];
+    unsigned char key[APP_KEY_LEN], iv[APP_IV_LEN];
+    unsigned char *pt  = malloc((size_t)size);
+    unsigned char *out = malloc((size_t)AEAD_MB_LANES * (size_t)(size + APP_TAG_LEN));
+    if (!pt || !out) { perror("malloc"); exit(1); }
+    RAND_bytes(pt, size);
+
+    int ok = 1;
+    memset(a, 0, sizeof(a));
+    memset(jobs, 0, sizeof(jobs));
+    for (int l = 0; l < AEAD_MB_LANES && ok; l++) {
+        RAND_bytes(key, sizeof(key));
+        RAND_bytes(iv, sizeof(iv));
+        ok = aead_ctx_init_suite(&a[l], crypto_rt_best_suite(), key) && aead_ctx_mb_init(&a[l], key);
+        aead_ctx_set_iv(&a[l], iv);
+        jobs[l].a = &a[l];
+        jobs[l].aad = APP_AAD;
+        jobs[l].aadlen = (int)sizeof(APP_AAD)-1;
+        jobs[l].in = pt;
+        jobs[l].inlen = size;
+        jobs[l].out = out + (size_t)l * (size_t)(size + APP_TAG_LEN);
+    }
+    OPENSSL_cleanse(key, sizeof(key));
+
+    lat_hist h = {0};
+    uint64_t ops = 0, t_end = now_ns() + (uint64_t)(secs * 1e9), t0 = now_ns(), t = t0;
+    while (ok && t < t_end) {
+        uint64_t s = now_ns();
+        ok = aead_mb_seal(jobs, AEAD_MB_LANES) == AEAD_MB_LANES;
+        t = now_ns();
+        lat_add(&h, t - s);
+        ops += AEAD_MB_LANES;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "aead_mb_seal x%d%s", AEAD_MB_LANES, a[0].mb ? "" : " (evp)");
+    if (ok) report(name, size, ops, (t - t0) / 1e9, &h);
+    else    fprintf(stderr, "aead_mb_seal failed\n");
+
+    lat_free(&h);
+    for (int l = 0; l < AEAD_MB_LANES; l++) aead_ctx_free(&a[l]);
+    free(pt); free(out);
+    return ok;
+}
+
+// ---- micro: 再送検出ウィンドウ（aead_replay_check + update）-----------------
+// 番号は 0..63 の揺らぎ付きで増えていく（並べ替えと重複を含む）。AEAD は含まない。
+static int bench_micro_replay(double secs)
+{
+    aead_replay r;
+    aead_replay_reset(&r);
+    lat_hist h = {0};
+    uint64_t x = 88172645463325252ull, ops = 0, dup = 0;
+    uint64_t t_end = now_ns() + (uint64_t)(secs * 1e9), t0 = now_ns(), t;
+    do {
+        uint64_t s = now_ns();
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        uint64_t n = ops + (x & 63);
+        if (aead_replay_check(&r, n)) aead_replay_update(&r, n);
+        else dup++;
+        t = now_ns();
+        lat_add(&h, t - s);
+        ops++;
+    } while (t < t_end);
+
+    report("aead_replay_check", 0, ops, (t - t0) / 1e9, &h);
+    lat_free(&h);
+    return dup < ops;
+}
+
+static int bench_micro(int only_size, double secs)
+{
+    report_header();
+    for (int op = OP_ENCRYPT; op <= OP_OPEN_CTX; op++) {
+        for (int i = 0; i < N_SIZES; i++) {
+            if (only_size && k_sizes[i] != only_size) continue;
+            if (!bench_micro_op(op, k_sizes[i], secs)) return 0;
+        }
+    }
+    for (int i = 0; i < N_SIZES && k_sizes[i] <= MB_MAX_SIZE; i++) {
+        if (only_size && k_sizes[i] != only_size) continue;
+        if (!bench_micro_mb(k_sizes[i], secs)) return 0;
+    }
+    return bench_micro_replay(secs) && bench_micro_op(OP_DERIVE, 0, secs);
+}
+
+// ---- tls: BIO ペア上の TLS + ハイブリッドレコード層 ---------------------------
+typedef struct {
+    SSL *cli, *srv;
+    aead_ctx tx, rx;    // サーバー送信 / クライアント受信
+} tls_pair;
+
+static SSL_CTX *g_sctx, *g_cctx;
+
+static void tls_pair_free(tls_pair *p)
+{
+    aead_ctx_free(&p->tx);
+    aead_ctx_free(&p->rx);
+    SSL_free(p->cli);
+    SSL_free(p->srv);
+}
+
+// 両端のハンドシェイクを交互に進め、両側で鍵導出まで済ませる。成功で 1。
+static int tls_pair_open(tls_pair *p)
+{
+    BIO *bc = NULL, *bs = NULL;
+    memset(p, 0, sizeof(*p));
+    if (!BIO_new_bio_pair(&bc, 4 * APP_STREAM_FRAME_MAX, &bs, 4 * APP_STREAM_FRAME_MAX)) return 0;
+    p->cli = SSL_new(g_cctx);
+    p->srv = SSL_new(g_sctx);
+    if (!p->cli || !p->srv) { BIO_free(bc); BIO_free(bs); tls_pair_free(p); return 0; }
+    SSL_set_bio(p->cli, bc, bc);
+    SSL_set_bio(p->srv, bs, bs);
+    SSL_set_connect_state(p->cli);
+    SSL_set_accept_state(p->srv);
+
+    int dc = 0, ds = 0;
+    for (int spins = 0; !(dc && ds) && spins < 64; spins++) {
+        if (!dc) {
+            int r = SSL_do_handshake(p->cli);
+            if (r == 1) dc = 1;
+            else if (SSL_get_error(p->cli, r) != SSL_ERROR_WANT_READ) goto err;
+        }
+        if (!ds) {
+            int r = SSL_do_handshake(p->srv);
+            if (r == 1) ds = 1;
+            else if (SSL_get_error(p->srv, r) != SSL_ERROR_WANT_READ) goto err;
+        }
+    }
+    if (!(dc && ds)) goto err;
+
+    unsigned char qkd[64], k_tx[APP_KEY_LEN], k_rx[APP_KEY_LEN], iv_tx[APP_IV_LEN], iv_rx[APP_IV_LEN];
+    if (!qkd_standin_from_tls(p->srv, qkd, sizeof(qkd))) goto err;
+    if (!derive_app_keys(qkd, sizeof(qkd), k_tx, k_rx, iv_tx, iv_rx)) goto err;
+    if (!aead_ctx_init_suite(&p->tx, crypto_rt_best_suite(), k_tx)) goto err;
+    aead_ctx_set_iv(&p->tx, iv_tx);
+
+    if (!qkd_standin_from_tls(p->cli, qkd, sizeof(qkd))) goto err;
+    if (!derive_app_keys(qkd, sizeof(qkd), k_tx, k_rx, iv_tx, iv_rx)) goto err;
+    if (!aead_ctx_init_suite(&p->rx, crypto_rt_best_suite(), k_tx)) goto err;
+    aead_ctx_set_iv(&p->rx, iv_tx);
+    return 1;
+err:
+    ERR_print_errors_fp(stderr);
+    tls_pair_free(p);
+    return 0;
+}
+
+// 1メッセージ（size バイト、16KB チャンクのストリーム）をサーバー→クライアントへ。
+static int tls_pair_send(tls_pair *p, unsigned char *frame, int size)
+{
+    aead_stream ss, cs;
+    if (!aead_stream_init(&ss, &p->tx, APP_AAD, (int)sizeof(APP_AAD)-1)) return 0;
+    if (!aead_stream_init(&cs, &p->rx, APP_AAD, (int)sizeof(APP_AAD)-1)) return 0;
+
+    int left = size;
+    do {
+        int n = left < APP_STREAM_CHUNK ? left : APP_STREAM_CHUNK;
+        left -= n;
+        aead_rec r = { frame, n };
+        int flen = 0, got = 0, used = 0;
+        if (!aead_stream_seal_batch(&ss, &r, 1, left == 0, &flen)) return 0;
+        if (SSL_write(p->srv, frame, flen) != flen) return 0;
+        while (got < flen) {
+            int k = SSL_read(p->cli, frame + got, flen - got);
+            if (k <= 0) return 0;
+            got += k;
+        }
+        if (aead_stream_open_batch(&cs, frame, flen, &r, 1, &used) != 1) return 0;
+    } while (left > 0);
+    return cs.done;
+}
+
+typedef struct {
+    int      size;        // 0 = ハンドシェイクのみ
+    double   secs;
+    uint64_t ops;
+    double   elapsed;
+    lat_hist lat;
+    int      ok;
+} tls_job;
+
+static void *tls_worker(void *arg)
+{
+    tls_job *j = (tls_job *)arg;
+    uint64_t t0 = now_ns(), t_end = t0 + (uint64_t)(j->secs * 1e9), t;
+    tls_pair p;
+    unsigned char *frame = NULL;
+    j->ok = 1;
+
+    if (j->size > 0) {
+        frame = malloc(APP_STREAM_FRAME_MAX);
+        if (!frame || !tls_pair_open(&p)) { j->ok = 0; free(frame); return NULL; }
+        t0 = now_ns();
+        t_end = t0 + (uint64_t)(j->secs * 1e9);
+    }
+
+    do {
+        uint64_t s = now_ns();
+        if (j->size == 0) {
+            j->ok = tls_pair_open(&p);
+            if (j->ok) tls_pair_free(&p);
+        } else {
+            j->ok = tls_pair_send(&p, frame, j->size);
+        }
+        t = now_ns();
+        lat_add(&j->lat, t - s);
+        j->ops++;
+    } while (j->ok && t < t_end);
+
+    j->elapsed = (t - t0) / 1e9;
+    if (j->size > 0) { tls_pair_free(&p); free(frame); }
+    return NULL;
+}
+
+static int run_tls_jobs(const char *name, int size, int conc, double secs)
+{
+    tls_job   *jobs = calloc((size_t)conc, sizeof(*jobs));
+    pthread_t *ths  = calloc((size_t)conc, sizeof(*ths));
+    if (!jobs || !ths) { perror("calloc"); exit(1); }
+
+    for (int i = 0; i < conc; i++) {
+        jobs[i].size = size;
+        jobs[i].secs = secs;
+        pthread_create(&ths[i], NULL, tls_worker, &jobs[i]);
+    }
+
+    lat_hist all = {0};
+    uint64_t ops = 0;
+    double elapsed = 0;
+    int ok = 1;
+    for (int i = 0; i < conc; i++) {
+        pthread_join(ths[i], NULL);
+        ok &= jobs[i].ok;
+        ops += jobs[i].ops;
+        if (jobs[i].elapsed > elapsed) elapsed = jobs[i].elapsed;
+        lat_merge(&all, &jobs[i].lat);
+        lat_free(&jobs[i].lat);
+    }
+    if (ok) report(name, size, ops, elapsed, &all);
+    else    fprintf(stderr, "%s failed\n", name);
+
+    lat_free(&all);
+    free(jobs); free(ths);
+    return ok;
+}
+
+static int bench_tls(int only_size, int conc, double secs)
+{
+    g_sctx = SSL_CTX_new(TLS_server_method());
+    g_cctx = SSL_CTX_new(TLS_client_method());
+    if (!g_sctx || !g_cctx) { ERR_print_errors_fp(stderr); return 0; }
+    if (SSL_CTX_use_certificate_file(g_sctx, CERT_FILE, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_use_PrivateKey_file(g_sctx, KEY_FILE, SSL_FILETYPE_PEM) != 1) {
+        ERR_print_errors_fp(stderr);
+        return 0;
+    }
+
+    printf("# tls: concurrency=%d (handshakes/s = records/s of the handshake row)\n", conc);
+    report_header();
+    int ok = run_tls_jobs("handshake+derive", 0, conc, secs);
+    for (int i = 0; ok && i < N_SIZES; i++) {
+        if (only_size && k_sizes[i] != only_size) continue;
+        ok = run_tls_jobs("tls+record send/recv", k_sizes[i], conc, secs);
+    }
+
+    SSL_CTX_free(g_sctx);
+    SSL_CTX_free(g_cctx);
+    return ok;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-m micro|tls|all] [-s size] [-c concurrency] [-d seconds] [-a suite]\n"
+                    "  -s  message size in bytes (default: 64 B .. 1 MB sweep)\n"
+                    "  -c  tls mode worker threads (default 1)\n"
+                    "  -d  seconds per measurement (default 0.5)\n"
+                    "  -a  record suite for the keyed-context rows, e.g. chacha20 (default: by CPU)\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    const char *mode = "all";
+    int size = 0, conc = 1;
+    double secs = 0.5;
+    const char *suite = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "m:s:c:d:a:h")) != -1) {
+        switch (opt) {
+        case 'm': mode = optarg; break;
+        case 's': size = atoi(optarg); break;
+        case 'c': conc = atoi(optarg); break;
+        case 'd': secs = atof(optarg); break;
+        case 'a': suite = optarg; break;
+        default:  usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    int do_micro = !strcmp(mode, "micro") || !strcmp(mode, "all");
+    int do_tls   = !strcmp(mode, "tls")   || !strcmp(mode, "all");
+    if ((!do_micro && !do_tls) || size < 0 || conc < 1 || secs <= 0) { usage(argv[0]); return 1; }
+
+    if (!crypto_rt_init()) { ERR_print_errors_fp(stderr); return 1; }
+    if (suite && !crypto_rt_set_prefer(suite)) { fprintf(stderr, "unknown or unavailable suite %s\n", suite); return 1; }
+    printf("# aead: %s key=%d iv=%d tag=%d (aead_encrypt/aead_decrypt: %s, build default)\n",
+           app_suite_get(crypto_rt_best_suite())->name, APP_KEY_LEN, APP_IV_LEN, APP_TAG_LEN, APP_AEAD_NAME);
+
+    int ok = 1;
+    if (do_micro) ok = bench_micro(size, secs);
+    if (ok && do_tls) ok = bench_tls(size, conc, secs);
+    crypto_rt_cleanup();
+    return ok ? 0 : 1;
+}
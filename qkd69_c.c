@@ -1,106 +1,1116 @@
-// qkd69_c.c  —  最小動作のTLSクライアント（OpenSSL 3）
+// qkd69_c.c  —  Stage69 TLS+QKDハイブリッド : クライアント（OpenSSL 3）
 // 1) 127.0.0.1:8443 に TCP で接続
-// 2) TLS を開始してメッセージを送信
-// 3) サーバーからの応答を受信して表示
+// 2) TLS を開始し、サーバーが送る key id の QKD 鍵（-q の鍵プールから）と
+//    TLS エクスポータから受信鍵を導出
+// 3) 「hdr||ct||tag」のレコード列を受信・復号して表示（または -o でファイルへ）
+//    -n N で N 回接続を繰り返し、合計スループットを表示
+// 4) -r N なら同じ接続でリクエストを N 件パイプライン送信（応答を待たずに
+//    最大 -W 件まで先行）し、サーバーのエコー応答を検証して req/s と往復遅延を表示
+// 5) -L N なら負荷生成: -T 本のスレッドが epoll で計 N 本の接続を回し続け、
+//    -d 秒間のハンドシェイク・hello・リクエスト往復の遅延分布を表示（-u で接続レート上限）
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 
 // ▼ ネットワーク系で必須
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 // ▼ OpenSSL
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
+#include "hybrid_common.h"   // AEAD (aead_ctx)、ストリーム復号、HKDF 鍵導出
+#include "hybrid_qkdpool.h"  // 共有メモリの QKD 鍵プール（key id で取り出し）
+#include "hybrid_config.h"   // -C: 設定ファイル
+
+// 既定値（-C 設定ファイル / -H -P で実行時に変更）
 #define HOST "127.0.0.1"
 #define PORT 8443
 
+static const char *g_host = HOST;
+static int         g_port = PORT;
+static char        g_sess_key[64];   // "host:port"（セッションキャッシュの鍵）
+
 static void die(const char *where)
 {
     fprintf(stderr, "ERROR at %s: %s\n", where, strerror(errno));
     exit(1);
 }
 
-int main(void)
+static double now_sec(void)
 {
-    // --- OpenSSL 初期化 ---
-    SSL_load_error_strings();
-    OpenSSL_add_ssl_algorithms();
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
-    if (!ctx) {
-        ERR_print_errors_fp(stderr);
-        return 1;
+// ---- TLS セッションキャッシュ（host:port ごと、再接続でハンドシェイク短縮） ----
+// TLS 1.3 のチケットはハンドシェイク後に届くので new_session コールバックで保存し、
+// 次の接続で SSL_set_session して再開する（公開鍵演算なし）。
+// TLS 1.3 のチケットは使い捨て（使った接続が新チケットを受けると OpenSSL が
+// 元のセッションを再開不可にする）ので、host:port ごとに数枚を積んでおき
+// 1 接続 1 枚取り出す。-L では複数スレッドから使うので g_sess_mu で守る。
+#define SESS_CACHE_SLOTS 16
+#define SESS_TICKETS     8    // host:port ごとに持つチケット数
+
+typedef struct {
+    char         key[64];   // "host:port"
+    SSL_SESSION *sess[SESS_TICKETS];   // [0] が最古
+    int          n;
+} sess_entry;
+
+static sess_entry g_sess_cache[SESS_CACHE_SLOTS];
+static int        g_sess_next;          // 満杯時に置き換える位置
+static pthread_mutex_t g_sess_mu = PTHREAD_MUTEX_INITIALIZER;
+
+static sess_entry *sess_cache_find(const char *key, int create)
+{
+    for (int i = 0; i < SESS_CACHE_SLOTS; i++) {
+        if (g_sess_cache[i].key[0] && strcmp(g_sess_cache[i].key, key) == 0) return &g_sess_cache[i];
+    }
+    if (!create) return NULL;
+    for (int i = 0; i < SESS_CACHE_SLOTS; i++) {
+        if (!g_sess_cache[i].key[0]) { snprintf(g_sess_cache[i].key, sizeof(g_sess_cache[i].key), "%s", key); return &g_sess_cache[i]; }
     }
+    sess_entry *e = &g_sess_cache[g_sess_next];
+    g_sess_next = (g_sess_next + 1) % SESS_CACHE_SLOTS;
+    for (int i = 0; i < e->n; i++) SSL_SESSION_free(e->sess[i]);
+    e->n = 0;
+    snprintf(e->key, sizeof(e->key), "%s", key);
+    return e;
+}
 
-    // 必要ならサーバ証明書検証を有効化（自己署名なら無効でもOK）
-    // SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
-    // SSL_CTX_load_verify_locations(ctx, "server.crt", NULL);
+// SSL の app_data に host:port を持たせておく
+static int sess_new_cb(SSL *ssl, SSL_SESSION *sess)
+{
+    const char *key = SSL_get_app_data(ssl);
+    if (!key) return 0;
+    pthread_mutex_lock(&g_sess_mu);
+    sess_entry *e = sess_cache_find(key, 1);
+    if (e->n == SESS_TICKETS) {   // 満杯なら最古を捨てる
+        SSL_SESSION_free(e->sess[0]);
+        memmove(e->sess, e->sess + 1, (SESS_TICKETS - 1) * sizeof(e->sess[0]));
+        e->n--;
+    }
+    e->sess[e->n++] = sess;
+    pthread_mutex_unlock(&g_sess_mu);
+    return 1;   // 参照を引き取った
+}
 
-    // --- ソケット作成 & 接続 ---
-    int s = socket(AF_INET, SOCK_STREAM, 0);
-    if (s < 0) die("socket");
+static void sess_cache_free(void)
+{
+    for (int i = 0; i < SESS_CACHE_SLOTS; i++) {
+        for (int j = 0; j < g_sess_cache[i].n; j++) SSL_SESSION_free(g_sess_cache[i].sess[j]);
+        memset(&g_sess_cache[i], 0, sizeof(g_sess_cache[i]));
+    }
+}
 
+// ---- TCP 接続（nonblock なら connect は EINPROGRESS のまま返す）。失敗で -1 --
+static int tcp_connect(int nonblock)
+{
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
-    addr.sin_port   = htons(PORT);
-    if (inet_pton(AF_INET, HOST, &addr.sin_addr) != 1) {
+    addr.sin_port   = htons((uint16_t)g_port);
+    if (inet_pton(AF_INET, g_host, &addr.sin_addr) != 1) {
         fprintf(stderr, "inet_pton failed\n");
+        return -1;
+    }
+
+    int s = socket(AF_INET, SOCK_STREAM | (nonblock ? SOCK_NONBLOCK : 0), 0);
+    if (s < 0) return -1;
+    // パイプライン（-r）ではリクエストを自分でまとめて書くので Nagle は不要
+    int on = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0 && !(nonblock && errno == EINPROGRESS)) {
+        int e = errno;
         close(s);
-        return 1;
+        errno = e;
+        return -1;
     }
-    if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) die("connect");
+    return s;
+}
 
-    // --- TLS ハンドシェイク ---
+// ---- 接続済みソケットに SSL を用意（SNI、キャッシュ済みセッション）。失敗で NULL
+// resume なら host:port のキャッシュ済みセッションで再開を試みる。
+static SSL *tls_new(SSL_CTX *ctx, int s, int resume)
+{
     SSL *ssl = SSL_new(ctx);
-    if (!ssl) { ERR_print_errors_fp(stderr); close(s); SSL_CTX_free(ctx); return 1; }
+    if (!ssl) { ERR_print_errors_fp(stderr); return NULL; }
     SSL_set_fd(ssl, s);
     // SNI（あれば）
-    SSL_set_tlsext_host_name(ssl, HOST);
+    SSL_set_tlsext_host_name(ssl, g_host);
+    SSL_set_app_data(ssl, g_sess_key);
+    if (resume) {
+        pthread_mutex_lock(&g_sess_mu);
+        sess_entry *e = sess_cache_find(g_sess_key, 0);
+        SSL_SESSION *sess = NULL;
+        // 新しい順に取り出し、もう再開できないものは捨てる
+        while (e && e->n > 0 && !sess) {
+            sess = e->sess[--e->n];
+            if (!SSL_SESSION_is_resumable(sess)) { SSL_SESSION_free(sess); sess = NULL; }
+        }
+        pthread_mutex_unlock(&g_sess_mu);
+        if (sess) {
+            SSL_set_session(ssl, sess);
+            SSL_SESSION_free(sess);   // 参照は ssl が持つ
+        }
+    }
+    return ssl;
+}
+
+// ---- TCP 接続 + TLS ハンドシェイク（ブロッキング）。失敗で NULL -------------
+static SSL *connect_tls(SSL_CTX *ctx, int *fd, int resume)
+{
+    int s = tcp_connect(0);
+    if (s < 0) die("connect");
 
+    SSL *ssl = tls_new(ctx, s, resume);
+    if (!ssl) { close(s); return NULL; }
     if (SSL_connect(ssl) != 1) {
         fprintf(stderr, "SSL_connect failed\n");
         ERR_print_errors_fp(stderr);
         SSL_free(ssl);
         close(s);
-        SSL_CTX_free(ctx);
-        return 1;
+        return NULL;
     }
-    printf("[C] TLS handshake ok\n");
+    *fd = s;
+    return ssl;
+}
 
-    // --- 送信 ---
-    const char *msg = "hello from client";
-    if (SSL_write(ssl, msg, (int)strlen(msg)) <= 0) {
-        fprintf(stderr, "SSL_write failed\n");
-        ERR_print_errors_fp(stderr);
+// ---- 受信鍵（サーバーの tx = "stage69 tx"）で aead_ctx を用意。成功で 1 ------
+// 先頭の key id を読み、プール鍵があれば -q の鍵プールから同じ id で取り出す。
+// tx（NULL 可）にはクライアント→サーバー方向（リクエスト）の aead_ctx を用意する。
+// chain にはサーバー送信方向のエポックチェーン（"stage69 tx chain"）を返す。
+static qkd_pool g_pool;          // hdr == NULL ならプールなし
+
+static int read_full(SSL *ssl, unsigned char *buf, int len)
+{
+    for (int got = 0; got < len; ) {
+        int r = SSL_read(ssl, buf + got, len - got);
+        if (r <= 0) return 0;
+        got += r;
+    }
+    return 1;
+}
+
+// keyid はサーバーが最初に送る QKD_KEYID_LEN バイト。
+static int init_session_keys(SSL *ssl, const unsigned char *keyid, aead_ctx *rx, aead_ctx *tx, unsigned char *chain)
+{
+    int ok = 0;
+    unsigned char pkey[QKD_POOL_KEY_LEN];
+    unsigned char secret[QKD_SECRET_MAX];
+    unsigned char k_s2c[APP_KEY_LEN], k_c2s[APP_KEY_LEN];
+    unsigned char iv_s2c[APP_IV_LEN], iv_c2s[APP_IV_LEN];
+    uint64_t id;
+    size_t slen;
+
+    if (!qkd_keyid_get(keyid, &id)) {
+        fprintf(stderr, "bad key id\n");
+        goto done;
+    }
+    if (id != QKD_KEYID_NONE) {
+        if (!g_pool.hdr || !qkd_pool_fetch(&g_pool, id, pkey)) {
+            fprintf(stderr, "QKD key %llu not in pool%s\n", (unsigned long long)id, g_pool.hdr ? "" : " (no -q)");
+            goto done;
+        }
+    }
+    // サーバーと同じ秘密（TLS エクスポータ || プール鍵）
+    slen = qkd_session_secret(ssl, id != QKD_KEYID_NONE ? pkey : NULL, secret);
+    if (!slen) {
+        fprintf(stderr, "SSL_export_keying_material failed\n");
+        goto done;
+    }
+    if (!derive_app_keys_chained(secret, slen, k_s2c, k_c2s, iv_s2c, iv_c2s, chain, NULL)) {
+        fprintf(stderr, "derive_app_keys failed\n");
+        goto done;
+    }
+    // スイートはハンドシェイクの ALPN でサーバーが選んだもの（無ければビルド既定）
+    if (!aead_ctx_init_suite(rx, app_suite_negotiated(ssl), k_s2c)) {
+        fprintf(stderr, "aead_ctx_init failed\n");
+        goto done;
+    }
+    aead_ctx_set_iv(rx, iv_s2c);
+    if (tx) {
+        if (!aead_ctx_init_suite(tx, rx->suite, k_c2s)) {
+            fprintf(stderr, "aead_ctx_init failed\n");
+            goto done;
+        }
+        aead_ctx_set_iv(tx, iv_c2s);
+    }
+    ok = 1;
+done:
+    OPENSSL_cleanse(pkey, sizeof(pkey));
+    OPENSSL_cleanse(secret, sizeof(secret));
+    OPENSSL_cleanse(k_s2c, sizeof(k_s2c));
+    OPENSSL_cleanse(k_c2s, sizeof(k_c2s));
+    return ok;
+}
+
+static int init_rx_ctx(SSL *ssl, aead_ctx *rx, aead_ctx *tx, unsigned char *chain)
+{
+    unsigned char keyid[QKD_KEYID_LEN];
+    if (!read_full(ssl, keyid, sizeof(keyid))) {
+        fprintf(stderr, "bad or missing key id\n");
+        return 0;
+    }
+    return init_session_keys(ssl, keyid, rx, tx, chain);
+}
+
+// ---- レコード列の受信・復号 -------------------------------------------------
+// SSL_read で溜めたバッファ（プールの 1 本、最大フレームが収まる）から
+// 完全なフレームをまとめてその場で復号し、
+// 残り（途中までのフレーム）は先頭へ寄せて次の読み込みを待つ。
+// サーバーのエポック更新（REKEY レコード）は chain とプールで追従する。
+// 封筒レコード（APP_REC_ENVELOPE、サーバー -z）ならその中のコンテンツ鍵で
+// 続く事前封印ストリームを復号する。
+// 最終チャンク（APP_REC_FINAL）まで受け取れたら 1。
+typedef struct {
+    uint64_t bytes;     // 復号した平文バイト数
+    uint64_t records;   // 復号したレコード数
+    int      resumed;   // セッション再開できた接続数
+    uint64_t epochs;    // 受け入れたエポック更新の回数
+} recv_stats;
+
+static int recv_stream(SSL *ssl, aead_ctx *rx, const unsigned char *chain, FILE *out, recv_stats *st)
+{
+    unsigned char *buf = app_buf_get();
+    int fill = 0, ok = 0;
+    int envelope = 0;   // 1 = 封筒を受信済み、2 = コンテンツストリームを復号中
+    aead_ctx ck = {0};
+    aead_stream s;
+    aead_rekey rk = { qkd_pool_rekey_cb, &g_pool, {0}, 0 };
+    if (!buf) return 0;
+    if (!aead_stream_init(&s, rx, APP_AAD, (int)sizeof(APP_AAD)-1)) { app_buf_put(buf, 0); return 0; }
+    memcpy(rk.chain, chain, APP_CHAIN_LEN);
+    aead_stream_set_rekey(&s, &rk);
+    OPENSSL_cleanse(&rk, sizeof(rk));
+
+    for (;;) {
+        int n, used = 0;
+        aead_rec recs[16];
+        do {
+            n = aead_stream_open_batch(&s, buf, fill, recs, 16, &used);
+            if (n < 0) { fprintf(stderr, "record authentication failed\n"); goto done; }
+            for (int i = 0; i < n; i++) {
+                unsigned char *pt = APP_REC_PAYLOAD(recs[i].base);
+                if (APP_REC_FLAGS(recs[i].base) & APP_REC_ENVELOPE) {
+                    int good = envelope == 0 && recs[i].len == APP_ENVELOPE_LEN &&
+                               aead_ctx_init_suite(&ck, pt[APP_KEY_LEN + APP_IV_LEN], pt);
+                    if (good) aead_ctx_set_iv(&ck, pt + APP_KEY_LEN);
+                    OPENSSL_cleanse(pt, (size_t)recs[i].len);
+                    if (!good) { fprintf(stderr, "bad envelope record\n"); goto done; }
+                    envelope = 1;
+                    continue;
+                }
+                if (out && recs[i].len > 0) fwrite(pt, 1, (size_t)recs[i].len, out);
+                st->bytes += (uint64_t)recs[i].len;
+                st->records++;
+            }
+            memmove(buf, buf + used, (size_t)(fill - used));
+            fill -= used;
+        } while (n > 0 && !s.done);
+
+        if (s.done) {
+            if (envelope != 1) break;
+            // セッション側は封筒で終わり。以降は事前封印ストリーム
+            st->epochs += s.epoch;
+            aead_stream_free(&s);
+            if (!aead_stream_init(&s, &ck, APP_AAD, (int)sizeof(APP_AAD)-1)) goto done;
+            envelope = 2;
+            continue;
+        }
+
+        int r = SSL_read(ssl, buf + fill, APP_BUF_SIZE - fill);
+        if (r <= 0) {
+            fprintf(stderr, "SSL_read failed or closed before final record\n");
+            ERR_print_errors_fp(stderr);
+            goto done;
+        }
+        fill += r;
     }
+    ok = 1;
+done:
+    st->epochs += s.epoch;
+    aead_stream_free(&s);
+    aead_ctx_free(&ck);
+    app_buf_put(buf, APP_BUF_SIZE);
+    return ok;
+}
+
+// ---- 遅延ヒストグラム（対数線形: 2 の冪ごとに 16 区間、誤差 6% 以内） -------
+// 接続ごとに持ち、終わった接続から合算する（-L）。
+#define HIST_SUB     16
+#define HIST_EXP_MAX 36     // 2^36 ns（約 69 s）以上は最後の区間
+#define HIST_BUCKETS ((HIST_EXP_MAX - 3) * HIST_SUB)
 
-    // --- 受信 ---
-    unsigned char buf[2048];
-    int r = SSL_read(ssl, buf, sizeof(buf)-1);
-    if (r > 0) {
-        buf[r] = '\0';
-        printf("[C] recv: %s\n", buf);
+typedef struct {
+    uint64_t n;
+    uint32_t c[HIST_BUCKETS];
+} lat_hist;
+
+static void hist_add(lat_hist *h, uint64_t ns)
+{
+    int i;
+    if (ns < HIST_SUB) {
+        i = (int)ns;
     } else {
-        fprintf(stderr, "SSL_read failed or closed\n");
+        int e = 63 - __builtin_clzll(ns);
+        if (e >= HIST_EXP_MAX) { e = HIST_EXP_MAX - 1; ns = (2ull << e) - 1; }
+        i = (e - 3) * HIST_SUB + (int)((ns >> (e - 4)) & (HIST_SUB - 1));
+    }
+    h->c[i]++;
+    h->n++;
+}
+
+static void hist_merge(lat_hist *dst, const lat_hist *src)
+{
+    for (int i = 0; i < HIST_BUCKETS; i++) dst->c[i] += src->c[i];
+    dst->n += src->n;
+}
+
+// p 分位の区間の中央値（us）
+static double hist_pct_us(const lat_hist *h, double p)
+{
+    if (h->n == 0) return 0;
+    uint64_t want = (uint64_t)(p * (double)(h->n - 1)) + 1, seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->c[i];
+        if (seen < want) continue;
+        if (i < HIST_SUB) return i / 1e3;
+        int e = i / HIST_SUB + 3;
+        uint64_t lo = (uint64_t)(HIST_SUB + i % HIST_SUB) << (e - 4);
+        return (lo + (1ull << (e - 4)) / 2) / 1e3;
+    }
+    return 0;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// ---- リクエストの大きさの配分（-s 64 または -s 64:8,1024:1,16384:1） ------
+#define MIX_MAX 16
+
+typedef struct {
+    int size[MIX_MAX];
+    int weight[MIX_MAX];
+    int n;
+    int total;
+} req_mix;
+
+// size[:weight] をカンマ区切りで。成功で 1。
+static int req_mix_parse(req_mix *m, const char *spec)
+{
+    memset(m, 0, sizeof(*m));
+    for (const char *p = spec; *p; ) {
+        char *end;
+        long size = strtol(p, &end, 10), w = 1;
+        if (end == p || size < 0 || size > APP_STREAM_CHUNK || m->n == MIX_MAX) return 0;
+        p = end;
+        if (*p == ':') {
+            w = strtol(p + 1, &end, 10);
+            if (end == p + 1 || w < 1 || w > 1000000) return 0;
+            p = end;
+        }
+        m->size[m->n] = (int)size;
+        m->weight[m->n++] = (int)w;
+        m->total += (int)w;
+        if (*p == ',') p++;
+        else if (*p) return 0;
+    }
+    return m->n > 0;
+}
+
+static int req_mix_pick(const req_mix *m, uint64_t *rnd)
+{
+    if (m->n == 1) return m->size[0];
+    uint64_t x = *rnd;   // xorshift64
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    *rnd = x;
+    int r = (int)(x % (uint64_t)m->total);
+    for (int i = 0; ; i++) {
+        if (r < m->weight[i]) return m->size[i];
+        r -= m->weight[i];
+    }
+}
+
+// ---- 持続接続（-r）: hello の後、同じ接続でリクエストをパイプライン送信 ----
+// 応答を待たずに最大 window 件まで送り、応答が届いた分だけ次を送るので、
+// 往復遅延が接続あたりのスループットの上限にならない。小さいリクエストは
+// 1 回の SSL_write（TLS レコード）にまとめる。送受信を同時に進めないと
+// 双方の送信バッファが詰まって止まるので、ソケットは非ブロッキングで使う。
+// サーバーはペイロードをそのまま返すので、応答は番号から作った期待値と比べる。
+typedef struct {
+    SSL *ssl;
+    aead_stream so, si;         // リクエスト / 応答（APP_RPC_AAD）
+    unsigned char *out, *in;    // バッファプールから
+    int olen, fill;             // out の送信待ち / in の受信済み
+    int sent, done, nreq, window;
+    int next_size;              // 次に送る大きさ（-1 = 未抽選）
+    uint64_t *t_sent;           // window 個のリング: 送信時刻
+    int      *sizes;            // 同: 大きさ
+    const req_mix *mix;
+    uint64_t rnd;
+    uint64_t bytes;             // 検証済み応答のペイロード
+    lat_hist *lat;
+} req_pipe;
+
+static void req_payload(unsigned char *p, int size, uint64_t i)
+{
+    for (int k = 0; k < size; k++) p[k] = (unsigned char)(i * 131 + (uint64_t)k);
+}
+
+static int req_payload_check(const unsigned char *p, int size, uint64_t i)
+{
+    for (int k = 0; k < size; k++) if (p[k] != (unsigned char)(i * 131 + (uint64_t)k)) return 0;
+    return 1;
+}
+
+static void req_pipe_free(req_pipe *p)
+{
+    aead_stream_free(&p->so);
+    aead_stream_free(&p->si);
+    free(p->t_sent);
+    free(p->sizes);
+    app_buf_put(p->out, APP_BUF_SIZE);
+    app_buf_put(p->in, APP_BUF_SIZE);
+    memset(p, 0, sizeof(*p));
+}
+
+// tx/rx は接続の鍵（rx は hello を読んだ続きの番号から）。成功で 1。
+static int req_pipe_init(req_pipe *p, SSL *ssl, aead_ctx *tx, aead_ctx *rx,
+                         int nreq, int window, const req_mix *mix, uint64_t seed, lat_hist *lat)
+{
+    memset(p, 0, sizeof(*p));
+    p->ssl = ssl;
+    p->nreq = nreq;
+    p->window = window;
+    p->next_size = -1;
+    p->mix = mix;
+    p->rnd = seed | 1;
+    p->lat = lat;
+    p->out = app_buf_get();
+    p->in  = app_buf_get();
+    p->t_sent = calloc((size_t)window, sizeof(uint64_t));
+    p->sizes  = calloc((size_t)window, sizeof(int));
+    if (!p->out || !p->in || !p->t_sent || !p->sizes ||
+        !aead_stream_init(&p->so, tx, APP_RPC_AAD, (int)sizeof(APP_RPC_AAD)-1) ||
+        !aead_stream_init(&p->si, rx, APP_RPC_AAD, (int)sizeof(APP_RPC_AAD)-1)) {
+        req_pipe_free(p);
+        return 0;
+    }
+    return 1;
+}
+
+// 1 回の SSL_read/SSL_write のエラーを見る。待てば進むなら 1。
+static int ssl_retryable(SSL *ssl, int r)
+{
+    int err = SSL_get_error(ssl, r);
+    return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE;
+}
+
+// 進められるだけ進める（ソケットは非ブロッキング）。
+// 戻り値: 1 = 最後の応答まで受信、0 = 待つ（*want_write なら書き込み可能も）、-1 = 失敗
+static int req_pipe_step(req_pipe *p, int *want_write)
+{
+    for (;;) {
+        int progress = 0;
+
+        // 窓が開いている分を 1 バッファに封印。SSL_write の再試行は同じバッファで
+        // ないといけないので、前の分を送り終えてから
+        if (p->olen == 0) {
+            while (p->sent < p->nreq && p->sent - p->done < p->window) {
+                if (p->next_size < 0) p->next_size = req_mix_pick(p->mix, &p->rnd);
+                if (p->olen + APP_REC_OVERHEAD + p->next_size > APP_BUF_SIZE) break;
+                unsigned char *f = p->out + p->olen;
+                int l = 0;
+                req_payload(APP_REC_PAYLOAD(f), p->next_size, (uint64_t)p->sent);
+                if (!aead_stream_seal_chunk(&p->so, APP_REC_PAYLOAD(f), p->next_size,
+                                            p->sent == p->nreq - 1, f, &l)) return -1;
+                p->t_sent[p->sent % p->window] = now_ns();
+                p->sizes[p->sent % p->window] = p->next_size;
+                p->next_size = -1;
+                p->olen += l;
+                p->sent++;
+            }
+        }
+
+        if (p->olen > 0) {
+            int r = SSL_write(p->ssl, p->out, p->olen);
+            if (r > 0) { p->olen = 0; progress = 1; }
+            else if (!ssl_retryable(p->ssl, r)) { fprintf(stderr, "SSL_write failed\n"); return -1; }
+        }
+
+        int r = SSL_read(p->ssl, p->in + p->fill, APP_BUF_SIZE - p->fill);
+        if (r > 0) {
+            p->fill += r;
+            progress = 1;
+            int n, used = 0;
+            aead_rec recs[16];
+            do {
+                n = aead_stream_open_batch(&p->si, p->in, p->fill, recs, 16, &used);
+                if (n < 0) { fprintf(stderr, "reply authentication failed\n"); return -1; }
+                uint64_t t = now_ns();
+                for (int i = 0; i < n; i++, p->done++) {
+                    int size = p->sizes[p->done % p->window];
+                    if (p->done >= p->sent || recs[i].len != size ||
+                        !req_payload_check(APP_REC_PAYLOAD(recs[i].base), size, (uint64_t)p->done)) {
+                        fprintf(stderr, "reply %d does not match its request\n", p->done);
+                        return -1;
+                    }
+                    p->bytes += (uint64_t)size;
+                    hist_add(p->lat, t - p->t_sent[p->done % p->window]);
+                }
+                memmove(p->in, p->in + used, (size_t)(p->fill - used));
+                p->fill -= used;
+            } while (n > 0);
+        } else if (!ssl_retryable(p->ssl, r)) {
+            fprintf(stderr, "SSL_read failed or closed after %d replies\n", p->done);
+            ERR_print_errors_fp(stderr);
+            return -1;
+        }
+
+        if (p->done == p->nreq) {
+            if (p->si.done) return 1;
+            fprintf(stderr, "last reply not marked final\n");
+            return -1;
+        }
+        if (!progress) { *want_write = p->olen > 0; return 0; }
+    }
+}
+
+// 1 接続分（ブロッキングのソケットを一時的に非ブロッキングにして poll で回す）
+static int run_requests(SSL *ssl, int fd, aead_ctx *tx, aead_ctx *rx,
+                        int nreq, int window, const req_mix *mix, lat_hist *lat, uint64_t *nreplies)
+{
+    req_pipe p;
+    int fl = fcntl(fd, F_GETFL), r = -1;
+    if (fl < 0 || !req_pipe_init(&p, ssl, tx, rx, nreq, window, mix, now_ns(), lat)) return 0;
+    fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+    for (;;) {
+        int ww = 0;
+        r = req_pipe_step(&p, &ww);
+        if (r != 0) break;
+        struct pollfd pfd = { fd, (short)(POLLIN | (ww ? POLLOUT : 0)), 0 };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) { r = -1; break; }
+    }
+    *nreplies += (uint64_t)p.done;
+    fcntl(fd, F_SETFL, fl);
+    req_pipe_free(&p);
+    return r == 1;
+}
+
+// ---- 負荷生成（-L N）: N 本の同時接続を epoll で回す -------------------------
+// 各スレッド（-T）が自分の epoll と接続の組を持つ。接続は
+//   TCP 接続 → TLS ハンドシェイク → key id + hello の復号 → -r 件のリクエスト
+// を非ブロッキングで進め、終わったら（-r 0 なら hello で）閉じて張り直す。
+// 新しい接続は -u 本/秒まで（立ち上がりのランプと張り直しの両方）。
+// 遅延は接続ごとのヒストグラムに取り、閉じるときにスレッドの合計へ、
+// 最後にスレッドの合計を足し合わせて表示する。
+enum { LG_IDLE, LG_TCP, LG_TLS, LG_HELLO, LG_REQ };
+
+typedef struct {
+    int      fd;
+    SSL     *ssl;
+    int      state;
+    uint32_t events;            // epoll に登録中の向き
+    uint64_t t0;                // connect 開始（遅延はここから測る）
+    aead_ctx rx, tx;
+    aead_stream hs;             // hello（APP_AAD）
+    int      keyed;
+    unsigned char *buf;         // key id + hello の受信（プールから）
+    int      fill;
+    req_pipe pipe;
+    lat_hist rtt;               // この接続のリクエスト往復
+} lg_conn;
+
+typedef struct {
+    SSL_CTX *ctx;
+    int      nconn;
+    double   rate;              // このスレッドの新規接続 / 秒、0 = 制限なし
+    uint64_t deadline;
+    int      resume, nreq, window;
+    const req_mix *mix;
+    // 結果
+    uint64_t opened, handshakes, resumed, sessions, failures, requests, bytes;
+    lat_hist hs_lat, hello_lat, rtt;
+} lg_thread;
+
+// ok: 1 = 済んだ、0 = 失敗、-1 = 締め切りで打ち切り（どちらにも数えない）
+static void lg_close(int ep, lg_thread *t, lg_conn *c, int ok)
+{
+    if (c->fd >= 0) epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+    if (c->state == LG_REQ) {
+        t->requests += (uint64_t)c->pipe.done;
+        t->bytes    += c->pipe.bytes;
+        req_pipe_free(&c->pipe);
+    }
+    if (ok == 1) t->sessions++;
+    if (ok == 0) t->failures++;
+    hist_merge(&t->rtt, &c->rtt);
+    memset(&c->rtt, 0, sizeof(c->rtt));
+    if (c->ssl) {
+        if (ok == 1) SSL_shutdown(c->ssl);   // close_notify（送れなくても待たない）
+        SSL_free(c->ssl);
+    }
+    if (c->fd >= 0) close(c->fd);
+    aead_stream_free(&c->hs);
+    aead_ctx_free(&c->rx);
+    aead_ctx_free(&c->tx);
+    app_buf_put(c->buf, APP_BUF_SIZE);
+    c->buf   = NULL;
+    c->ssl   = NULL;
+    c->fd    = -1;
+    c->keyed = 0;
+    c->fill  = 0;
+    c->state = LG_IDLE;
+}
+
+static int lg_open(int ep, lg_thread *t, lg_conn *c)
+{
+    c->fd = tcp_connect(1);
+    if (c->fd < 0) return 0;
+    c->t0     = now_ns();
+    c->state  = LG_TCP;
+    c->events = EPOLLOUT;
+    struct epoll_event ev = { .events = c->events, .data.ptr = c };
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev) < 0) { close(c->fd); c->fd = -1; c->state = LG_IDLE; return 0; }
+    t->opened++;
+    return 1;
+}
+
+static void lg_want(int ep, lg_conn *c, uint32_t events)
+{
+    if (events == c->events) return;
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+    epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+    c->events = events;
+}
+
+// key id と hello を読む。戻り値は req_pipe_step と同じ（1 = hello まで受信）
+static int lg_hello(lg_thread *t, lg_conn *c)
+{
+    for (;;) {
+        int r = SSL_read(c->ssl, c->buf + c->fill, APP_BUF_SIZE - c->fill);
+        if (r <= 0) return ssl_retryable(c->ssl, r) ? 0 : -1;
+        c->fill += r;
+        if (!c->keyed) {
+            if (c->fill < QKD_KEYID_LEN) continue;
+            unsigned char chain[APP_CHAIN_LEN];
+            aead_rekey rk = { qkd_pool_rekey_cb, &g_pool, {0}, 0 };
+            int ok = init_session_keys(c->ssl, c->buf, &c->rx, &c->tx, chain) &&
+                     aead_stream_init(&c->hs, &c->rx, APP_AAD, (int)sizeof(APP_AAD)-1);
+            memcpy(rk.chain, chain, APP_CHAIN_LEN);
+            if (ok) aead_stream_set_rekey(&c->hs, &rk);
+            OPENSSL_cleanse(chain, sizeof(chain));
+            OPENSSL_cleanse(&rk, sizeof(rk));
+            if (!ok) return -1;
+            c->keyed = 1;
+            memmove(c->buf, c->buf + QKD_KEYID_LEN, (size_t)(c->fill - QKD_KEYID_LEN));
+            c->fill -= QKD_KEYID_LEN;
+        }
+        int n, used = 0;
+        aead_rec recs[16];
+        do {
+            n = aead_stream_open_batch(&c->hs, c->buf, c->fill, recs, 16, &used);
+            if (n < 0) return -1;
+            for (int i = 0; i < n; i++) {
+                if (APP_REC_FLAGS(recs[i].base) & APP_REC_ENVELOPE) return -1;   // -z は未対応
+                t->bytes += (uint64_t)recs[i].len;
+            }
+            memmove(c->buf, c->buf + used, (size_t)(c->fill - used));
+            c->fill -= used;
+        } while (n > 0 && !c->hs.done);
+        if (c->hs.done) {
+            hist_add(&t->hello_lat, now_ns() - c->t0);
+            return 1;
+        }
+    }
+}
+
+static void lg_step(int ep, lg_thread *t, lg_conn *c)
+{
+    int r, ww = 0;
+    switch (c->state) {
+    case LG_TCP: {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) { lg_close(ep, t, c, 0); return; }
+        if (!(c->ssl = tls_new(t->ctx, c->fd, t->resume))) { lg_close(ep, t, c, 0); return; }
+        c->state = LG_TLS;
+    }   // fall through
+    case LG_TLS:
+        r = SSL_connect(c->ssl);
+        if (r != 1) {
+            if (!ssl_retryable(c->ssl, r)) { lg_close(ep, t, c, 0); return; }
+            lg_want(ep, c, SSL_get_error(c->ssl, r) == SSL_ERROR_WANT_WRITE ? EPOLLOUT : EPOLLIN);
+            return;
+        }
+        t->handshakes++;
+        if (SSL_session_reused(c->ssl)) t->resumed++;
+        hist_add(&t->hs_lat, now_ns() - c->t0);
+        if (!(c->buf = app_buf_get())) { lg_close(ep, t, c, 0); return; }
+        c->state = LG_HELLO;
+        // fall through
+    case LG_HELLO:
+        r = lg_hello(t, c);
+        if (r < 0) { lg_close(ep, t, c, 0); return; }
+        if (r == 0) { lg_want(ep, c, EPOLLIN); return; }
+        if (t->nreq == 0) { lg_close(ep, t, c, 1); return; }
+        if (!req_pipe_init(&c->pipe, c->ssl, &c->tx, &c->rx, t->nreq, t->window, t->mix,
+                           now_ns() ^ (uint64_t)(uintptr_t)c, &c->rtt)) { lg_close(ep, t, c, 0); return; }
+        c->state = LG_REQ;
+        // fall through
+    default:   // LG_REQ
+        r = req_pipe_step(&c->pipe, &ww);
+        if (r != 0) { lg_close(ep, t, c, r == 1); return; }
+        lg_want(ep, c, EPOLLIN | (ww ? EPOLLOUT : 0));
+        return;
+    }
+}
+
+static void *lg_thread_main(void *arg)
+{
+    lg_thread *t = (lg_thread *)arg;
+    lg_conn *conns = calloc((size_t)t->nconn, sizeof(lg_conn));
+    int *idle = calloc((size_t)t->nconn, sizeof(int));
+    int ep = epoll_create1(0);
+    if (!conns || !idle || ep < 0) { perror("lg_thread"); free(conns); free(idle); return NULL; }
+
+    int nidle = t->nconn;
+    for (int i = 0; i < t->nconn; i++) { conns[i].fd = -1; idle[i] = t->nconn - 1 - i; }
+    uint64_t interval = t->rate > 0 ? (uint64_t)(1e9 / t->rate) : 0;
+    uint64_t next_open = now_ns();
+    struct epoll_event evs[512];
+
+    for (;;) {
+        uint64_t now = now_ns();
+        if (now >= t->deadline) break;
+        // 空いている枠に新しい接続（-u の速さまで）
+        while (nidle > 0 && (!interval || now >= next_open)) {
+            lg_conn *c = &conns[idle[nidle - 1]];
+            if (!lg_open(ep, t, c)) { t->failures++; break; }   // 少し待ってから再試行
+            nidle--;
+            if (interval) next_open = (next_open + interval < now ? now : next_open + interval);
+        }
+        int timeout = 100;   // 締め切りの確認
+        if (nidle > 0) timeout = interval ? (int)((next_open > now ? next_open - now : 0) / 1000000) : 10;
+        int n = epoll_wait(ep, evs, 512, timeout);
+        if (n < 0 && errno != EINTR) { perror("epoll_wait"); break; }
+        for (int i = 0; i < n; i++) {
+            lg_conn *c = (lg_conn *)evs[i].data.ptr;
+            lg_step(ep, t, c);
+            if (c->state == LG_IDLE) idle[nidle++] = (int)(c - conns);
+        }
+    }
+    // 締め切り: 途中の接続は数えずに閉じる（済んだリクエストは数える）
+    for (int i = 0; i < t->nconn; i++) {
+        if (conns[i].state != LG_IDLE) lg_close(ep, t, &conns[i], -1);
+    }
+    close(ep);
+    free(idle);
+    free(conns);
+    return NULL;
+}
+
+static int run_load(SSL_CTX *ctx, int nconn, int nthreads, double secs, double rate,
+                    int resume, int nreq, int window, const req_mix *mix)
+{
+    // 数千接続ぶんのファイル記述子
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (nthreads > nconn) nthreads = nconn;
+    lg_thread *t = calloc((size_t)nthreads, sizeof(lg_thread));
+    pthread_t *th = calloc((size_t)nthreads, sizeof(pthread_t));
+    if (!t || !th) die("calloc");
+
+    double t0 = now_sec();
+    uint64_t deadline = now_ns() + (uint64_t)(secs * 1e9);
+    int started = 0;
+    for (int i = 0; i < nthreads; i++) {
+        t[i].ctx      = ctx;
+        t[i].nconn    = nconn / nthreads + (i < nconn % nthreads);
+        t[i].rate     = rate / nthreads;
+        t[i].deadline = deadline;
+        t[i].resume   = resume;
+        t[i].nreq     = nreq;
+        t[i].window   = window;
+        t[i].mix      = mix;
+        if (pthread_create(&th[i], NULL, lg_thread_main, &t[i]) != 0) break;
+        started++;
+    }
+    lg_thread sum;
+    memset(&sum, 0, sizeof(sum));
+    for (int i = 0; i < started; i++) {
+        pthread_join(th[i], NULL);
+        sum.opened     += t[i].opened;
+        sum.handshakes += t[i].handshakes;
+        sum.resumed    += t[i].resumed;
+        sum.sessions   += t[i].sessions;
+        sum.failures   += t[i].failures;
+        sum.requests   += t[i].requests;
+        sum.bytes      += t[i].bytes;
+        hist_merge(&sum.hs_lat, &t[i].hs_lat);
+        hist_merge(&sum.hello_lat, &t[i].hello_lat);
+        hist_merge(&sum.rtt, &t[i].rtt);
+    }
+    double dt = now_sec() - t0;
+
+    printf("[L] %d conns on %d threads, %.1f s: %llu connects, %llu handshakes (%.0f/s, %llu resumed), "
+           "%llu sessions done, %llu failures\n",
+           nconn, started, dt, (unsigned long long)sum.opened, (unsigned long long)sum.handshakes,
+           dt > 0 ? sum.handshakes / dt : 0.0, (unsigned long long)sum.resumed,
+           (unsigned long long)sum.sessions, (unsigned long long)sum.failures);
+    printf("[L] %llu requests (%.0f req/s), %.2f MB/s decrypted\n",
+           (unsigned long long)sum.requests, dt > 0 ? sum.requests / dt : 0.0, dt > 0 ? sum.bytes / dt / 1e6 : 0.0);
+    const struct { const char *name; const lat_hist *h; } rows[] = {
+        { "handshake", &sum.hs_lat }, { "hello", &sum.hello_lat }, { "request rtt", &sum.rtt },
+    };
+    printf("[L] %-12s %10s %9s %9s %9s %9s\n", "latency(us)", "count", "p50", "p90", "p99", "p999");
+    for (int i = 0; i < 3; i++) {
+        printf("[L] %-12s %10llu %9.1f %9.1f %9.1f %9.1f\n", rows[i].name, (unsigned long long)rows[i].h->n,
+               hist_pct_us(rows[i].h, 0.50), hist_pct_us(rows[i].h, 0.90),
+               hist_pct_us(rows[i].h, 0.99), hist_pct_us(rows[i].h, 0.999));
+    }
+    free(t);
+    free(th);
+    return started == nthreads && sum.handshakes > 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-C file] [-O name=value] [-H host] [-P port] [-n connections] [-o outfile] [-R] [-q pool] [-a suites] [-r requests] [-W window] [-s mix]\n"
+                    "       %s -L conns [-T threads] [-d seconds] [-u rate] [-r requests] [-W window] [-s mix] [-R] [-q pool] [-a suites]\n"
+                    "  -C  read settings from a file first (name = value per line, names below)\n"
+                    "  -O  set one setting by name, e.g. -O window=64\n"
+                    "  -H  server address (host, default " HOST ")   -P  port (port, default %d)\n"
+                    "  -n  connect N times in a row and report throughput (connections)\n"
+                    "  -o  write decrypted payload to outfile, default: print once (out)\n"
+                    "  -R  disable TLS session resumption, full handshake every time (no_resume)\n"
+                    "  -q  shared-memory QKD key pool to look server key ids up in (pool, e.g. " QKD_POOL_NAME ")\n"
+                    "  -a  record suites to offer in preference order, e.g. chacha20,aes256gcm (suites)\n"
+                    "      (default: by CPU, ChaCha20 first without AES instructions)\n"
+                    "  -r  keep each connection open after the hello and send N pipelined requests (requests)\n"
+                    "  -W  requests in flight without waiting for a reply (window, default 16)\n"
+                    "  -s  request payload bytes, or a weighted mix such as 64:8,1024:1,16384:1 (mix)\n"
+                    "      (default 64, max %d)\n"
+                    "  -L  load generator: keep N connections busy, hello, -r requests, reconnect (load_conns)\n"
+                    "  -T  load generator threads, one epoll loop each (load_threads, default 1)\n"
+                    "  -d  load generator run time in seconds (duration, default 10)\n"
+                    "  -u  load generator new connections per second, ramp-up and reconnects (rate, default unlimited)\n",
+                    prog, prog, PORT, APP_STREAM_CHUNK);
+}
+
+// ---- 設定（-C ファイル → コマンドライン の順に適用、後が勝つ） ------------
+#define CLIENT_OPTS "C:O:H:P:n:o:Rq:a:r:W:s:L:T:d:u:h"
+
+typedef struct {
+    int loops, resume, nreq, window, lg_conns, lg_threads;
+    double lg_secs, lg_rate;
+    const char *outpath, *pool_name, *suites, *mix_spec;
+} client_cfg;
+
+static const app_cfg_key k_client_cfg[] = {
+    { "host", 'H', 0 }, { "port", 'P', 0 }, { "connections", 'n', 0 }, { "out", 'o', 0 },
+    { "no_resume", 'R', 1 }, { "pool", 'q', 0 }, { "suites", 'a', 0 }, { "requests", 'r', 0 },
+    { "window", 'W', 0 }, { "mix", 's', 0 }, { "load_conns", 'L', 0 }, { "load_threads", 'T', 0 },
+    { "duration", 'd', 0 }, { "rate", 'u', 0 },
+    { NULL, 0, 0 }
+};
+
+static int client_set(int opt, const char *val, void *arg)
+{
+    client_cfg *c = (client_cfg *)arg;
+    switch (opt) {
+    case 'O': return app_cfg_apply_pair(k_client_cfg, val, client_set, arg);
+    case 'H': g_host = val; break;
+    case 'P': g_port = atoi(val); break;
+    case 'n': c->loops = atoi(val); break;
+    case 'o': c->outpath = val; break;
+    case 'R': c->resume = 0; break;
+    case 'q': c->pool_name = val; break;
+    case 'a': c->suites = val; break;
+    case 'r': c->nreq = atoi(val); break;
+    case 'W': c->window = atoi(val); break;
+    case 's': c->mix_spec = val; break;
+    case 'L': c->lg_conns = atoi(val); break;
+    case 'T': c->lg_threads = atoi(val); break;
+    case 'd': c->lg_secs = atof(val); break;
+    case 'u': c->lg_rate = atof(val); break;
+    default:  return 0;
+    }
+    return 1;
+}
+
+// 再現用に実際に使う値を 1 行で出す（計測する実行 -n/-r/-L と、-C か -O を使ったとき）
+static void log_config(const client_cfg *c)
+{
+    printf("[C] config: host=%s port=%d connections=%d out=%s no_resume=%s pool=%s suites=%s"
+           " requests=%d window=%d mix=%s load_conns=%d load_threads=%d duration=%g rate=%g record=%s/%d\n",
+           g_host, g_port, c->loops, c->outpath ? c->outpath : "-", c->resume ? "no" : "yes",
+           c->pool_name ? c->pool_name : "-", c->suites ? c->suites : "auto",
+           c->nreq, c->window, c->mix_spec, c->lg_conns, c->lg_threads, c->lg_secs, c->lg_rate,
+           APP_AEAD_NAME, APP_STREAM_CHUNK);
+}
+
+int main(int argc, char **argv)
+{
+    client_cfg cfg = {
+        .loops = 1, .resume = 1, .window = 16, .lg_threads = 1, .lg_secs = 10,
+        .mix_spec = "64",
+    };
+
+    const char *cfg_file = app_cfg_prescan(argc, argv, CLIENT_OPTS);
+    if (cfg_file && !app_cfg_load(cfg_file, k_client_cfg, client_set, &cfg)) return 1;
+    int opt, tuned = cfg_file != NULL;
+    while ((opt = getopt(argc, argv, CLIENT_OPTS)) != -1) {
+        if (opt == 'C') continue;
+        if (opt == 'O') tuned = 1;
+        if (!client_set(opt, optarg, &cfg)) { usage(argv[0]); return opt == 'h' ? 0 : 1; }
+    }
+    int loops = cfg.loops, resume = cfg.resume, nreq = cfg.nreq, window = cfg.window;
+    int lg_conns = cfg.lg_conns, lg_threads = cfg.lg_threads;
+    double lg_secs = cfg.lg_secs, lg_rate = cfg.lg_rate;
+    const char *outpath = cfg.outpath, *pool_name = cfg.pool_name, *suites = cfg.suites;
+    const char *mix_spec = cfg.mix_spec;
+    req_mix mix;
+    if (loops < 1 || nreq < 0 || window < 1 || !req_mix_parse(&mix, mix_spec) ||
+        g_port < 1 || g_port > 65535 ||
+        lg_conns < 0 || lg_threads < 1 || lg_secs <= 0 || lg_rate < 0) { usage(argv[0]); return 1; }
+    snprintf(g_sess_key, sizeof(g_sess_key), "%s:%d", g_host, g_port);
+    if (tuned || lg_conns || loops > 1 || nreq) log_config(&cfg);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // --- OpenSSL 初期化 ---
+    SSL_load_error_strings();
+    OpenSSL_add_ssl_algorithms();
+    if (!crypto_rt_init()) {
         ERR_print_errors_fp(stderr);
+        return 1;
+    }
+    if (suites && !crypto_rt_set_prefer(suites)) {
+        fprintf(stderr, "unknown or unavailable suite in -a %s\n", suites);
+        return 1;
+    }
+
+    if (pool_name && !qkd_pool_open(&g_pool, pool_name, 0, 0)) {
+        fprintf(stderr, "cannot open QKD key pool %s\n", pool_name);
+        return 1;
     }
 
-    // --- 後始末 ---
-    SSL_shutdown(ssl);
-    SSL_free(ssl);
-    close(s);
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (!ctx || !app_suite_offer(ctx)) {
+        ERR_print_errors_fp(stderr);
+        return 1;
+    }
+
+    if (resume) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(ctx, sess_new_cb);
+    }
+
+    // 必要ならサーバ証明書検証を有効化（自己署名なら無効でもOK）
+    // SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    // SSL_CTX_load_verify_locations(ctx, "server.crt", NULL);
+
+    if (lg_conns) {
+        int r = run_load(ctx, lg_conns, lg_threads, lg_secs, lg_rate, resume, nreq, window, &mix);
+        sess_cache_free();
+        SSL_CTX_free(ctx);
+        qkd_pool_close(&g_pool);
+        app_buf_pool_free_all();
+        crypto_rt_cleanup();
+        return r ? 0 : 1;
+    }
+
+    FILE *out = NULL;
+    if (outpath) {
+        out = fopen(outpath, "wb");
+        if (!out) die(outpath);
+    } else if (loops == 1) {
+        out = stdout;
+    }
+
+    recv_stats st = {0, 0, 0, 0};
+    lat_hist *rtt = nreq ? calloc(1, sizeof(lat_hist)) : NULL;
+    uint64_t nreplies = 0;
+    if (nreq && !rtt) die("calloc");
+    int ok = 1;
+    double t0 = now_sec();
+
+    for (int i = 0; i < loops; i++) {
+        int s = -1;
+        SSL *ssl = connect_tls(ctx, &s, resume);
+        if (!ssl) { ok = 0; break; }
+        if (SSL_session_reused(ssl)) st.resumed++;
+        if (loops == 1) {
+            int suite = app_suite_negotiated(ssl);
+            printf("[C] TLS handshake ok, record suite %s\n", suite ? app_suite_get(suite)->name : "?");
+        }
+
+        // --- 受信・復号（コンテキストは接続中ずっと再利用） ---
+        aead_ctx rx = {0}, tx = {0};
+        unsigned char chain[APP_CHAIN_LEN];
+        if (out == stdout) { printf("[C] recv: "); fflush(stdout); }
+        int r = init_rx_ctx(ssl, &rx, &tx, chain) && recv_stream(ssl, &rx, chain, out, &st);
+        OPENSSL_cleanse(chain, sizeof(chain));
+        if (out == stdout) printf("\n");
+        // --- 同じ接続でリクエスト（hello と同じ受信コンテキストの続き） ---
+        if (r && nreq) r = run_requests(ssl, s, &tx, &rx, nreq, window, &mix, rtt, &nreplies);
+        aead_ctx_free(&rx);
+        aead_ctx_free(&tx);
+
+        // --- 後始末 ---
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+        close(s);
+        if (!r) { ok = 0; break; }
+    }
+
+    double dt = now_sec() - t0;
+    if (out && out != stdout) fclose(out);
+    if (outpath || loops > 1) {
+        printf("[C] %d conn (%d resumed), %llu records (%llu rekeys), %llu bytes in %.3f s (%.2f MB/s)\n",
+               loops, st.resumed, (unsigned long long)st.records, (unsigned long long)st.epochs,
+               (unsigned long long)st.bytes,
+               dt, dt > 0 ? st.bytes / dt / 1e6 : 0.0);
+    }
+    if (nreq) {
+        printf("[C] %llu requests (%s B, window %d) in %.3f s: %.0f req/s, rtt p50 %.1f us p99 %.1f us\n",
+               (unsigned long long)nreplies, mix_spec, window, dt, dt > 0 ? nreplies / dt : 0.0,
+               hist_pct_us(rtt, 0.50), hist_pct_us(rtt, 0.99));
+        free(rtt);
+    }
+
+    sess_cache_free();
     SSL_CTX_free(ctx);
+    qkd_pool_close(&g_pool);
+    app_buf_pool_free_all();
+    crypto_rt_cleanup();
     EVP_cleanup();
 
-    return 0;
+    return ok ? 0 : 1;
 }
-
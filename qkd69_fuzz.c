@@ -0,0 +1,277 @@
+// qkd69_fuzz.c  —  Stage69 TLS+QKDハイブリッド : aead_decrypt とレコード解析の fuzz ターゲット
+//   build (libFuzzer): clang -O1 -g -fsanitize=fuzzer,address,undefined -DFUZZ_TARGET=FUZZ_DECRYPT -o fuzz_decrypt qkd69_fuzz.c -lssl -lcrypto
+//                      （-DFUZZ_TARGET=FUZZ_RECORD でレコード解析側）
+//   build (単体):      cc -O1 -g -fsanitize=address,undefined -DFUZZ_STANDALONE -DFUZZ_TARGET=FUZZ_RECORD -o fuzz_record qkd69_fuzz.c -lssl -lcrypto
+//   run (単体):        ./fuzz_record [file...]   （ファイルなしなら決まった種から作る入力を回す、-n N で個数）
+//
+// FUZZ_DECRYPT: 入力 = 鍵 || nonce || AAD 長(1) || AAD || 暗号文+タグ。aead_decrypt
+// は落ちず、成功したときは同じ鍵と nonce で暗号化し直すと入力の暗号文に戻る。
+// FUZZ_RECORD: 先頭 1 バイトでモードを選ぶ。
+//   0: 入力をそのまま受信バイト列として aead_stream_open_batch に食わせる
+//      （長さヘッダ、フラグ、エポック更新、部分レコードの扱い）。
+//   1: 入力を平文チャンクに切って封印し、指定位置のビットを反転して開く。
+//      反転がなければ全部元に戻り、あればどこかで必ず失敗する。
+//   2: 入力を受信レコード番号の列とみなし、再送検出ウィンドウを単純な参照
+//      モデル（受理済み番号の集合 + 最大値）と比べる。
+// どのモードも不一致は abort() で知らせる（libFuzzer がクラッシュとして拾う）。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <openssl/evp.h>
+
+#include "hybrid_common.h"
+
+#define FUZZ_DECRYPT 1
+#define FUZZ_RECORD  2
+
+#ifndef FUZZ_TARGET
+#define FUZZ_TARGET FUZZ_RECORD
+#endif
+
+static const unsigned char k_key[APP_KEY_LEN] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+static const unsigned char k_iv[APP_IV_LEN] = { 0xa0, 0xa1, 0xa2, 0xa3 };
+
+static void fuzz_init(void)
+{
+    static int done;
+    if (done) return;
+    if (!crypto_rt_init()) abort();
+    done = 1;
+}
+
+#define FUZZ_ASSERT(c) do { if (!(c)) { fprintf(stderr, "fuzz: %s:%d: %s\n", __FILE__, __LINE__, #c); abort(); } } while (0)
+
+#if FUZZ_TARGET == FUZZ_DECRYPT
+static int fuzz_one(const uint8_t *data, size_t size)
+{
+    enum { HDR = APP_KEY_LEN + APP_IV_LEN + 1 };
+    if (size < HDR || size > (1u << 20)) return 0;
+    const unsigned char *key = data, *nonce = data + APP_KEY_LEN;
+    size_t aadlen = data[HDR - 1];
+    if (size < HDR + aadlen) return 0;
+    const unsigned char *aad = data + HDR, *ct = aad + aadlen;
+    int ctlen = (int)(size - HDR - aadlen);
+
+    unsigned char *pt = malloc((size_t)ctlen + 1), *re = malloc((size_t)ctlen + APP_TAG_LEN);
+    FUZZ_ASSERT(pt && re);
+    int ptlen = -1, relen = 0;
+    if (aead_decrypt(key, aad, (int)aadlen, nonce, ct, ctlen, pt, &ptlen)) {
+        FUZZ_ASSERT(ptlen == ctlen - APP_TAG_LEN);
+        FUZZ_ASSERT(aead_encrypt(key, aad, (int)aadlen, nonce, pt, ptlen, re, &relen));
+        FUZZ_ASSERT(relen == ctlen && memcmp(re, ct, (size_t)ctlen) == 0);
+    }
+    free(pt);
+    free(re);
+    return 0;
+}
+
+// 単体実行の種: ほとんど本物の暗号文で、1 バイトだけずらしたもの
+static size_t fuzz_seed(uint32_t i, unsigned char *buf, size_t cap)
+{
+    size_t pos = 0;
+    memcpy(buf, k_key, APP_KEY_LEN);
+    memcpy(buf + APP_KEY_LEN, k_iv, APP_IV_LEN);
+    pos = APP_KEY_LEN + APP_IV_LEN;
+    size_t aadlen = i % sizeof(APP_AAD);
+    buf[pos++] = (unsigned char)aadlen;
+    memcpy(buf + pos, APP_AAD, aadlen);
+    pos += aadlen;
+    int ptlen = (int)(i % 200), ctlen = 0;
+    unsigned char pt[200];
+    for (int k = 0; k < ptlen; k++) pt[k] = (unsigned char)(k ^ i);
+    if (pos + (size_t)ptlen + APP_TAG_LEN > cap) return pos;
+    aead_encrypt(k_key, buf + APP_KEY_LEN + APP_IV_LEN + 1, (int)aadlen, k_iv, pt, ptlen, buf + pos, &ctlen);
+    pos += (size_t)ctlen;
+    if (i % 3) buf[(i * 2654435761u) % pos] ^= (unsigned char)(1 + i % 255);
+    if (i % 5 == 0) pos -= i % pos;
+    return pos;
+}
+#else
+static int stream_pair(aead_ctx *a, aead_stream *s)
+{
+    if (!aead_ctx_init_suite(a, APP_SUITE, k_key)) return 0;
+    aead_ctx_set_iv(a, k_iv);
+    return aead_stream_init(s, a, APP_RPC_AAD, (int)sizeof(APP_RPC_AAD)-1);
+}
+
+// モード 0: 受信バイト列をそのまま開く（成功しても失敗してもよい、壊れないこと）
+static void fuzz_parse(const uint8_t *data, size_t size)
+{
+    aead_ctx a;
+    aead_stream s;
+    aead_rec recs[16];
+    FUZZ_ASSERT(stream_pair(&a, &s));
+    unsigned char *buf = malloc(size ? size : 1);
+    FUZZ_ASSERT(buf);
+    memcpy(buf, data, size);
+    size_t off = 0;
+    while (off < size && !s.done) {
+        int used = 0;
+        int n = aead_stream_open_batch(&s, buf + off, (int)(size - off), recs, 16, &used);
+        if (n < 0) break;
+        FUZZ_ASSERT(used >= 0 && (size_t)used <= size - off);
+        for (int i = 0; i < n; i++) {
+            FUZZ_ASSERT(recs[i].len >= 0 && recs[i].base >= buf + off &&
+                        APP_REC_PAYLOAD(recs[i].base) + recs[i].len <= buf + off + used);
+        }
+        if (n == 0 && used == 0) break;     // 部分レコード
+        off += (size_t)used;
+    }
+    aead_stream_free(&s);
+    aead_ctx_free(&a);
+    free(buf);
+}
+
+// モード 1: 封印 → 1 ビット反転 → 開く
+static void fuzz_roundtrip(const uint8_t *data, size_t size)
+{
+    if (size < 4) return;
+    uint32_t flip = (uint32_t)data[0] << 16 | (uint32_t)data[1] << 8 | data[2];
+    int chunk = 1 + data[3] * 8;
+    data += 4;
+    size -= 4;
+    size_t nrec = size / (size_t)chunk + 1;
+    size_t cap = size + nrec * APP_REC_OVERHEAD;
+    unsigned char *wire = malloc(cap), *out = malloc((size_t)chunk + APP_REC_OVERHEAD);
+    FUZZ_ASSERT(wire && out);
+
+    aead_ctx a;
+    aead_stream s;
+    FUZZ_ASSERT(stream_pair(&a, &s));
+    size_t w = 0, off = 0;
+    do {
+        int n = size - off < (size_t)chunk ? (int)(size - off) : chunk, flen = 0;
+        FUZZ_ASSERT(aead_stream_seal_chunk(&s, data + off, n, off + (size_t)n == size, wire + w, &flen));
+        w += (size_t)flen;
+        off += (size_t)n;
+    } while (off < size);
+    aead_stream_free(&s);
+    aead_ctx_free(&a);
+
+    int flipped = flip < w * 8;
+    if (flipped) wire[flip / 8] ^= (unsigned char)(1 << (flip % 8));
+
+    FUZZ_ASSERT(stream_pair(&a, &s));
+    size_t r = 0, got = 0;
+    int ok = 1;
+    while (ok && r < w && !s.done) {
+        int ctlen = 0, n = 0;
+        unsigned char fl = 0;
+        if (w - r < APP_REC_HDR_LEN || !aead_rec_get_hdr(wire + r, &ctlen, &fl) ||
+            (size_t)ctlen > w - r - APP_REC_HDR_LEN || ctlen > chunk + APP_TAG_LEN ||
+            !aead_stream_open_chunk(&s, wire + r, wire + r + APP_REC_HDR_LEN, ctlen, out, &n, NULL)) {
+            ok = 0;
+            break;
+        }
+        FUZZ_ASSERT(got + (size_t)n <= size);
+        if (!flipped) FUZZ_ASSERT(memcmp(out, data + got, (size_t)n) == 0);
+        got += (size_t)n;
+        r += APP_REC_HDR_LEN + (size_t)ctlen;
+    }
+    ok = ok && s.done && r == w && got == size;
+    FUZZ_ASSERT(ok == !flipped);
+    aead_stream_free(&s);
+    aead_ctx_free(&a);
+    free(wire);
+    free(out);
+}
+
+// モード 2: 再送検出ウィンドウ = 参照モデル
+static void fuzz_replay(const uint8_t *data, size_t size)
+{
+    enum { MAXN = 512 };
+    uint64_t seen[MAXN];
+    size_t nseen = 0;
+    uint64_t top = 0;
+    int any = 0;
+    aead_replay r;
+    aead_replay_reset(&r);
+    for (size_t i = 0; i + 2 <= size && nseen < MAXN; i += 2) {
+        // 2 バイトで前回の最大値からの相対位置（大きく飛ぶことも、戻ることもある）
+        int16_t d = (int16_t)(data[i] | data[i + 1] << 8);
+        uint64_t n = any ? (d < 0 && (uint64_t)-d > top ? 0 : top + (int64_t)d) : (uint16_t)d;
+        int dup = 0;
+        for (size_t k = 0; k < nseen && !dup; k++) dup = seen[k] == n;
+        int got = aead_replay_check(&r, n);
+        if (dup) FUZZ_ASSERT(!got);
+        if (!dup && (!any || n > top || top - n < APP_REPLAY_WINDOW - 64)) FUZZ_ASSERT(got);
+        if (any && n <= top && top - n >= APP_REPLAY_WINDOW) FUZZ_ASSERT(!got);
+        if (got) {
+            aead_replay_update(&r, n);
+            seen[nseen++] = n;
+            if (!any || n > top) top = n;
+            any = 1;
+        }
+    }
+}
+
+static int fuzz_one(const uint8_t *data, size_t size)
+{
+    if (size < 1) return 0;
+    switch (data[0] % 3) {
+    case 0: fuzz_parse(data + 1, size - 1); break;
+    case 1: fuzz_roundtrip(data + 1, size - 1); break;
+    case 2: fuzz_replay(data + 1, size - 1); break;
+    }
+    return 0;
+}
+
+// 単体実行の種: 本物の封印ストリームを少し壊したもの / 封印テスト / 再送列
+static size_t fuzz_seed(uint32_t i, unsigned char *buf, size_t cap)
+{
+    uint32_t x = i * 2654435761u + 1;
+    size_t n = 1 + (x >> 8) % (cap - 1 < 3000 ? cap - 1 : 3000);
+    buf[0] = (unsigned char)(i % 3);
+    for (size_t k = 1; k < n; k++) { x ^= x << 13; x ^= x >> 17; x ^= x << 5; buf[k] = (unsigned char)x; }
+    if (buf[0] == 0 && n > 64) {
+        aead_ctx a;
+        aead_stream s;
+        int flen = 0, len = (int)(n / 3);
+        if (stream_pair(&a, &s) && aead_stream_seal_chunk(&s, buf + 1, len, i & 1, buf + 1, &flen)) {
+            n = 1 + (size_t)flen;
+            if (i % 4 > 1) buf[1 + x % (size_t)flen] ^= 0x80;
+            if (i % 7 == 0) n -= 1 + x % (size_t)flen / 2;
+        }
+        aead_stream_free(&s);
+        aead_ctx_free(&a);
+    }
+    if (buf[0] == 1 && n > 4) buf[1] = (unsigned char)(i % 8 ? buf[1] : 0xff);   // 半分強は反転なし
+    return n;
+}
+#endif
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    fuzz_init();
+    return fuzz_one(data, size);
+}
+
+#ifdef FUZZ_STANDALONE
+// libFuzzer がない環境向け: ファイルを 1 つずつ、または決まった種を N 個回す
+int main(int argc, char **argv)
+{
+    static unsigned char buf[1 << 16];
+    if (argc > 1 && strcmp(argv[1], "-n") != 0) {
+        for (int i = 1; i < argc; i++) {
+            FILE *f = fopen(argv[i], "rb");
+            if (!f) { perror(argv[i]); return 1; }
+            size_t n = fread(buf, 1, sizeof(buf), f);
+            fclose(f);
+            LLVMFuzzerTestOneInput(buf, n);
+        }
+        printf("[F] %d inputs ok\n", argc - 1);
+        return 0;
+    }
+    uint32_t iters = argc > 2 ? (uint32_t)strtoul(argv[2], NULL, 10) : 20000;
+    for (uint32_t i = 0; i < iters; i++) {
+        size_t n = fuzz_seed(i, buf, sizeof(buf));
+        LLVMFuzzerTestOneInput(buf, n);
+    }
+    printf("[F] %u generated inputs ok\n", iters);
+    crypto_rt_cleanup();
+    return 0;
+}
+#endif
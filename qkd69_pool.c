@@ -0,0 +1,215 @@
+// qkd69_pool.c  —  Stage69 TLS+QKDハイブリッド : QKD 鍵プールの供給プロセス
+//   build: cc -O2 -o qkd69_pool qkd69_pool.c -lssl -lcrypto
+//
+// 共有メモリの鍵プール（hybrid_qkdpool.h）を作り、KMS から先読みした鍵を
+// 詰める（単一プロデューサ）。qkd69_s -q が取り出し、qkd69_c -q が key id で
+// 同じ鍵を引く。KMS 取得（ETSI 014 の REST 相当）は数 ms かかるので accept
+// 経路では待たず、ここで残量が低水位 (-w) を割ったら -b 本ずつまとめて -k 本まで
+// 補充する。KMS はデモでは RAND_bytes + 遅延 (-l) + レート上限 (-r) で代用。
+// プールが空で代用鍵に落ちた回数（stalls）は共有ヘッダにあり、定期的に表示する。
+// -S でリングを NUMA ノードごとのシャードに分け（既定はノード数）、各ワーカーは
+// 自ノードのシャードから取り出す。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+
+#include "hybrid_qkdpool.h"
+#include "hybrid_config.h"
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    g_stop = 1;
+}
+
+static void sleep_ms(int ms)
+{
+    struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// ---- KMS 代用 -------------------------------------------------------------
+// 1回の要求で最大 n 本。latency_ms の往復遅延があり、rate>0 なら
+// 累積の供給量を rate 本/秒に抑える。取得できた本数を返す（0 なら待つ）。
+typedef struct {
+    int    latency_ms;
+    long   rate;
+    double t0;
+    uint64_t fetched;
+    uint64_t requests;
+} kms_src;
+
+static int kms_fetch(kms_src *k, unsigned char *keys, int n)
+{
+    if (k->rate) {
+        double allow = (now_sec() - k->t0) * (double)k->rate - (double)k->fetched;
+        if (allow < 1) return 0;
+        if (allow < n) n = (int)allow;
+    }
+    if (k->latency_ms) sleep_ms(k->latency_ms);
+    if (RAND_bytes(keys, n * QKD_POOL_KEY_LEN) != 1) return -1;
+    k->fetched += (uint64_t)n;
+    k->requests++;
+    return n;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-C file] [-O name=value] [-p name] [-n slots] [-S shards] [-k keep] [-w low] [-b batch] [-l ms] [-r keys_per_sec] [-s secs] [-u]\n"
+                    "  -C  read settings from a file first (name = value per line, names below)\n"
+                    "  -O  set one setting by name, e.g. -O batch=256\n"
+                    "  -p  shared-memory name (name, default " QKD_POOL_NAME ")\n"
+                    "  -n  ring size in keys (slots, default 4096)\n"
+                    "  -S  shards, bound round robin to NUMA nodes (shards, default: one per node)\n"
+                    "  -k  keys to keep ready after a refill (keep, default: ring size)\n"
+                    "  -w  low watermark that triggers a refill (low, default: keep / 4)\n"
+                    "  -b  keys per KMS request (batch, default 64)\n"
+                    "  -l  simulated KMS request latency in ms (kms_latency_ms, default 0)\n"
+                    "  -r  KMS key rate limit, 0 = unlimited (kms_rate, default 0)\n"
+                    "  -s  stats interval in seconds, 0 = only at exit (stats_secs, default 10)\n"
+                    "  -u  remove the pool and exit\n", prog);
+}
+
+// ---- 設定（-C ファイル → コマンドライン の順に適用、後が勝つ） ------------
+#define POOL_OPTS "C:O:p:n:S:k:w:b:l:r:s:uh"
+
+typedef struct {
+    const char *name;
+    long nslots, keep, low, nshards;
+    int batch, stats_secs, unlink;
+    kms_src kms;
+} pool_cfg;
+
+static const app_cfg_key k_pool_cfg[] = {
+    { "name", 'p', 0 }, { "slots", 'n', 0 }, { "shards", 'S', 0 }, { "keep", 'k', 0 },
+    { "low", 'w', 0 }, { "batch", 'b', 0 }, { "kms_latency_ms", 'l', 0 }, { "kms_rate", 'r', 0 },
+    { "stats_secs", 's', 0 },
+    { NULL, 0, 0 }
+};
+
+static int pool_set(int opt, const char *val, void *arg)
+{
+    pool_cfg *c = (pool_cfg *)arg;
+    switch (opt) {
+    case 'O': return app_cfg_apply_pair(k_pool_cfg, val, pool_set, arg);
+    case 'p': c->name = val; break;
+    case 'n': c->nslots = atol(val); break;
+    case 'S': c->nshards = atol(val); break;
+    case 'k': c->keep = atol(val); break;
+    case 'w': c->low = atol(val); break;
+    case 'b': c->batch = atoi(val); break;
+    case 'l': c->kms.latency_ms = atoi(val); break;
+    case 'r': c->kms.rate = atol(val); break;
+    case 's': c->stats_secs = atoi(val); break;
+    case 'u': c->unlink = 1; break;
+    default:  return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    pool_cfg cfg = {
+        .name = QKD_POOL_NAME, .nslots = 4096, .low = -1, .nshards = app_numa_nodes(),
+        .batch = 64, .stats_secs = 10,
+    };
+
+    const char *cfg_file = app_cfg_prescan(argc, argv, POOL_OPTS);
+    if (cfg_file && !app_cfg_load(cfg_file, k_pool_cfg, pool_set, &cfg)) return 1;
+    int opt;
+    while ((opt = getopt(argc, argv, POOL_OPTS)) != -1) {
+        if (opt == 'C') continue;
+        if (!pool_set(opt, optarg, &cfg)) { usage(argv[0]); return opt == 'h' ? 0 : 1; }
+    }
+    const char *name = cfg.name;
+    if (cfg.unlink) return shm_unlink(name) == 0 ? 0 : (perror(name), 1);
+    long nslots = cfg.nslots, keep = cfg.keep, low = cfg.low, nshards = cfg.nshards;
+    int batch = cfg.batch, stats_secs = cfg.stats_secs;
+    kms_src kms = cfg.kms;
+    if (keep == 0) keep = nslots;
+    if (low < 0) low = keep / 4;
+    if (nslots < 1 || nslots > (1L << 24) || nshards < 1 || nshards > QKD_POOL_MAX_SHARDS || keep < 1 || keep > nslots || low >= keep ||
+        batch < 1 || batch > 4096 || kms.latency_ms < 0 || kms.rate < 0 || stats_secs < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    printf("[P] config: name=%s slots=%ld shards=%ld keep=%ld low=%ld batch=%d kms_latency_ms=%d kms_rate=%ld stats_secs=%d\n",
+           name, nslots, nshards, keep, low, batch, kms.latency_ms, kms.rate, stats_secs);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    qkd_pool pool;
+    if (!qkd_pool_open_shards(&pool, name, 1, (uint32_t)nslots, (uint32_t)nshards)) {
+        perror(name);
+        return 1;
+    }
+    unsigned char *keys = malloc((size_t)batch * QKD_POOL_KEY_LEN);
+    if (!keys) { perror("malloc"); return 1; }
+    printf("[P] QKD key pool %s: %u slots x %d B in %ld shards, keep %ld, low watermark %ld, batch %d\n",
+           name, pool.hdr->nslots, QKD_POOL_KEY_LEN, nshards, keep, low, batch);
+
+    // 残量が low を割ったら keep まで補充。それ以外は 1ms ごとに残量を見るだけ
+    uint64_t delivered = 0, refills = 0, last_stalls = 0;
+    int filling = 1;          // 起動直後は keep まで詰める
+    kms.t0 = now_sec();
+    double next_stats = kms.t0 + stats_secs;
+    while (!g_stop) {
+        uint64_t avail = qkd_pool_available(&pool);
+        if (!filling && avail < (uint64_t)low) { filling = 1; refills++; }
+        if (filling && avail >= (uint64_t)keep) filling = 0;
+
+        int got = 0;
+        if (filling) {
+            int want = (int)((uint64_t)keep - avail < (uint64_t)batch ? (uint64_t)keep - avail : (uint64_t)batch);
+            got = kms_fetch(&kms, keys, want);
+            if (got < 0) { fprintf(stderr, "KMS fetch failed\n"); break; }
+            int put = 0;
+            while (put < got && qkd_pool_put(&pool, keys + (size_t)put * QKD_POOL_KEY_LEN)) put++;
+            delivered += (uint64_t)put;   // 入りきらない分（取り残し slot 待ち）は捨てる
+            OPENSSL_cleanse(keys, (size_t)got * QKD_POOL_KEY_LEN);
+            if (put < got) got = 0;
+        }
+        if (got == 0) sleep_ms(1);
+
+        if (stats_secs && now_sec() >= next_stats) {
+            uint64_t stalls = qkd_pool_stalls(&pool);
+            printf("[P] ready %llu, claimed %llu, stalls %llu (+%llu), refills %llu, KMS requests %llu\n",
+                   (unsigned long long)qkd_pool_available(&pool),
+                   (unsigned long long)qkd_pool_claims(&pool),
+                   (unsigned long long)stalls, (unsigned long long)(stalls - last_stalls),
+                   (unsigned long long)refills, (unsigned long long)kms.requests);
+            fflush(stdout);
+            last_stalls = stalls;
+            next_stats += stats_secs;
+        }
+    }
+
+    printf("[P] delivered %llu keys, %llu unclaimed, %llu claimed, %llu stalls, %llu refills\n",
+           (unsigned long long)delivered, (unsigned long long)qkd_pool_available(&pool),
+           (unsigned long long)qkd_pool_claims(&pool),
+           (unsigned long long)qkd_pool_stalls(&pool), (unsigned long long)refills);
+    free(keys);
+    // 残っている鍵を消してから外す
+    qkd_pool_wipe(&pool);
+    qkd_pool_close(&pool);
+    shm_unlink(name);
+    return 0;
+}
@@ -1,11 +1,21 @@
 // qkd69_s.c  —  Stage69 TLS+QKDハイブリッド : サーバー（単体で完結版）
+#define _GNU_SOURCE          // accept4
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/time.h>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -13,193 +23,1426 @@
 #include <openssl/hmac.h>
 #include <openssl/rand.h>
 #include <openssl/kdf.h>     // HKDF
+#include <openssl/core_names.h>
+#include <openssl/async.h>   // -O async: SSL_MODE_ASYNC
 
-// ====== 可変部（必要なら変更）=========================================
+#include "hybrid_common.h"   // AEAD (aead_ctx), HKDF 鍵導出
+#include "hybrid_qkdpool.h"  // 共有メモリの QKD 鍵プール
+#include "hybrid_pstream.h"  // 1ストリームの並列封印
+#include "hybrid_mb.h"       // 小レコードのマルチバッファ封印
+#include "hybrid_metrics.h"  // -m: Prometheus /metrics
+#include "hybrid_numa.h"     // -c: CPU 固定と NUMA 配置
+#include "hybrid_config.h"   // -C: 設定ファイル
+#include "hybrid_reclog.h"   // -O record_log: 封印レコードの監査ログ
+
+// ====== 既定値（-C 設定ファイル / -H -P / -O cert=... key=... で実行時に変更）=====
 #define HOST        "127.0.0.1"
 #define PORT        8443
 #define CERT_FILE   "server.crt"
 #define KEY_FILE    "server.key"
-
-// AES-GCM 用パラメータ
-#define APP_KEY_LEN 32       // AES-256
-#define APP_IV_LEN  12       // GCM 非推奨でない 96bit
-#define TAG_LEN     16
+// AEAD スイートと KEY/IV/TAG 長は hybrid_common.h（-DAPP_SUITE 等でビルド時に固定。両端で同じ値）
+// 実行時に選べるのはその鍵長に収まるスイート（-a）
 // ====================================================================
 
-// ---- AES-GCM 暗号化（out = ciphertext||tag）-------------------------
-static int aead_encrypt(const unsigned char *key,
-                        const unsigned char *aad, int aadlen,
-                        const unsigned char *nonce, int noncelen,
-                        const unsigned char *pt, int ptlen,
-                        unsigned char *out, int *outlen)
+static const char *g_host = HOST;
+static int         g_port = PORT;
+static int         g_verbose = 0;   // -O verbose=yes: 接続ごとのログ行（既定は出さない。件数は -m のメトリクスで）
+
+static void openssl_fatal(const char *where)
 {
-    int len = 0, ctlen = 0;
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-    if(!ctx) return 0;
+    fprintf(stderr, "[OpenSSL] %s failed\n", where);
+    ERR_print_errors_fp(stderr);
+}
+
+// ---- TLS セッション再開（ステートレスチケット、鍵は定期ローテーション） ------
+// 再接続クライアントは証明書署名つきのフルハンドシェイクを省略できる。
+// 鍵は -t 秒ごとに更新し、1世代前の鍵で暗号化されたチケットも受け付ける
+// （その場合は新しい鍵でチケットを再発行させる）。
+typedef struct {
+    unsigned char name[16];
+    unsigned char aes[32];
+    unsigned char hmac[32];
+} ticket_key;
 
-    if(!EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL)) goto err;
-    if(!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, noncelen, NULL)) goto err;
-    if(!EVP_EncryptInit_ex(ctx, NULL, NULL, key, nonce)) goto err;
+static struct {
+    pthread_mutex_t mu;
+    EVP_CIPHER *cipher;     // AES-256-CBC（起動時に1回 fetch）
+    ticket_key  cur, prev;
+    int         has_prev;
+    time_t      rotated;
+    int         interval;   // 秒
+} g_tk = { .mu = PTHREAD_MUTEX_INITIALIZER, .interval = 3600 };
 
-    if(aad && aadlen>0){
-        if(!EVP_EncryptUpdate(ctx, NULL, &len, aad, aadlen)) goto err;
+static int ticket_key_new(ticket_key *k)
+{
+    return RAND_bytes(k->name, sizeof(k->name)) == 1 &&
+           RAND_bytes(k->aes,  sizeof(k->aes))  == 1 &&
+           RAND_bytes(k->hmac, sizeof(k->hmac)) == 1;
+}
+
+// g_tk.mu を保持して呼ぶ
+static void ticket_keys_rotate_if_due(void)
+{
+    time_t now = time(NULL);
+    if(now - g_tk.rotated < g_tk.interval) return;
+    ticket_key next;
+    if(!ticket_key_new(&next)) return;   // 失敗時は現行鍵を使い続ける
+    g_tk.prev     = g_tk.cur;
+    g_tk.has_prev = 1;
+    g_tk.cur      = next;
+    g_tk.rotated  = now;
+    OPENSSL_cleanse(&next, sizeof(next));
+}
+
+static int ticket_key_cb(SSL *s, unsigned char key_name[16], unsigned char *iv,
+                         EVP_CIPHER_CTX *cctx, EVP_MAC_CTX *hctx, int enc)
+{
+    ticket_key k;
+    int ret = 1;
+
+    pthread_mutex_lock(&g_tk.mu);
+    ticket_keys_rotate_if_due();
+    if(enc || memcmp(key_name, g_tk.cur.name, 16) == 0){
+        k = g_tk.cur;
+    }else if(g_tk.has_prev && memcmp(key_name, g_tk.prev.name, 16) == 0){
+        k = g_tk.prev;
+        ret = 2;                          // 復号は可、再発行させる
+    }else{
+        ret = 0;                          // 不明な鍵 → フルハンドシェイク
     }
-    if(!EVP_EncryptUpdate(ctx, out, &len, pt, ptlen)) goto err;
-    ctlen = len;
+    pthread_mutex_unlock(&g_tk.mu);
+    if(ret == 0) return 0;
+    // TLS 1.3 のチケットは使い捨て。再発行しないとクライアントは毎回交互にフルハンドシェイクになる
+    if(!enc && SSL_version(s) >= TLS1_3_VERSION) ret = 2;
+
+    OSSL_PARAM params[3];
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, k.hmac, sizeof(k.hmac));
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *)"SHA256", 0);
+    params[2] = OSSL_PARAM_construct_end();
 
-    if(!EVP_EncryptFinal_ex(ctx, out + ctlen, &len)) goto err;
-    ctlen += len;
+    if(enc){
+        memcpy(key_name, k.name, 16);
+        if(RAND_bytes(iv, EVP_CIPHER_get_iv_length(g_tk.cipher)) != 1 ||
+           EVP_EncryptInit_ex(cctx, g_tk.cipher, NULL, k.aes, iv) != 1) ret = -1;
+    }else{
+        if(EVP_DecryptInit_ex(cctx, g_tk.cipher, NULL, k.aes, iv) != 1) ret = -1;
+    }
+    if(ret > 0 && EVP_MAC_CTX_set_params(hctx, params) != 1) ret = -1;
 
-    if(!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, TAG_LEN, out + ctlen)) goto err;
-    ctlen += TAG_LEN;
+    OPENSSL_cleanse(&k, sizeof(k));
+    return ret;
+}
 
-    *outlen = ctlen;
-    EVP_CIPHER_CTX_free(ctx);
+// 起動時に 1 回。チケット鍵はコンテキストを差し替えても引き継ぐ
+static int ticket_keys_init(int interval)
+{
+    g_tk.interval = interval;
+    g_tk.cipher   = EVP_CIPHER_fetch(NULL, "AES-256-CBC", NULL);
+    if(!g_tk.cipher || !ticket_key_new(&g_tk.cur)) return 0;
+    g_tk.rotated = time(NULL);
     return 1;
-err:
-    EVP_CIPHER_CTX_free(ctx);
-    return 0;
 }
 
-// ---- QKD からアプリ鍵を導出（デモでは QKD = ランダム64B） ------------
-//   tx = HKDF-SHA256(qkd, salt="", info="stage69 tx", len=32)
-//   rx = HKDF-SHA256(qkd, salt="", info="stage69 rx", len=32)
-static int derive_app_keys(const unsigned char *qkd, size_t qkd_len,
-                           unsigned char *tx32, unsigned char *rx32)
+static int setup_resumption(SSL_CTX *ctx)
+{
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"stage69", 7);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    return SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb) == 1;
+}
+
+// ---- 現行の TLS コンテキスト（SIGHUP で証明書を読み直して差し替え） ----------
+// 新しい接続は現行の SSL_CTX から SSL を作る。差し替え後も SSL は自分の
+// SSL_CTX の参照を持つので、既存の接続は古い方で最後まで続き、古い方は
+// 最後の接続が閉じたときに解放される。各スレッドは現行コンテキストの参照を
+// 1 つ持ち、世代番号が変わったときだけロックを取って持ち替える（accept 経路は
+// アトミック読み 1 回）。チケット鍵は共通なので、再開可能なクライアントは
+// 差し替え後もフルハンドシェイクにならない。
+static struct {
+    pthread_mutex_t mu;
+    SSL_CTX *cur;
+    _Atomic unsigned gen;
+} g_ctx = { .mu = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread SSL_CTX *t_ctx;
+static __thread unsigned t_ctx_gen;
+
+static SSL_CTX *ctx_current(void)
+{
+    unsigned gen = atomic_load_explicit(&g_ctx.gen, memory_order_acquire);
+    if(t_ctx && t_ctx_gen == gen) return t_ctx;
+    pthread_mutex_lock(&g_ctx.mu);
+    SSL_CTX *c = g_ctx.cur;
+    SSL_CTX_up_ref(c);
+    gen = atomic_load_explicit(&g_ctx.gen, memory_order_relaxed);
+    pthread_mutex_unlock(&g_ctx.mu);
+    if(t_ctx) SSL_CTX_free(t_ctx);
+    t_ctx     = c;
+    t_ctx_gen = gen;
+    return c;
+}
+
+// ctx の参照を引き取って現行にする（NULL で外すだけ）。戻り値は新しい世代番号
+static unsigned ctx_publish(SSL_CTX *ctx)
+{
+    pthread_mutex_lock(&g_ctx.mu);
+    SSL_CTX *old = g_ctx.cur;
+    g_ctx.cur = ctx;
+    unsigned gen = atomic_fetch_add_explicit(&g_ctx.gen, 1, memory_order_release) + 1;
+    pthread_mutex_unlock(&g_ctx.mu);
+    if(old) SSL_CTX_free(old);
+    return gen;
+}
+
+// ---- 接続ごとの送信鍵（QKD 鍵導出 → aead_ctx） ---------------------------
+// 鍵スケジュールは接続ごとに1回だけ展開（以降は nonce 差し替えのみ）。
+// nonce は HKDF 由来の tx_iv とレコードカウンタから作るので RAND_bytes 不要。
+// -q で鍵プールがあればそこから1本取り出し（ロックなし）、その key id を
+// keyid[QKD_KEYID_LEN] に書く。呼び出し側はこれをレコードより先に送る。
+// プールが無い・空なら TLS エクスポータのみ（key id = QKD_KEYID_NONE）。
+// rx（NULL 可）にはクライアント→サーバー方向（リクエスト）の aead_ctx を用意する。
+// chain（NULL 可）にはエポック更新用の送信方向チェーン秘密を返す。
+// mb なら aead_mb_seal 用の鍵スケジュールも付ける（AES-256-GCM のときだけ）。成功で 1。
+static qkd_pool g_pool;          // hdr == NULL ならプールなし
+static int      g_pool_on = 0;
+// -O record_log: 送信方向の封印レコードを全部ログへ（ストリーム id は接続ごと）
+static app_reclog g_reclog;
+static int        g_reclog_on = 0;
+
+static int init_tx_ctx(SSL *ssl, aead_ctx *tx, aead_ctx *rx, unsigned char *keyid, unsigned char *chain, int mb)
 {
     int ok = 0;
-    EVP_PKEY_CTX *pctx = NULL;
-
-    // tx
-    pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
-    if(!pctx) goto done;
-    if(EVP_PKEY_derive_init(pctx) <= 0) goto done;
-    if(EVP_PKEY_CTX_set_hkdf_md(pctx, EVP_sha256()) <= 0) goto done;
-    if(EVP_PKEY_CTX_set1_hkdf_salt(pctx, "", 0) <= 0) goto done;
-    if(EVP_PKEY_CTX_set1_hkdf_key(pctx, qkd, (int)qkd_len) <= 0) goto done;
-    if(EVP_PKEY_CTX_add1_hkdf_info(pctx, "stage69 tx", 10) <= 0) goto done;
-    size_t len = APP_KEY_LEN;
-    if(EVP_PKEY_derive(pctx, tx32, &len) <= 0 || len != APP_KEY_LEN) goto done;
-    EVP_PKEY_CTX_free(pctx); pctx = NULL;
-
-    // rx
-    pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
-    if(!pctx) goto done;
-    if(EVP_PKEY_derive_init(pctx) <= 0) goto done;
-    if(EVP_PKEY_CTX_set_hkdf_md(pctx, EVP_sha256()) <= 0) goto done;
-    if(EVP_PKEY_CTX_set1_hkdf_salt(pctx, "", 0) <= 0) goto done;
-    if(EVP_PKEY_CTX_set1_hkdf_key(pctx, qkd, (int)qkd_len) <= 0) goto done;
-    if(EVP_PKEY_CTX_add1_hkdf_info(pctx, "stage69 rx", 10) <= 0) goto done;
-    len = APP_KEY_LEN;
-    if(EVP_PKEY_derive(pctx, rx32, &len) <= 0 || len != APP_KEY_LEN) goto done;
 
+    unsigned char pkey[QKD_POOL_KEY_LEN];
+    unsigned char secret[QKD_SECRET_MAX];
+    unsigned char k_tx[APP_KEY_LEN], k_rx[APP_KEY_LEN];
+    unsigned char iv_tx[APP_IV_LEN], iv_rx[APP_IV_LEN];
+    uint64_t id = QKD_KEYID_NONE;
+    uint64_t t0 = app_metrics_now_ns();
+    int have_key = g_pool_on && qkd_pool_claim(&g_pool, pkey, &id);
+    size_t slen = qkd_session_secret(ssl, have_key ? pkey : NULL, secret);
+    if(!slen){
+        openssl_fatal("SSL_export_keying_material");
+        goto done;
+    }
+    if(!derive_app_keys_chained(secret, slen, k_tx, k_rx, iv_tx, iv_rx, chain, NULL)){
+        fprintf(stderr, "derive_app_keys failed\n");
+        goto done;
+    }
+    // スイートはハンドシェイクの ALPN で合意済み（無ければビルド既定）
+    if(!aead_ctx_init_suite(tx, app_suite_negotiated(ssl), k_tx)){
+        fprintf(stderr, "aead_ctx_init failed\n");
+        goto done;
+    }
+    if(mb && !aead_ctx_mb_init(tx, k_tx)){
+        fprintf(stderr, "aead_ctx_mb_init failed\n");
+        goto done;
+    }
+    aead_ctx_set_iv(tx, iv_tx);
+    if(g_reclog_on) tx->log_id = app_reclog_stream(&g_reclog);
+    if(rx){
+        if(!aead_ctx_init_suite(rx, tx->suite, k_rx)){
+            fprintf(stderr, "aead_ctx_init failed\n");
+            goto done;
+        }
+        aead_ctx_set_iv(rx, iv_rx);
+    }
+    qkd_keyid_put(keyid, id);
+    app_metric_since(APP_H_KEY_DERIVATION, t0);
     ok = 1;
 done:
-    if(pctx) EVP_PKEY_CTX_free(pctx);
+    OPENSSL_cleanse(pkey, sizeof(pkey));
+    OPENSSL_cleanse(secret, sizeof(secret));
+    OPENSSL_cleanse(k_tx, sizeof(k_tx));
+    OPENSSL_cleanse(k_rx, sizeof(k_rx));
     return ok;
 }
 
-static void openssl_fatal(const char *where)
+// ---- 送信レコード作成（「key id || hdr||ct」、1チャンクのストリーム） ----
+// nonce はカウンタから導出するのでワイヤには載せない。
+// out は HELLO_BUF_LEN バイト以上（バッファプールの 1 本に収まる）。
+#define HELLO_BUF_LEN (QKD_KEYID_LEN + APP_REC_OVERHEAD + 1024)
+_Static_assert(HELLO_BUF_LEN <= APP_BUF_SIZE, "hello must fit a pool buffer");
+
+// 接続のセッション鍵。hello を封印した後もリクエスト応答に使い続ける。
+typedef struct {
+    aead_ctx    tx, rx;     // サーバー→クライアント / クライアント→サーバー
+    aead_stream out;        // hello、続いて応答（APP_RPC_AAD）
+    aead_stream in;         // リクエスト（APP_RPC_AAD）
+} conn_session;
+
+static void conn_session_free(conn_session *s)
 {
-    fprintf(stderr, "[OpenSSL] %s failed\n", where);
-    ERR_print_errors_fp(stderr);
+    aead_stream_free(&s->out);
+    aead_stream_free(&s->in);
+    aead_ctx_free(&s->tx);
+    aead_ctx_free(&s->rx);
 }
 
-// ---- メイン（TLSサーバー → 接続1件受けて暗号メッセージ送信） ---------
-int main(void)
+// 封印は hello_prepare → aead_mb_seal → hello_finish の 3 段。-e では同じ
+// epoll 周回でハンドシェイクを終えた接続の hello をまとめて 1 回で封印する。
+static const unsigned char k_hello_msg[] =
+    "Hello from Stage69 server with TLS+QKD hybrid";
+
+// 鍵を導出し、平文を out のペイロード位置に置いて j を用意する。
+// 失敗しても s は conn_session_free で片付ける。成功で 1。
+static int hello_prepare(SSL *ssl, unsigned char *out, conn_session *s, aead_mb_job *j)
 {
-    // OpenSSL 初期化
-    SSL_load_error_strings();
-    OpenSSL_add_ssl_algorithms();
+    memset(s, 0, sizeof(*s));
+    if(!init_tx_ctx(ssl, &s->tx, &s->rx, out, NULL, 1)) return 0;
 
-    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
-    if(!ctx){ openssl_fatal("SSL_CTX_new"); return 1; }
+    unsigned char *frame = out + QKD_KEYID_LEN;
+    int len = (int)sizeof(k_hello_msg)-1;
+    memcpy(APP_REC_PAYLOAD(frame), k_hello_msg, (size_t)len);
+    return aead_stream_init(&s->out, &s->tx, APP_AAD, (int)sizeof(APP_AAD)-1) &&
+           aead_mb_job_chunk(j, &s->out, frame, len, 1);
+}
+
+// 封印結果を受け取り、リクエスト応答用のストリームを用意する。
+// outlen は key id 込み。成功で 1。
+static int hello_finish(conn_session *s, const aead_mb_job *j, int *outlen)
+{
+    if(!j->ok){ fprintf(stderr, "aead_mb_seal failed\n"); return 0; }
+    *outlen = QKD_KEYID_LEN + APP_REC_HDR_LEN + j->outlen;
+    aead_stream_free(&s->out);
+    return aead_stream_init(&s->out, &s->tx, APP_RPC_AAD, (int)sizeof(APP_RPC_AAD)-1) &&
+           aead_stream_init(&s->in,  &s->rx, APP_RPC_AAD, (int)sizeof(APP_RPC_AAD)-1);
+}
+
+static int build_hello(SSL *ssl, unsigned char *out, conn_session *s, int *outlen)
+{
+    aead_mb_job j;
+    if(!hello_prepare(ssl, out, s, &j)) return 0;
+    aead_mb_seal(&j, 1);
+    return hello_finish(s, &j, outlen);
+}
 
-    if(SSL_CTX_use_certificate_file(ctx, CERT_FILE, SSL_FILETYPE_PEM) != 1){
-        openssl_fatal("use_certificate"); return 1;
+// ---- リクエスト応答（hello の後、同じ接続で） ------------------------------
+// クライアントは応答を待たずに何件でも送ってくる（パイプライン）。buf 先頭の
+// 完全なリクエストをその場で開き、同じ場所に応答（ペイロードのエコー）を
+// 封印する。応答は要求と同じ長さなので buf[0..used) がそのまま送る応答列。
+// 開封も封印もジョブ列にして aead_mb_open / aead_mb_seal に 1 回で渡す。
+// -e では周回中に溜まった全接続のリクエストを同じ 1 回にまとめる（hello と同じ）。
+#define RPC_BATCH 16
+
+// buf 先頭の完全なフレームを開封ジョブ j[0..) にする（最大 max 件、最終
+// リクエストの後は止まる）。*used は使ったバイト数。
+// 戻り値: ジョブ数（0 = 完全なレコードがまだ無い）、ヘッダ不正で -1。
+static int rpc_prepare(conn_session *s, unsigned char *buf, int fill, aead_mb_job *j, int max, int *used)
+{
+    int off = 0, n = 0;
+    while(n < max && !s->in.done && fill - off >= APP_REC_HDR_LEN){
+        int ctlen = 0;
+        unsigned char flags = 0;
+        if(!aead_rec_get_hdr(buf + off, &ctlen, &flags)) return -1;
+        if(fill - off < APP_REC_HDR_LEN + ctlen) break;
+        if(!aead_mb_job_open_chunk(&j[n], &s->in, buf + off, ctlen)) return -1;
+        n++;
+        off += APP_REC_HDR_LEN + ctlen;
     }
-    if(SSL_CTX_use_PrivateKey_file(ctx, KEY_FILE, SSL_FILETYPE_PEM) != 1){
-        openssl_fatal("use_privatekey"); return 1;
+    *used = off;
+    return n;
+}
+
+// 開封済みのジョブ j[0..n) を、同じ場所へ封印する応答のジョブに置き換える。
+// 開封に失敗したジョブがあれば 0。
+static int rpc_reply(conn_session *s, aead_mb_job *j, int n)
+{
+    for(int i = 0; i < n; i++){
+        if(!j[i].ok) return 0;
+        unsigned char *frame = j[i].frame;
+        int len = j[i].outlen, final = APP_REC_FLAGS(frame) & APP_REC_FINAL;
+        if(!aead_mb_job_chunk(&j[i], &s->out, frame, len, final)) return 0;
     }
-    if(SSL_CTX_check_private_key(ctx) != 1){
-        openssl_fatal("check_private_key"); return 1;
+    return 1;
+}
+
+static int rpc_sealed(const aead_mb_job *j, int n)
+{
+    for(int i = 0; i < n; i++) if(!j[i].ok) return 0;
+    return 1;
+}
+
+// 1 接続分をその場で: 戻り値は応答したレコード数（0 = 完全なレコードがまだ無い）、
+// 認証失敗で -1。
+static int rpc_answer(conn_session *s, unsigned char *buf, int fill, int *used)
+{
+    aead_mb_job j[RPC_BATCH];
+    *used = 0;
+    int n = rpc_prepare(s, buf, fill, j, RPC_BATCH, used);
+    if(n <= 0) return n;
+    aead_mb_open(j, n);
+    if(!rpc_reply(s, j, n)) return -1;
+    aead_mb_seal(j, n);
+    return rpc_sealed(j, n) ? n : -1;
+}
+
+// ブロッキング版: 最終リクエストに答えるか、相手が閉じる（1回きりの
+// クライアントは hello を読んだら close_notify）まで続ける。無通信が
+// idle_secs 続くと SSL_read がタイムアウトで失敗し、接続を閉じる。
+static void serve_requests(SSL *ssl, conn_session *s, unsigned char *buf)
+{
+    int fill = 0;
+    while(!s->in.done){
+        int used = 0, n = rpc_answer(s, buf, fill, &used);
+        if(n < 0){ fprintf(stderr, "[S] request authentication failed\n"); return; }
+        if(n > 0){
+            if(SSL_write(ssl, buf, used) <= 0) return;
+            memmove(buf, buf + used, (size_t)(fill - used));
+            fill -= used;
+            continue;
+        }
+        int r = SSL_read(ssl, buf + fill, APP_BUF_SIZE - fill);
+        if(r <= 0) return;
+        fill += r;
     }
+}
 
-    // ソケット待ち受け
+// ---- ファイルのストリーム送信（チャンク単位で暗号化 → 即 SSL_write） ------
+// メモリ使用量はファイルサイズに依らず 1 チャンク分。
+// -k N なら N チャンクごとにプールの新しい QKD 鍵でエポックを進める（再接続なし）。
+// -p N なら N スレッドでチャンクを並列に封印し、順番どおりに SSL_write する。
+// 封印スレッドは起動時に作る 1 つのプールを全接続で共有する（接続ごとには作らない）。
+static const char *g_stream_file = NULL;   // -f で指定
+static uint64_t    g_rekey_chunks = 0;     // -k で指定、0 = エポック更新なし
+static int         g_seal_threads = 1;     // -p で指定
+
+static int stream_read_file(void *io, unsigned char *buf, int len)
+{
+    size_t n = fread(buf, 1, (size_t)len, (FILE *)io);
+    return ferror((FILE *)io) ? -1 : (int)n;
+}
+
+static int stream_write_ssl(void *io, const unsigned char *buf, int len)
+{
+    return SSL_write((SSL *)io, buf, len) == len;
+}
+
+static int send_file_stream(SSL *ssl, const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if(!fp){ perror(path); return 0; }
+
+    aead_ctx tx = {0};
+    unsigned char keyid[QKD_KEYID_LEN];
+    aead_rekey rk = { qkd_pool_rekey_cb, &g_pool, {0}, g_rekey_chunks };
+    int ok = init_tx_ctx(ssl, &tx, NULL, keyid, rk.chain, 0) &&
+             SSL_write(ssl, keyid, QKD_KEYID_LEN) == QKD_KEYID_LEN &&
+             (g_rekey_chunks ?
+              aead_encrypt_stream(&tx, APP_AAD, (int)sizeof(APP_AAD)-1,
+                                  stream_read_file, fp, stream_write_ssl, ssl, &rk) :
+              aead_encrypt_stream_mt(&tx, APP_AAD, (int)sizeof(APP_AAD)-1,
+                                     stream_read_file, fp, stream_write_ssl, ssl, g_seal_threads));
+    if(!ok) fprintf(stderr, "aead_encrypt_stream failed\n");
+    else if(g_verbose) printf("[S] streamed %s\n", path);
+
+    aead_ctx_free(&tx);
+    OPENSSL_cleanse(&rk, sizeof(rk));
+    fclose(fp);
+    return ok;
+}
+
+// ---- ゼロコピー送信（-f と -z）: 事前封印ファイル + kTLS / SSL_sendfile --------
+// 起動時にファイルを一度だけコンテンツ鍵で封印して一時ファイルに置き、mmap する。
+// 接続ごとにはセッション鍵で封じた封筒レコード（APP_REC_ENVELOPE: コンテンツ鍵||iv）
+// だけを暗号化し、本体は封印済みのバイト列をそのまま送る。kTLS が有効なら
+// SSL_sendfile でカーネルがページキャッシュから直接 TLS 化、無効なら mmap から
+// SSL_write（自前のコピーと AES-GCM は接続ごとに発生しない）。
+// コンテンツ鍵は全接続で共通（同じ平文を同じ暗号文で配る用途向け）。
+static int g_zerocopy = 0;              // -z
+static struct {
+    int fd;
+    unsigned char *map;
+    size_t len;
+    unsigned char key[APP_KEY_LEN];
+    unsigned char iv[APP_IV_LEN];
+    int suite;                         // ビルド既定（どのピアも持っている）
+} g_sealed = { .fd = -1, .suite = APP_SUITE };
+
+static int stream_write_fd(void *io, const unsigned char *buf, int len)
+{
+    int fd = *(int *)io;
+    while(len > 0){
+        ssize_t n = write(fd, buf, (size_t)len);
+        if(n < 0){ if(errno == EINTR) continue; return 0; }
+        buf += n; len -= (int)n;
+    }
+    return 1;
+}
+
+static int preseal_file(const char *path)
+{
+    char tmpl[] = "/tmp/stage69-sealed-XXXXXX";
+    FILE *fp = fopen(path, "rb");
+    if(!fp){ perror(path); return 0; }
+
+    int ok = 0;
+    aead_ctx ck = {0};
+    g_sealed.fd = mkstemp(tmpl);
+    if(g_sealed.fd < 0){ perror("mkstemp"); goto done; }
+    unlink(tmpl);                      // 名前は残さない
+
+    if(RAND_bytes(g_sealed.key, sizeof(g_sealed.key)) != 1 ||
+       RAND_bytes(g_sealed.iv, sizeof(g_sealed.iv)) != 1 ||
+       !aead_ctx_init_suite(&ck, g_sealed.suite, g_sealed.key)){ openssl_fatal("preseal key"); goto done; }
+    aead_ctx_set_iv(&ck, g_sealed.iv);
+    if(g_reclog_on) ck.log_id = app_reclog_stream(&g_reclog);   // 本体は起動時の 1 回だけ記録
+    if(!aead_encrypt_stream(&ck, APP_AAD, (int)sizeof(APP_AAD)-1,
+                            stream_read_file, fp, stream_write_fd, &g_sealed.fd, NULL)){
+        fprintf(stderr, "preseal %s failed\n", path);
+        goto done;
+    }
+    off_t end = lseek(g_sealed.fd, 0, SEEK_END);
+    if(end <= 0){ perror("lseek"); goto done; }
+    g_sealed.len = (size_t)end;
+    g_sealed.map = mmap(NULL, g_sealed.len, PROT_READ, MAP_SHARED, g_sealed.fd, 0);
+    if(g_sealed.map == MAP_FAILED){ g_sealed.map = NULL; perror("mmap"); goto done; }
+    ok = 1;
+done:
+    aead_ctx_free(&ck);
+    fclose(fp);
+    return ok;
+}
+
+static int send_sealed(SSL *ssl)
+{
+    unsigned char buf[QKD_KEYID_LEN + APP_REC_OVERHEAD + APP_ENVELOPE_LEN];
+    unsigned char *rec = buf + QKD_KEYID_LEN;
+    aead_ctx tx = {0};
+    aead_stream st;
+    int reclen = 0, ok = 0;
+
+    // 封筒: key id || [FINAL|ENVELOPE] コンテンツ鍵||iv||スイート（セッション鍵で封印）
+    memcpy(APP_REC_PAYLOAD(rec), g_sealed.key, APP_KEY_LEN);
+    memcpy(APP_REC_PAYLOAD(rec) + APP_KEY_LEN, g_sealed.iv, APP_IV_LEN);
+    APP_REC_PAYLOAD(rec)[APP_KEY_LEN + APP_IV_LEN] = (unsigned char)g_sealed.suite;
+    if(!init_tx_ctx(ssl, &tx, NULL, buf, NULL, 0) ||
+       !aead_stream_init(&st, &tx, APP_AAD, (int)sizeof(APP_AAD)-1) ||
+       !aead_stream_seal_chunk_flags(&st, APP_REC_PAYLOAD(rec), APP_ENVELOPE_LEN,
+                                     APP_REC_FINAL | APP_REC_ENVELOPE, rec, &reclen)){
+        fprintf(stderr, "envelope seal failed\n");
+        goto done;
+    }
+    if(SSL_write(ssl, buf, QKD_KEYID_LEN + reclen) <= 0) goto done;
+
+    // 本体: kTLS なら SSL_sendfile、そうでなければ mmap から SSL_write
+    int ktls = BIO_get_ktls_send(SSL_get_wbio(ssl));
+    size_t off = 0;
+    while(off < g_sealed.len){
+        size_t n = 0;
+        if(ktls){
+            ossl_ssize_t r = SSL_sendfile(ssl, g_sealed.fd, (off_t)off, g_sealed.len - off, 0);
+            if(r <= 0) goto done;
+            n = (size_t)r;
+        }else if(SSL_write_ex(ssl, g_sealed.map + off, g_sealed.len - off, &n) != 1){
+            goto done;
+        }
+        off += n;
+    }
+    if(g_verbose) printf("[S] sent pre-sealed %zu bytes via %s\n", g_sealed.len, ktls ? "kTLS SSL_sendfile" : "mmap SSL_write");
+    ok = 1;
+done:
+    OPENSSL_cleanse(buf, sizeof(buf));
+    aead_ctx_free(&tx);
+    return ok;
+}
+
+// ---- メトリクス（-m 指定時のみ集計） -------------------------------------
+// カウンタはスレッドごとのシャードに書き、スクレイプ時に合算（hybrid_metrics.h）。
+static atomic_int g_active_conns;
+
+static void conn_metrics_open(void)
+{
+    if(g_app_metrics.enabled) atomic_fetch_add_explicit(&g_active_conns, 1, memory_order_relaxed);
+}
+
+// 接続終了時: ソケットの送受信バイト（ハンドシェイク込み）を加算
+static void conn_metrics_close(SSL *ssl)
+{
+    if(!g_app_metrics.enabled) return;
+    atomic_fetch_sub_explicit(&g_active_conns, 1, memory_order_relaxed);
+    app_metric_add(APP_M_TLS_BYTES_IN,  BIO_number_read(SSL_get_rbio(ssl)));
+    app_metric_add(APP_M_TLS_BYTES_OUT, BIO_number_written(SSL_get_wbio(ssl)));
+}
+
+static void conn_metrics_handshake(int ok, uint64_t t0)
+{
+    app_metric_add(ok ? APP_M_CONNECTIONS : APP_M_HANDSHAKE_FAILURES, 1);
+    if(ok) app_metric_since(APP_H_HANDSHAKE, t0);
+}
+
+// ---- 1接続分の処理（ハンドシェイク → 暗号メッセージ送信 → リクエスト応答）: ブロッキング版
+// ワーカーは 1 接続にかかりきりなので、黙った相手（FIN なしで消えた相手も）に
+// 握られないよう送受信に無通信タイムアウトを掛ける。切れたら接続を閉じる。
+static int g_idle_secs = 30;               // -O idle_secs=N、0 = 無制限
+
+static void set_idle_timeout(int fd)
+{
+    if(g_idle_secs <= 0) return;
+    struct timeval tv = { g_idle_secs, 0 };
+    if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+       setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) perror("idle timeout");
+}
+
+static void serve_conn(SSL_CTX *ctx, int cs)
+{
+    set_idle_timeout(cs);
+    SSL *ssl = SSL_new(ctx);
+    if(!ssl){ openssl_fatal("SSL_new"); close(cs); return; }
+    SSL_set_fd(ssl, cs);
+    conn_metrics_open();
+
+    uint64_t t0 = app_metrics_now_ns();
+    int hs = SSL_accept(ssl) == 1;
+    conn_metrics_handshake(hs, t0);
+    if(!hs){
+        openssl_fatal("SSL_accept");
+        conn_metrics_close(ssl);
+        SSL_free(ssl); close(cs); return;
+    }
+    if(g_verbose) printf("[S] TLS handshake ok%s\n", SSL_session_reused(ssl) ? " (resumed)" : "");
+
+    if(g_zerocopy){
+        if(!send_sealed(ssl)) openssl_fatal("send_sealed");
+        goto done;
+    }
+    if(g_stream_file){
+        send_file_stream(ssl, g_stream_file);
+        goto done;
+    }
+
+    unsigned char *buf = app_buf_get();
+    conn_session sess;
+    int outlen = 0;
+    memset(&sess, 0, sizeof(sess));
+    if(buf && build_hello(ssl, buf, &sess, &outlen)){
+        int n = SSL_write(ssl, buf, outlen);
+        if(g_verbose)
+            printf("[S] sent %d bytes (key id %d + hdr %d + ct %d)\n", n, QKD_KEYID_LEN, APP_REC_HDR_LEN,
+                   outlen - QKD_KEYID_LEN - APP_REC_HDR_LEN);
+        if(n > 0) serve_requests(ssl, &sess, buf);
+    }
+    conn_session_free(&sess);
+    app_buf_put(buf, APP_BUF_SIZE);
+
+done:
+    SSL_shutdown(ssl);
+    conn_metrics_close(ssl);
+    SSL_free(ssl);
+    close(cs);
+}
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+
+// ---- -c: スレッドの CPU 固定と NUMA 配置 ------------------------------------
+// index 番目のワーカー/ループを g_cpus[index % g_ncpus] に固定し、QKD プールは
+// 自ノードのシャードを既定にする（同じノードのスレッドでシャードを分け合う）。
+// バッファプールのスラブや接続状態は固定した後にそのスレッドが確保するので、
+// ファーストタッチで自ノードに載る。戻り値は固定した CPU（-c なし・失敗は -1）。
+static int g_cpus[APP_NUMA_MAX_CPUS];
+static int g_ncpus = 0;
+
+static int place_thread(int index)
+{
+    int cpu = -1, node, ordinal = index;
+    if(g_ncpus){
+        cpu = g_cpus[index % g_ncpus];
+        if(!app_pin_thread(cpu)){ fprintf(stderr, "[S] cannot pin to CPU %d\n", cpu); cpu = -1; }
+    }
+    node = app_numa_self_node();
+    if(cpu >= 0){
+        ordinal = 0;
+        for(int j = 0; j < index; j++) if(app_cpu_node(g_cpus[j % g_ncpus]) == node) ordinal++;
+    }
+    if(g_pool_on) qkd_pool_set_home(qkd_pool_home_for_node(&g_pool, node, ordinal));
+    return cpu;
+}
+
+// ---- 待ち受けソケット作成（reuseport=1 で SO_REUSEPORT + 非ブロッキング） --
+// cpu >= 0 なら SO_INCOMING_CPU で、その CPU が受けた接続をこのソケットに寄せる
+// （SO_REUSEPORT のグループ内で振り分けるときに優先される）。
+static int open_listener(int backlog, int reuseport, int cpu)
+{
     int ls = socket(AF_INET, SOCK_STREAM, 0);
-    if(ls < 0){ perror("socket"); return 1; }
+    if(ls < 0){ perror("socket"); return -1; }
 
     int on = 1;
     setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    // 接続は hello の後も開いたままで小さい応答を返すので Nagle を切る（accept した側に継承）
+    setsockopt(ls, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if(reuseport){
+        if(setsockopt(ls, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0){
+            perror("SO_REUSEPORT"); close(ls); return -1;
+        }
+        fcntl(ls, F_SETFL, fcntl(ls, F_GETFL, 0) | O_NONBLOCK);
+    }
+    if(cpu >= 0 && setsockopt(ls, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0) perror("SO_INCOMING_CPU");
 
     struct sockaddr_in addr = {0};
     addr.sin_family = AF_INET;
-    addr.sin_port   = htons(PORT);
-    inet_pton(AF_INET, HOST, &addr.sin_addr);
+    addr.sin_port   = htons((uint16_t)g_port);
+    if(inet_pton(AF_INET, g_host, &addr.sin_addr) != 1){ fprintf(stderr, "bad listen address %s\n", g_host); close(ls); return -1; }
 
-    if(bind(ls, (struct sockaddr*)&addr, sizeof(addr)) < 0){ perror("bind"); return 1; }
-    if(listen(ls, 1) < 0){ perror("listen"); return 1; }
+    if(bind(ls, (struct sockaddr*)&addr, sizeof(addr)) < 0){ perror("bind"); close(ls); return -1; }
+    if(listen(ls, backlog) < 0){ perror("listen"); close(ls); return -1; }
+    return ls;
+}
 
-    printf("[S] TLS server on https://%s:%d\n", HOST, PORT);
+// ---- ワーカースレッドプール（accept スレッド → fd キュー → ワーカー） ----
+// SSL_CTX は全ワーカーで共有、SSL は接続ごと。キューが満杯なら accept 側が待つ。
+#define CONN_QUEUE_LEN 1024
 
-    for(;;) {
-        struct sockaddr_in cli; socklen_t clilen = sizeof(cli);
-        int cs = accept(ls, (struct sockaddr*)&cli, &clilen);
-        if(cs < 0){ perror("accept"); continue; }
+typedef struct {
+    int fds[CONN_QUEUE_LEN];
+    int head, tail, count;
+    pthread_mutex_t mu;
+    pthread_cond_t not_empty, not_full;
+} conn_queue;
 
-        SSL *ssl = SSL_new(ctx);
-        SSL_set_fd(ssl, cs);
+static void conn_queue_push(conn_queue *q, int fd)
+{
+    pthread_mutex_lock(&q->mu);
+    while(q->count == CONN_QUEUE_LEN) pthread_cond_wait(&q->not_full, &q->mu);
+    q->fds[q->tail] = fd;
+    q->tail = (q->tail + 1) % CONN_QUEUE_LEN;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->mu);
+}
 
-        if(SSL_accept(ssl) != 1){
-            openssl_fatal("SSL_accept");
-            SSL_free(ssl); close(cs); continue;
+static int conn_queue_pop(conn_queue *q)
+{
+    pthread_mutex_lock(&q->mu);
+    while(q->count == 0) pthread_cond_wait(&q->not_empty, &q->mu);
+    int fd = q->fds[q->head];
+    q->head = (q->head + 1) % CONN_QUEUE_LEN;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->mu);
+    return fd;
+}
+
+typedef struct {
+    conn_queue *q;
+    int         index;
+} worker_arg;
+
+// スクレイプ時のゲージ（arg = ワーカーモードの接続キュー、epoll では NULL）
+static void server_gauges(FILE *out, void *arg)
+{
+    conn_queue *q = (conn_queue *)arg;
+    fprintf(out, "# HELP stage69_connections_active Connections being served\n"
+                 "# TYPE stage69_connections_active gauge\nstage69_connections_active %d\n",
+            atomic_load(&g_active_conns));
+    if(q){
+        pthread_mutex_lock(&q->mu);
+        int depth = q->count;
+        pthread_mutex_unlock(&q->mu);
+        fprintf(out, "# HELP stage69_worker_queue_depth Accepted sockets waiting for a worker\n"
+                     "# TYPE stage69_worker_queue_depth gauge\nstage69_worker_queue_depth %d\n", depth);
+    }
+    fprintf(out, "# HELP stage69_tls_context_generation TLS contexts loaded (1 + certificate reloads)\n"
+                 "# TYPE stage69_tls_context_generation gauge\nstage69_tls_context_generation %u\n",
+            atomic_load(&g_ctx.gen));
+    if(g_pool_on){
+        fprintf(out, "# HELP stage69_qkd_pool_keys_ready Keys in the shared QKD pool\n"
+                     "# TYPE stage69_qkd_pool_keys_ready gauge\nstage69_qkd_pool_keys_ready %llu\n"
+                     "# HELP stage69_qkd_pool_stalls_total Claims that found the pool empty (all processes)\n"
+                     "# TYPE stage69_qkd_pool_stalls_total counter\nstage69_qkd_pool_stalls_total %llu\n",
+                (unsigned long long)qkd_pool_available(&g_pool),
+                (unsigned long long)qkd_pool_stalls(&g_pool));
+    }
+    if(g_reclog_on){
+        fprintf(out, "# HELP stage69_record_log_committed_bytes Record log bytes made durable\n"
+                     "# TYPE stage69_record_log_committed_bytes gauge\nstage69_record_log_committed_bytes %llu\n"
+                     "# HELP stage69_record_log_full_total Records refused because the record log was full\n"
+                     "# TYPE stage69_record_log_full_total counter\nstage69_record_log_full_total %llu\n",
+                (unsigned long long)atomic_load(&g_reclog.hdr->committed),
+                (unsigned long long)atomic_load(&g_reclog.full));
+    }
+}
+
+static void *worker_main(void *p)
+{
+    worker_arg *w = (worker_arg *)p;
+    place_thread(w->index);
+    for(;;){
+        int cs = conn_queue_pop(w->q);
+        serve_conn(ctx_current(), cs);
+    }
+    return NULL;
+}
+
+// ---- イベント駆動モード（非ブロッキング + epoll、1ループ/コア） ---------
+// 各ループが SO_REUSEPORT で自前の待ち受けソケットを持ち、カーネルが接続を
+// 振り分ける。SSL_accept/SSL_write/SSL_shutdown は WANT_READ/WANT_WRITE で
+// 中断し、epoll の通知で再開する。スレッドを持たない接続はハンドシェイク中
+// 数十バイト、その後はセッション鍵とバッファ 1 本。
+// ハンドシェイクを終えた接続は EV_SEAL で周回の終わりまで待ち、hello を
+// まとめて aead_mb_seal で封印してから EV_HELLO で送る。その後は
+// EV_READ（リクエストを読む）→ EV_RPC → EV_WRITE（応答を送る）を
+// 最終リクエストか相手の close_notify まで繰り返す。EV_RPC の接続は周回の
+// 終わりまで待ち、全接続のリクエストをまとめて aead_mb_open で開き、応答を
+// まとめて aead_mb_seal で封印する（小さいレコードほど 1 回に多く載る）。
+// -O async=yes（SSL_MODE_ASYNC）では provider の処理待ちで SSL_* が
+// WANT_ASYNC を返す。ジョブの待ち fd を同じ epoll に載せ、完了通知で同じ
+// 呼び出しを再開するので、アクセラレータが処理している間も他の接続を進める。
+// ジョブに空きがない（WANT_ASYNC_JOB）接続は再試行リストに載せ、epoll_wait を
+// 1ms で起こして周回の終わりに再試行する。
+// 1 周回の通知には同じ接続のソケットとジョブ fd が並ぶことがあり、封印待ちの
+// 接続はまとめ処理の中で閉じられる。閉じた接続は EV_CLOSED にして周回の
+// 終わりまで解放しない（以降の通知は読み捨てる）。
+enum { EV_HANDSHAKE, EV_SEAL, EV_HELLO, EV_READ, EV_RPC, EV_WRITE, EV_SHUTDOWN, EV_CLOSED };
+
+typedef struct ev_conn {
+    int  fd;
+    SSL *ssl;
+    int  state;
+    int  outlen;            // buf 先頭の送信待ちバイト数
+    int  fill;              // buf に入っているバイト数（送信待ち + 読みかけのリクエスト）
+    unsigned char *buf;     // バッファプールから（ハンドシェイク完了時に確保）
+    conn_session  *sess;    // 同上
+    uint64_t t0;            // accept 時刻（-m のとき）
+    int  async;             // 非同期ジョブの待ち fd を epoll に登録したことがある
+    int  nrec;              // EV_RPC: ev_seal_queue に積んだリクエスト数
+    int  retrying;          // 再試行リストに載っている
+    struct ev_conn *retry_next;
+    struct ev_conn *dead_next;
+} ev_conn;
+
+typedef struct {
+    int      ls;        // main が起動前に開いた SO_REUSEPORT ソケット（ループが閉じる）
+    int      index;
+} ev_loop_arg;
+
+#define EV_SEAL_BATCH 64   // 1 回の aead_mb_seal に渡す hello の上限
+#define EV_RPC_JOBS   256  // 1 回の aead_mb_open / aead_mb_seal に渡すリクエストの上限
+
+// ループごとに 1 つ、周回の終わりにまとめて処理するもの
+typedef struct {
+    ev_conn    *c[EV_SEAL_BATCH];       // hello 待ち
+    int         n;
+    aead_mb_job rj[EV_RPC_JOBS];        // リクエスト開封 → 同じジョブで応答封印
+    ev_conn    *rc[EV_RPC_JOBS];        // 各ジョブの接続（接続ごとに連続）
+    int         rn;
+    ev_conn    *retry;                  // WANT_ASYNC_JOB で再試行を待つ接続
+    ev_conn    *dead;                   // 閉じた接続（周回の終わりに解放）
+} ev_seal_queue;
+
+#define EV_ASYNC_FDS 8     // 1 接続が同時に待つ非同期ジョブ fd の上限
+
+// 資源を返して EV_CLOSED にする。構造体の解放は ev_conn_reap で。
+static void ev_conn_close(int ep, ev_seal_queue *sq, ev_conn *c)
+{
+    if(c->state == EV_CLOSED) return;
+    epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+    if(c->async){
+        OSSL_ASYNC_FD fds[EV_ASYNC_FDS];
+        size_t n = 0;
+        if(SSL_get_all_async_fds(c->ssl, NULL, &n) && n <= EV_ASYNC_FDS && SSL_get_all_async_fds(c->ssl, fds, &n)){
+            for(size_t i = 0; i < n; i++) epoll_ctl(ep, EPOLL_CTL_DEL, fds[i], NULL);
         }
-        printf("[S] TLS handshake ok\n");
+    }
+    app_buf_put(c->buf, APP_BUF_SIZE);
+    if(c->sess){ conn_session_free(c->sess); free(c->sess); }
+    conn_metrics_close(c->ssl);
+    SSL_free(c->ssl);
+    close(c->fd);
+    c->state     = EV_CLOSED;
+    c->dead_next = sq->dead;
+    sq->dead     = c;
+}
 
-        // --- デモ用: QKD(将来の共有鍵) をランダム64Bで代用 ---
-        unsigned char qkd[64];
-        RAND_bytes(qkd, sizeof(qkd));
+// 周回の終わり: 閉じた接続を再試行リストから外してから解放する
+static void ev_conn_reap(ev_seal_queue *sq)
+{
+    for(ev_conn **pp = &sq->retry; *pp; ){
+        if((*pp)->state == EV_CLOSED) *pp = (*pp)->retry_next;
+        else pp = &(*pp)->retry_next;
+    }
+    while(sq->dead){
+        ev_conn *c = sq->dead;
+        sq->dead = c->dead_next;
+        free(c);
+    }
+}
+
+static void ev_seal_flush(int ep, ev_seal_queue *sq);
+static void ev_rpc_flush(int ep, ev_seal_queue *sq);
+
+// WANT_ASYNC: 増えた待ち fd を epoll に足し、終わったジョブの fd を外す。
+// fd はジョブごと（QAT provider はジョブごとに eventfd）なので data.ptr は
+// ソケットと同じこの接続（閉じても周回中は解放しないので両方の通知が来てよい）。
+// 1 なら通知待ち、0 なら登録できない（接続を閉じる）。
+static int ev_conn_async_watch(int ep, ev_conn *c)
+{
+    OSSL_ASYNC_FD add[EV_ASYNC_FDS], del[EV_ASYNC_FDS];
+    size_t nadd = 0, ndel = 0;
+    if(!SSL_get_changed_async_fds(c->ssl, NULL, &nadd, NULL, &ndel) ||
+       nadd > EV_ASYNC_FDS || ndel > EV_ASYNC_FDS ||
+       !SSL_get_changed_async_fds(c->ssl, add, &nadd, del, &ndel)) return 0;
+    for(size_t i = 0; i < ndel; i++) epoll_ctl(ep, EPOLL_CTL_DEL, del[i], NULL);
+    for(size_t i = 0; i < nadd; i++){
+        struct epoll_event ev = {0};
+        ev.events   = EPOLLIN;
+        ev.data.ptr = c;
+        if(epoll_ctl(ep, EPOLL_CTL_ADD, add[i], &ev) != 0 && errno != EEXIST){ perror("epoll_ctl async fd"); return 0; }
+        c->async = 1;
+    }
+    return 1;
+}
 
-        unsigned char k_tx[APP_KEY_LEN], k_rx[APP_KEY_LEN];
-        if(!derive_app_keys(qkd, sizeof(qkd), k_tx, k_rx)){
-            fprintf(stderr, "derive_app_keys failed\n");
-            SSL_shutdown(ssl); SSL_free(ssl); close(cs); continue;
+// 状態を進められるところまで進める。WANT_* なら待つ方向を epoll に登録。
+static void ev_conn_step(int ep, ev_conn *c, ev_seal_queue *sq)
+{
+    if(c->state == EV_CLOSED) return;   // 同じ周回で閉じた接続への残りの通知
+    for(;;){
+        int r, err;
+        switch(c->state){
+        case EV_HANDSHAKE:
+            r = SSL_accept(c->ssl);
+            if(r == 1){
+                conn_metrics_handshake(1, c->t0);
+                if(g_verbose) printf("[S] TLS handshake ok%s\n", SSL_session_reused(c->ssl) ? " (resumed)" : "");
+                c->buf  = app_buf_get();
+                c->sess = calloc(1, sizeof(*c->sess));
+                if(!c->buf || !c->sess){ ev_conn_close(ep, sq, c); return; }
+                c->state = EV_SEAL;
+                sq->c[sq->n++] = c;
+                if(sq->n == EV_SEAL_BATCH) ev_seal_flush(ep, sq);
+                return;
+            }
+            break;
+        case EV_SEAL:   // ev_seal_flush / ev_rpc_flush を待っている間は進めない
+        case EV_RPC:
+            return;
+        case EV_HELLO:
+        case EV_WRITE:
+            r = SSL_write(c->ssl, c->buf, c->outlen);
+            if(r > 0){
+                if(c->state == EV_HELLO && g_verbose)
+                    printf("[S] sent %d bytes (key id %d + hdr %d + ct %d)\n", r, QKD_KEYID_LEN, APP_REC_HDR_LEN,
+                           c->outlen - QKD_KEYID_LEN - APP_REC_HDR_LEN);
+                memmove(c->buf, c->buf + c->outlen, (size_t)(c->fill - c->outlen));
+                c->fill  -= c->outlen;
+                c->state  = c->sess->in.done ? EV_SHUTDOWN : EV_READ;
+                continue;
+            }
+            break;
+        case EV_READ:
+            if(sq->rn + RPC_BATCH > EV_RPC_JOBS) ev_rpc_flush(ep, sq);
+            r = rpc_prepare(c->sess, c->buf, c->fill, sq->rj + sq->rn, RPC_BATCH, &c->outlen);
+            if(r < 0){ fprintf(stderr, "[S] request authentication failed\n"); ev_conn_close(ep, sq, c); return; }
+            if(r > 0){
+                for(int k = 0; k < r; k++) sq->rc[sq->rn + k] = c;
+                sq->rn  += r;
+                c->nrec  = r;
+                c->state = EV_RPC;
+                return;
+            }
+            r = SSL_read(c->ssl, c->buf + c->fill, APP_BUF_SIZE - c->fill);
+            if(r > 0){ c->fill += r; continue; }
+            if(SSL_get_error(c->ssl, r) == SSL_ERROR_ZERO_RETURN){ c->state = EV_SHUTDOWN; continue; }
+            break;
+        default: // EV_SHUTDOWN: close_notify を送れたら相手を待たずに閉じる
+            r = SSL_shutdown(c->ssl);
+            if(r >= 0){ ev_conn_close(ep, sq, c); return; }
+            break;
         }
 
-        // 送るメッセージを AES-GCM で暗号化し、TLSの上に「nonce||ct」を送る
-        const unsigned char aad[] = "Stage69-AAD";
-        const unsigned char msg[] =
-            "Hello from Stage69 server with TLS+QKD hybrid";
-        unsigned char iv[APP_IV_LEN];
-        RAND_bytes(iv, sizeof(iv));
+        err = SSL_get_error(c->ssl, r);
+        if(err == SSL_ERROR_WANT_ASYNC && ev_conn_async_watch(ep, c)) return;
+        // WANT_ASYNC_JOB: ジョブの空きがない。fd の通知はないので周回の終わりに再試行
+        if(err == SSL_ERROR_WANT_ASYNC_JOB){
+            if(!c->retrying){
+                c->retrying   = 1;
+                c->retry_next = sq->retry;
+                sq->retry     = c;
+            }
+            return;
+        }
+        if(err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE){
+            struct epoll_event ev = {0};
+            ev.events   = (err == SSL_ERROR_WANT_READ) ? EPOLLIN : EPOLLOUT;
+            ev.data.ptr = c;
+            epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+            return;
+        }
+        if(c->state == EV_HANDSHAKE){ conn_metrics_handshake(0, 0); openssl_fatal("SSL_accept"); }
+        ev_conn_close(ep, sq, c);
+        return;
+    }
+}
 
-        unsigned char ct[sizeof(msg) + TAG_LEN + 16]; // 余裕を持たせる
-        int ctlen = 0;
-        if(!aead_encrypt(k_tx, aad, (int)sizeof(aad)-1,
-                         iv, sizeof(iv), msg, (int)sizeof(msg)-1,
-                         ct, &ctlen))
-        {
-            fprintf(stderr, "aead_encrypt failed\n");
-            SSL_shutdown(ssl); SSL_free(ssl); close(cs); continue;
+// 溜まった hello をまとめて封印し、各接続を EV_HELLO に進める。
+static void ev_seal_flush(int ep, ev_seal_queue *sq)
+{
+    aead_mb_job j[EV_SEAL_BATCH];
+    ev_conn    *c[EV_SEAL_BATCH];
+    int n = sq->n, m = 0;
+    sq->n = 0;
+
+    for(int i = 0; i < n; i++){
+        if(hello_prepare(sq->c[i]->ssl, sq->c[i]->buf, sq->c[i]->sess, &j[m])) c[m++] = sq->c[i];
+        else ev_conn_close(ep, sq, sq->c[i]);
+    }
+    aead_mb_seal(j, m);
+    for(int i = 0; i < m; i++){
+        if(!hello_finish(c[i]->sess, &j[i], &c[i]->outlen)){ ev_conn_close(ep, sq, c[i]); continue; }
+        c[i]->fill  = c[i]->outlen;
+        c[i]->state = EV_HELLO;
+        ev_conn_step(ep, c[i], sq);
+    }
+}
+
+// 溜まったリクエストをまとめて開き、応答をまとめて封印して各接続を EV_WRITE に
+// 進める。ジョブは接続のバッファを指すので、閉じるのは封印が終わってから。
+static void ev_rpc_flush(int ep, ev_seal_queue *sq)
+{
+    ev_conn *ready[EV_RPC_JOBS], *bad[EV_RPC_JOBS];
+    int n = sq->rn, nready = 0, nbad = 0;
+
+    aead_mb_open(sq->rj, n);
+    for(int i = 0; i < n; i += sq->rc[i]->nrec){
+        ev_conn *c = sq->rc[i];
+        if(rpc_reply(c->sess, &sq->rj[i], c->nrec)) continue;
+        for(int k = 0; k < c->nrec; k++) sq->rj[i + k].inlen = -1;   // 封印しない
+    }
+    aead_mb_seal(sq->rj, n);
+    for(int i = 0; i < n; i += sq->rc[i]->nrec){
+        ev_conn *c = sq->rc[i];
+        if(rpc_sealed(&sq->rj[i], c->nrec)) ready[nready++] = c;
+        else                                 bad[nbad++]     = c;
+    }
+    sq->rn = 0;
+
+    for(int i = 0; i < nbad; i++){
+        fprintf(stderr, "[S] request authentication failed\n");
+        ev_conn_close(ep, sq, bad[i]);
+    }
+    for(int i = 0; i < nready; i++){
+        ready[i]->state = EV_WRITE;
+        ev_conn_step(ep, ready[i], sq);
+    }
+}
+
+static void *ev_loop_main(void *p)
+{
+    ev_loop_arg *a = (ev_loop_arg *)p;
+    int ls = a->ls;
+    place_thread(a->index);
+
+    int ep = epoll_create1(0);
+    if(ep < 0){ perror("epoll_create1"); close(ls); return NULL; }
+
+    struct epoll_event lev = {0};
+    lev.events   = EPOLLIN;
+    lev.data.ptr = NULL;   // NULL = 待ち受けソケット
+    epoll_ctl(ep, EPOLL_CTL_ADD, ls, &lev);
+
+    struct epoll_event evs[256];
+    ev_seal_queue *sq = calloc(1, sizeof(*sq));
+    if(!sq){ perror("calloc"); close(ep); close(ls); return NULL; }
+    for(;;){
+        int n = epoll_wait(ep, evs, 256, sq->retry ? 1 : -1);
+        if(n < 0){ if(errno == EINTR) continue; perror("epoll_wait"); break; }
+
+        for(int i = 0; i < n; i++){
+            ev_conn *c = (ev_conn *)evs[i].data.ptr;
+            if(c){ ev_conn_step(ep, c, sq); continue; }
+
+            // 溜まっている接続をまとめて accept
+            for(;;){
+                int cs = accept4(ls, NULL, NULL, SOCK_NONBLOCK);
+                if(cs < 0){
+                    if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("accept4");
+                    break;
+                }
+                c = calloc(1, sizeof(*c));
+                if(c) c->ssl = SSL_new(ctx_current());
+                if(!c || !c->ssl){ free(c); close(cs); continue; }
+                c->fd    = cs;
+                c->state = EV_HANDSHAKE;
+                c->t0    = app_metrics_now_ns();
+                conn_metrics_open();
+                SSL_set_fd(c->ssl, cs);
+                SSL_set_accept_state(c->ssl);
+
+                struct epoll_event ev = {0};
+                ev.events   = EPOLLIN;
+                ev.data.ptr = c;
+                epoll_ctl(ep, EPOLL_CTL_ADD, cs, &ev);
+                ev_conn_step(ep, c, sq);
+            }
+        }
+        // ジョブの空きを待っていた接続（ここで載った分は次の周回）
+        ev_conn *r = sq->retry;
+        sq->retry = NULL;
+        while(r){
+            ev_conn *c = r;
+            r = c->retry_next;
+            c->retrying = 0;
+            ev_conn_step(ep, c, sq);
+        }
+        // 封印した応答を送った接続がまた完全なリクエストを持っていることがあるので、
+        // 何も溜まらなくなるまで（次の epoll 通知は来ないかもしれない）
+        while(sq->n || sq->rn){
+            if(sq->n)  ev_seal_flush(ep, sq);
+            if(sq->rn) ev_rpc_flush(ep, sq);
         }
+        ev_conn_reap(sq);
+    }
+    ev_conn_reap(sq);
+    free(sq);
+    close(ep);
+    close(ls);
+    return NULL;
+}
 
-        unsigned char buf[APP_IV_LEN + 1024];
-        memcpy(buf, iv, APP_IV_LEN);
-        memcpy(buf + APP_IV_LEN, ct, ctlen);
-        int outlen = APP_IV_LEN + ctlen;
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-C file] [-O name=value] [-H host] [-P port] [-w workers] [-b backlog] [-e] [-f file] [-t secs] [-q pool] [-k chunks] [-p threads] [-z] [-a suites] [-m port] [-c cpus]\n"
+                    "  -C  read settings from a file first (name = value per line, names below)\n"
+                    "  -O  set one setting by name, e.g. -O cert=/etc/stage69/server.crt\n"
+                    "  -H  listen address (host, default " HOST ")   -P  port (port, default %d)\n"
+                    "      cert / key: certificate (chain) and private key PEM files (default " CERT_FILE " / " KEY_FILE ");\n"
+                    "      SIGHUP reloads both for new connections, open ones stay on the old context\n"
+                    "  -w  workers or event loops (workers, default: online CPUs)   -b  listen backlog (backlog)\n"
+                    "  -e  epoll event loops (epoll), one per worker, SO_REUSEPORT\n"
+                    "  -f  stream file to each client (file), worker pool mode only\n"
+                    "  -t  session ticket key rotation interval (ticket_secs, default 3600, 0 = no resumption)\n"
+                    "  -q  take QKD keys from the shared-memory pool (pool, e.g. " QKD_POOL_NAME ", see qkd69_pool)\n"
+                    "  -k  with -f, switch to fresh QKD keys in-band every N chunks of 16 KB (rekey_chunks)\n"
+                    "  -p  with -f, seal streams on a shared pool of N threads, not with -k (seal_threads)\n"
+                    "  -z  with -f, seal the file once at startup and send it zero-copy, kTLS/SSL_sendfile (zerocopy)\n"
+                    "  -a  record suites in preference order, e.g. chacha20,aes256gcm (suites)\n"
+                    "      (default: by CPU, AES-GCM first with AES instructions; also aes128gcm, aes256gcmsiv)\n"
+                    "  -m  serve Prometheus metrics on http://host:port/metrics (metrics_port)\n"
+                    "  -c  pin worker i / event loop i to the i-th CPU of a list such as 0-7,16-23 (cpus);\n"
+                    "      with -e each loop's listener takes the connections its CPU receives\n"
+                    "      (SO_INCOMING_CPU); buffers and QKD pool shards follow the CPU's NUMA node\n"
+                    "      provider: OpenSSL providers to load besides default, e.g. qatprovider\n"
+                    "      propq: property query for TLS and record crypto, e.g. ?provider=qatprovider\n"
+                    "      async: with -e, run TLS crypto as async jobs (SSL_MODE_ASYNC) so a loop serves\n"
+                    "      other connections while the provider works (async = yes)\n"
+                    "      record_log: append every sealed record to this file (memory-mapped, see qkd69_log);\n"
+                    "      record_log_mb: its size for a new file (default 1024), a full log fails the send;\n"
+                    "      record_log_ms: group commit interval (default %d)\n"
+                    "      idle_secs: worker mode, drop a connection after N seconds without traffic\n"
+                    "      (default 30, 0 = never)\n"
+                    "      verbose: log every handshake, hello and stream (verbose = yes; off by default, the\n"
+                    "      metrics endpoint counts them)\n", prog, PORT, APP_RECLOG_COMMIT_MS);
+}
 
-        int n = SSL_write(ssl, buf, outlen);
-        printf("[S] sent %d bytes (iv %d + ct %d)\n", n, APP_IV_LEN, ctlen);
+// ---- 設定（-C ファイル → コマンドライン の順に適用、後が勝つ） ------------
+#define SERVER_OPTS "C:O:H:P:w:b:ef:t:q:k:p:za:m:c:h"
+enum { OPT_CERT = APP_CFG_OPT_LONG, OPT_KEY, OPT_PROVIDER, OPT_PROPQ, OPT_ASYNC,
+       OPT_RECLOG, OPT_RECLOG_MB, OPT_RECLOG_MS, OPT_IDLE, OPT_VERBOSE };
+
+typedef struct {
+    int workers, backlog, evmode, ticket_secs, metrics_port, async;
+    const char *pool_name, *suites, *cpus, *cert, *key, *providers, *propq;
+    const char *reclog;
+    long reclog_mb, reclog_ms;
+} server_cfg;
 
-        SSL_shutdown(ssl);
-        SSL_free(ssl);
-        close(cs);
-        // 1件送ったら終了（必要なら while を継続に）
+static const app_cfg_key k_server_cfg[] = {
+    { "host", 'H', 0 }, { "port", 'P', 0 }, { "cert", OPT_CERT, 0 }, { "key", OPT_KEY, 0 },
+    { "workers", 'w', 0 }, { "backlog", 'b', 0 }, { "epoll", 'e', 1 }, { "file", 'f', 0 },
+    { "ticket_secs", 't', 0 }, { "pool", 'q', 0 }, { "rekey_chunks", 'k', 0 },
+    { "seal_threads", 'p', 0 }, { "zerocopy", 'z', 1 }, { "suites", 'a', 0 },
+    { "metrics_port", 'm', 0 }, { "cpus", 'c', 0 },
+    { "provider", OPT_PROVIDER, 0 }, { "propq", OPT_PROPQ, 0 }, { "async", OPT_ASYNC, 1 },
+    { "record_log", OPT_RECLOG, 0 }, { "record_log_mb", OPT_RECLOG_MB, 0 }, { "record_log_ms", OPT_RECLOG_MS, 0 },
+    { "idle_secs", OPT_IDLE, 0 }, { "verbose", OPT_VERBOSE, 1 },
+    { NULL, 0, 0 }
+};
+
+static int server_set(int opt, const char *val, void *arg)
+{
+    server_cfg *c = (server_cfg *)arg;
+    switch(opt){
+    case 'O': return app_cfg_apply_pair(k_server_cfg, val, server_set, arg);
+    case 'H': g_host = val; break;
+    case 'P': g_port = atoi(val); break;
+    case OPT_CERT: c->cert = val; break;
+    case OPT_KEY:  c->key  = val; break;
+    case OPT_PROVIDER: c->providers = val; break;
+    case OPT_PROPQ:    c->propq     = val; break;
+    case OPT_ASYNC:    c->async     = 1; break;
+    case OPT_RECLOG:    c->reclog    = val; break;
+    case OPT_RECLOG_MB: c->reclog_mb = atol(val); break;
+    case OPT_RECLOG_MS: c->reclog_ms = atol(val); break;
+    case OPT_IDLE:      g_idle_secs  = atoi(val); break;
+    case OPT_VERBOSE:   g_verbose    = 1; break;
+    case 'w': c->workers = atoi(val); break;
+    case 'b': c->backlog = atoi(val); break;
+    case 'e': c->evmode  = 1; break;
+    case 'f': g_stream_file = val; break;
+    case 't': c->ticket_secs = atoi(val); break;
+    case 'q': c->pool_name = val; break;
+    case 'z': g_zerocopy = 1; break;
+    case 'p': g_seal_threads = atoi(val); break;
+    case 'k': g_rekey_chunks = strtoull(val, NULL, 10); break;
+    case 'a': c->suites = val; break;
+    case 'm': c->metrics_port = atoi(val); break;
+    case 'c':
+        if(!(g_ncpus = app_cpu_list_parse(val, g_cpus, APP_NUMA_MAX_CPUS))) return 0;
+        c->cpus = val;
         break;
+    default:  return 0;
     }
+    return 1;
+}
 
-    close(ls);
+// 再現用に実際に使う値を 1 行で出す
+static void log_config(const server_cfg *c)
+{
+    printf("[S] config: host=%s port=%d cert=%s key=%s workers=%d backlog=%d epoll=%s"
+           " ticket_secs=%d pool=%s suites=%s metrics_port=%d cpus=%s"
+           " file=%s rekey_chunks=%llu seal_threads=%d zerocopy=%s provider=%s propq=%s async=%s"
+           " record_log=%s record_log_mb=%ld record_log_ms=%ld idle_secs=%d verbose=%s record=%s/%d\n",
+           g_host, g_port, c->cert, c->key, c->workers, c->backlog, c->evmode ? "yes" : "no",
+           c->ticket_secs, c->pool_name ? c->pool_name : "-", c->suites ? c->suites : "auto",
+           c->metrics_port, c->cpus ? c->cpus : "-",
+           g_stream_file ? g_stream_file : "-", (unsigned long long)g_rekey_chunks, g_seal_threads,
+           g_zerocopy ? "yes" : "no", c->providers ? c->providers : "-", c->propq ? c->propq : "-",
+           c->async ? "yes" : "no", c->reclog ? c->reclog : "-", c->reclog_mb, c->reclog_ms,
+           g_idle_secs, g_verbose ? "yes" : "no", APP_AEAD_NAME, APP_STREAM_CHUNK);
+}
+
+// ---- TLS コンテキスト作成（起動時と SIGHUP のたび） -------------------------
+// 失敗なら NULL（エラーは表示済み）。証明書と鍵は毎回ファイルから読み直す。
+static SSL_CTX *build_ctx(const server_cfg *c)
+{
+    // propq: 署名・鍵交換・レコード暗号を provider から（鍵ファイルの読み込みも同じ問い合わせ）
+    SSL_CTX *ctx = SSL_CTX_new_ex(NULL, c->propq, TLS_server_method());
+    if(!ctx){ openssl_fatal("SSL_CTX_new"); return NULL; }
+
+    if(SSL_CTX_use_certificate_chain_file(ctx, c->cert) != 1){
+        openssl_fatal("use_certificate"); goto err;
+    }
+    if(SSL_CTX_use_PrivateKey_file(ctx, c->key, SSL_FILETYPE_PEM) != 1){
+        openssl_fatal("use_privatekey"); goto err;
+    }
+    if(SSL_CTX_check_private_key(ctx) != 1){
+        openssl_fatal("check_private_key"); goto err;
+    }
+    SSL_CTX_set_alpn_select_cb(ctx, app_suite_alpn_select, NULL);
+    if(c->ticket_secs > 0){
+        if(!setup_resumption(ctx)){ openssl_fatal("setup_resumption"); goto err; }
+    }else{
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+        SSL_CTX_set_num_tickets(ctx, 0);
+    }
+    // ゼロコピー: 外側 TLS をカーネルへ（kTLS）
+    if(g_zerocopy) SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    if(c->async) SSL_CTX_set_mode(ctx, SSL_MODE_ASYNC);
+    return ctx;
+err:
     SSL_CTX_free(ctx);
+    return NULL;
+}
+
+// SIGHUP 待ち専用スレッド（SIGHUP は全スレッドでブロック済み）。
+// 読み直しに失敗したら今のコンテキストのまま続ける。
+static void *reload_main(void *p)
+{
+    const server_cfg *c = (const server_cfg *)p;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    for(;;){
+        int sig;
+        if(sigwait(&set, &sig) != 0) continue;
+        SSL_CTX *ctx = build_ctx(c);
+        if(!ctx){ fprintf(stderr, "[S] reload of %s / %s failed, keeping the current context\n", c->cert, c->key); continue; }
+        unsigned gen = ctx_publish(ctx);
+        printf("[S] reloaded %s / %s (TLS context generation %u)\n", c->cert, c->key, gen);
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+// ---- メイン（TLSサーバー → accept ループ → ワーカーへ受け渡し） ---------
+int main(int argc, char **argv)
+{
+    long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+    server_cfg cfg = {
+        .workers = nproc > 0 ? (int)nproc : 1,
+        .backlog = SOMAXCONN,
+        .ticket_secs = 3600,
+        .cert = CERT_FILE,
+        .key  = KEY_FILE,
+        .reclog_mb = 1024,
+        .reclog_ms = APP_RECLOG_COMMIT_MS,
+    };
+
+    const char *cfg_file = app_cfg_prescan(argc, argv, SERVER_OPTS);
+    if(cfg_file && !app_cfg_load(cfg_file, k_server_cfg, server_set, &cfg)) return 1;
+    int opt;
+    while((opt = getopt(argc, argv, SERVER_OPTS)) != -1){
+        if(opt == 'C') continue;
+        if(!server_set(opt, optarg, &cfg)){ usage(argv[0]); return opt == 'h' ? 0 : 1; }
+    }
+    int workers = cfg.workers, backlog = cfg.backlog, evmode = cfg.evmode;
+    int ticket_secs = cfg.ticket_secs, metrics_port = cfg.metrics_port;
+    const char *pool_name = cfg.pool_name, *suites = cfg.suites;
+    if(workers < 1 || backlog < 1 || ticket_secs < 0 || (evmode && g_stream_file) ||
+       g_port < 1 || g_port > 65535 || metrics_port < 0 || metrics_port > 65535 ||
+       (g_zerocopy && (!g_stream_file || g_rekey_chunks)) ||
+       g_seal_threads < 1 || (g_seal_threads > 1 && g_rekey_chunks) || (cfg.async && !evmode) ||
+       cfg.reclog_mb < 1 || cfg.reclog_ms < 1 || cfg.reclog_ms > 10000 || g_idle_secs < 0){ usage(argv[0]); return 1; }
+    log_config(&cfg);
+
+    // 切断済みソケットへの SSL_write でプロセスごと落ちないように
+    signal(SIGPIPE, SIG_IGN);
+
+    // OpenSSL 初期化
+    SSL_load_error_strings();
+    OpenSSL_add_ssl_algorithms();
+    // provider（アクセラレータ）と property query は鍵と暗号の取得より前に
+    if(cfg.providers && !crypto_rt_load_providers(cfg.providers)){ openssl_fatal("OSSL_PROVIDER_load"); return 1; }
+    if(cfg.propq && !crypto_rt_set_propq(cfg.propq)){ fprintf(stderr, "propq too long: %s\n", cfg.propq); return 1; }
+    if(cfg.async && !ASYNC_is_capable()){ fprintf(stderr, "async jobs are not supported on this platform\n"); return 1; }
+    if(!crypto_rt_init()){ openssl_fatal("crypto_rt_init"); return 1; }
+    if(suites && !crypto_rt_set_prefer(suites)){
+        fprintf(stderr, "unknown or unavailable suite in -a %s\n", suites);
+        return 1;
+    }
+    printf("[S] record suites:");
+    for(int i = 0; i < g_crypto_rt.nprefer; i++) printf(" %s", app_suite_get(g_crypto_rt.prefer[i])->name);
+    printf("\n");
+
+    if(g_ncpus) printf("[S] threads pinned round robin to %d CPUs (%d NUMA nodes)\n", g_ncpus, app_numa_nodes());
+
+    // QKD 鍵プール（共有メモリ）。開けなければエクスポータ代用で続行
+    if(pool_name){
+        g_pool_on = qkd_pool_open(&g_pool, pool_name, 0, 0);
+        if(g_pool_on) printf("[S] QKD key pool %s: %u slots in %u shards, %llu keys ready\n", pool_name,
+                             g_pool.hdr->nslots, g_pool.hdr->nshards, (unsigned long long)qkd_pool_available(&g_pool));
+        else          fprintf(stderr, "[S] QKD key pool %s unavailable, using TLS exporter stand-in\n", pool_name);
+    }
+
+    // 封印レコードの監査ログ。送信経路はコピーするだけで、msync は専用スレッドがまとめて
+    if(cfg.reclog){
+        if(!app_reclog_open(&g_reclog, cfg.reclog, (uint64_t)cfg.reclog_mb << 20, (int)cfg.reclog_ms)){
+            perror(cfg.reclog); return 1;
+        }
+        app_reclog_install(&g_reclog);
+        g_reclog_on = 1;
+        printf("[S] record log %s: %llu of %llu MB committed, group commit every %ld ms\n", cfg.reclog,
+               (unsigned long long)(g_reclog.hdr->committed >> 20), (unsigned long long)(g_reclog.cap >> 20), cfg.reclog_ms);
+    }
+
+    // 並列封印のスレッドプール（全ストリーム共有）
+    if(g_seal_threads > 1 && g_stream_file && !g_zerocopy){
+        if(!aead_spool_start(g_seal_threads)){ perror("seal pool"); return 1; }
+        printf("[S] seal pool: %d threads shared by all streams\n", g_aead_spool.nthreads);
+    }
+
+    if(cfg.ticket_secs > 0 && !ticket_keys_init(cfg.ticket_secs)){ openssl_fatal("ticket_keys_init"); return 1; }
+    SSL_CTX *ctx = build_ctx(&cfg);
+    if(!ctx) return 1;
+    ctx_publish(ctx);
+    // ファイルは起動時に一度だけ封印
+    if(g_zerocopy){
+        if(!preseal_file(g_stream_file)) return 1;
+        printf("[S] pre-sealed %s (%zu bytes)\n", g_stream_file, g_sealed.len);
+    }
+
+    // SIGHUP: 証明書と鍵を読み直してコンテキストを差し替える（新しい接続から）。
+    // どのスレッドにも届かないよう、スレッドを作る前にブロックして専用スレッドで待つ
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hup, NULL);
+    pthread_t reload_th;
+    if(pthread_create(&reload_th, NULL, reload_main, &cfg) != 0){ perror("pthread_create"); return 1; }
+    pthread_detach(reload_th);
+
+    // ワーカーモードの接続キュー（-m のゲージからも読む）
+    static conn_queue q = {
+        .mu = PTHREAD_MUTEX_INITIALIZER,
+        .not_empty = PTHREAD_COND_INITIALIZER,
+        .not_full = PTHREAD_COND_INITIALIZER,
+    };
+
+    // メトリクス: 集計はスレッド起動前に有効化する（aead の観測フックも入る）
+    if(metrics_port){
+        app_metrics_enable(server_gauges, evmode ? NULL : &q);
+        if(!app_metrics_serve(g_host, metrics_port)){ perror("metrics listener"); return 1; }
+        printf("[S] metrics on http://%s:%d/metrics\n", g_host, metrics_port);
+    }
+
+    // イベント駆動モード: 各ループが自前の SO_REUSEPORT ソケットを持つ。
+    // 1 つでも開けなければ起動しない（-c ならその CPU が受けた接続の行き先がなくなる）
+    if(evmode){
+        ev_loop_arg *earg = calloc((size_t)workers, sizeof(*earg));
+        pthread_t *ths = calloc((size_t)workers, sizeof(*ths));
+        if(!ths || !earg){ perror("calloc"); return 1; }
+        for(int i = 0; i < workers; i++){
+            earg[i] = (ev_loop_arg){ open_listener(backlog, 1, g_ncpus ? g_cpus[i % g_ncpus] : -1), i };
+            if(earg[i].ls < 0){
+                fprintf(stderr, "[S] cannot open the listener of event loop %d\n", i);
+                while(i-- > 0) close(earg[i].ls);
+                return 1;
+            }
+        }
+        for(int i = 0; i < workers; i++){
+            if(pthread_create(&ths[i], NULL, ev_loop_main, &earg[i]) != 0){
+                perror("pthread_create"); return 1;
+            }
+        }
+        printf("[S] TLS server on https://%s:%d (epoll loops=%d backlog=%d)\n",
+               g_host, g_port, workers, backlog);
+        for(int i = 0; i < workers; i++) pthread_join(ths[i], NULL);
+        free(ths);
+        free(earg);
+        ctx_publish(NULL);
+        app_reclog_close(&g_reclog);
+        qkd_pool_close(&g_pool);
+        app_buf_pool_free_all();
+        crypto_rt_cleanup();
+        EVP_cleanup();
+        return 0;
+    }
+
+    // ソケット待ち受け
+    int ls = open_listener(backlog, 0, -1);
+    if(ls < 0) return 1;
+
+    // ワーカー起動
+    worker_arg *warg = calloc((size_t)workers, sizeof(*warg));
+    if(!warg){ perror("calloc"); return 1; }
+    for(int i = 0; i < workers; i++){
+        pthread_t th;
+        warg[i] = (worker_arg){ &q, i };
+        if(pthread_create(&th, NULL, worker_main, &warg[i]) != 0){
+            perror("pthread_create"); return 1;
+        }
+        pthread_detach(th);
+    }
+
+    printf("[S] TLS server on https://%s:%d (workers=%d backlog=%d)\n",
+           g_host, g_port, workers, backlog);
+
+    for(;;) {
+        struct sockaddr_in cli; socklen_t clilen = sizeof(cli);
+        int cs = accept(ls, (struct sockaddr*)&cli, &clilen);
+        if(cs < 0){ perror("accept"); continue; }
+        conn_queue_push(&q, cs);
+    }
+
+    close(ls);
+    free(warg);
+    aead_spool_stop();
+    ctx_publish(NULL);
+    app_reclog_close(&g_reclog);
+    qkd_pool_close(&g_pool);
+    app_buf_pool_free_all();
+    crypto_rt_cleanup();
     EVP_cleanup();
     return 0;
 }
@@ -0,0 +1,667 @@
+// qkd69_test.c  —  Stage69 TLS+QKDハイブリッド : レコード層の既知解テストと性質テスト
+//   build: cc -O2 -pthread -o qkd69_test qkd69_test.c -lssl -lcrypto
+//   run:   ./qkd69_test            （qkd69_test.py がスイート別ビルドと fuzz、指定すれば perf も回す）
+//
+// 既知解（KAT）: 固定の鍵・iv・平文から作った鍵導出、封印レコード、ストリームの
+// SHA-256 を、この形式の出力として固定した値と比べる。ワイヤ形式（ヘッダ、
+// AAD、nonce = iv XOR レコード番号、エポック更新）が変わるとここで落ちる。
+// 値は既定ビルド（32 バイト鍵、12 バイト iv、16 バイトタグ）のもので、他の
+// -D ビルドでは KAT を飛ばして性質テストだけを回す。
+// 性質テスト: 一括封印 = 逐次封印、マルチバッファ = EVP、並列ストリーム = 直列、
+// 使い回したコンテキスト = 新しいコンテキスト、改ざん 1 ビットで必ず失敗、
+// 再送検出ウィンドウ、封印レコードログの往復、終了したスレッドのメトリクス、
+// ALPN のスイート選択（サーバーが外したスイートは選ばない）。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <openssl/err.h>
+
+#include "hybrid_common.h"
+#include "hybrid_mb.h"
+#include "hybrid_metrics.h"
+#include "hybrid_pstream.h"
+#include "hybrid_reclog.h"
+
+#define KAT_BUILD (APP_KEY_LEN == 32 && APP_IV_LEN == 12 && APP_TAG_LEN == 16)
+
+static int g_fails;
+
+#define CHECK(c) do { if (!(c)) { printf("[T]   %s:%d: %s\n", __FILE__, __LINE__, #c); g_fails++; } } while (0)
+
+// ---- 固定入力 -------------------------------------------------------------
+static unsigned char k_key[32], k_iv[12], k_secret[32];
+static unsigned char *k_pt;          // KAT_PT_LEN バイトの決まった平文
+#define KAT_PT_LEN 40000
+
+static void kat_inputs(void)
+{
+    for (int i = 0; i < 32; i++) { k_key[i] = (unsigned char)i; k_secret[i] = (unsigned char)(0x40 + i); }
+    for (int i = 0; i < 12; i++) k_iv[i] = (unsigned char)(0xa0 + i);
+    k_pt = malloc(KAT_PT_LEN);
+    if (!k_pt) { perror("malloc"); exit(1); }
+    for (int i = 0; i < KAT_PT_LEN; i++) k_pt[i] = (unsigned char)(i * 31 + 7);
+}
+
+static void hex(const unsigned char *p, size_t n, char *out)
+{
+    for (size_t i = 0; i < n; i++) sprintf(out + 2 * i, "%02x", p[i]);
+    out[2 * n] = '\0';
+}
+
+// SHA-256 の 16 進が want と一致するか。違えば実際の値を表示する
+static int digest_is(const char *what, const unsigned char *p, size_t n, const char *want)
+{
+    unsigned char md[32];
+    char got[65];
+    unsigned int mdlen = 0;
+    if (EVP_Digest(p, n, md, &mdlen, EVP_sha256(), NULL) != 1) return 0;
+    hex(md, 32, got);
+    if (strcmp(got, want) == 0) return 1;
+    printf("[T]   %s: sha256 %s, want %s\n", what, got, want);
+    return 0;
+}
+
+// ---- メモリ上のストリーム入出力 -----------------------------------------------
+typedef struct {
+    unsigned char *buf;
+    size_t len, off, cap;
+} mem_io;
+
+static int mem_read(void *io, unsigned char *buf, int len)
+{
+    mem_io *m = (mem_io *)io;
+    size_t n = m->len - m->off < (size_t)len ? m->len - m->off : (size_t)len;
+    memcpy(buf, m->buf + m->off, n);
+    m->off += n;
+    return (int)n;
+}
+
+static int mem_write(void *io, const unsigned char *buf, int len)
+{
+    mem_io *m = (mem_io *)io;
+    if (m->len + (size_t)len > m->cap) {
+        size_t cap = (m->cap ? m->cap * 2 : 65536) + (size_t)len;
+        unsigned char *b = realloc(m->buf, cap);
+        if (!b) return 0;
+        m->buf = b;
+        m->cap = cap;
+    }
+    memcpy(m->buf + m->len, buf, (size_t)len);
+    m->len += (size_t)len;
+    return 1;
+}
+
+static int ctx_open(aead_ctx *a, int suite)
+{
+    if (!aead_ctx_init_suite(a, suite, k_key)) return 0;
+    aead_ctx_set_iv(a, k_iv);
+    return 1;
+}
+
+// 決まった鍵素材を返すエポック更新（info = 1 バイトの通し番号）
+static int kat_rekey(void *arg, int enc, unsigned char *info, int *infolen,
+                     unsigned char *material, size_t *mlen)
+{
+    unsigned *n = (unsigned *)arg;
+    if (enc) { info[0] = (unsigned char)(*n)++; *infolen = 1; }
+    else if (*infolen != 1) return 0;
+    memset(material, 0x30 + info[0], 32);
+    *mlen = 32;
+    return 1;
+}
+
+// ---- 既知解 -------------------------------------------------------------
+static void test_kat_derive(void)
+{
+#if KAT_BUILD
+    unsigned char out[32 * 4 + 12 * 2];
+    unsigned char *tx = out, *rx = out + 32, *txiv = out + 64, *rxiv = out + 76;
+    unsigned char *txc = out + 88, *rxc = out + 120;
+    CHECK(derive_app_keys_chained(k_secret, sizeof(k_secret), tx, rx, txiv, rxiv, txc, rxc));
+    CHECK(digest_is("derive_app_keys_chained", out, sizeof(out),
+                    "9d6fa8cc5b91c604502bff983650bb4775516ab075b006bcff06e9c1fe721388"));
+
+    unsigned char chain[32], ek[2][32 + 12];
+    memcpy(chain, txc, 32);
+    CHECK(derive_epoch_keys(chain, NULL, 0, ek[0], ek[0] + 32));              // ラチェット
+    CHECK(derive_epoch_keys(chain, k_secret, sizeof(k_secret), ek[1], ek[1] + 32));   // 新しい素材
+    CHECK(digest_is("derive_epoch_keys", ek[0], sizeof(ek), "d10d0f8e5ff2589b91b0fa8b1b6b0fa46c7451fc9afd44d808ec038bd4e0243a"));
+#endif
+}
+
+// 3 レコード（0、64、1000 バイト）を同じコンテキストで順に封印
+static void test_kat_seal(void)
+{
+#if KAT_BUILD
+    static const struct { int suite; const char *want; } k[] = {
+        { APP_SUITE_AES_256_GCM,       "c1b61ef212d74fd898fff2dab9b209b6c39264e617bc338b0e21fe23598c8a53" },
+        { APP_SUITE_CHACHA20_POLY1305, "ec4351084bbdaff40f51ae00f559787214b3475db531aad1640d0d15d343774d" },
+    };
+    for (size_t s = 0; s < sizeof(k) / sizeof(k[0]); s++) {
+        if (!crypto_rt_has_suite(k[s].suite)) { printf("[T]   %s unavailable, skipped\n", app_suite_get(k[s].suite)->name); continue; }
+        aead_ctx a;
+        unsigned char out[3 * APP_TAG_LEN + 64 + 1000];
+        int off = 0, n = 0;
+        static const int lens[3] = { 0, 64, 1000 };
+        CHECK(ctx_open(&a, k[s].suite));
+        for (int i = 0; i < 3; i++) {
+            CHECK(aead_ctx_seal_next(&a, APP_AAD, (int)sizeof(APP_AAD)-1, k_pt, lens[i], out + off, &n));
+            off += n;
+        }
+        CHECK(off == (int)sizeof(out));
+        CHECK(digest_is(app_suite_get(k[s].suite)->name, out, sizeof(out), k[s].want));
+        aead_ctx_free(&a);
+    }
+#endif
+}
+
+// KAT_PT_LEN バイトのストリーム（エポックなし / 1 チャンクごとに更新）
+static void test_kat_stream(void)
+{
+#if KAT_BUILD
+    static const char *const k_what[2] = { "aead_encrypt_stream", "aead_encrypt_stream (rekey every chunk)" };
+    static const char *const k_want[2] = {
+        "90a3aab7a18377623229a534a8677ef3291a04dc9db6baebbe8c8a2d3d81e64c",
+        "5a98205d6f14ea392a07533733b37e81b3ef7e12bfa6000e20ece6018b0dc8ce",
+    };
+    for (int rekey = 0; rekey < 2; rekey++) {
+        aead_ctx a;
+        unsigned n = 0;
+        aead_rekey rk = { kat_rekey, &n, {0}, 1 };
+        memcpy(rk.chain, k_secret, APP_CHAIN_LEN);
+        mem_io in = { k_pt, KAT_PT_LEN, 0, 0 }, out = { 0 };
+        CHECK(ctx_open(&a, APP_SUITE_AES_256_GCM));
+        CHECK(aead_encrypt_stream(&a, APP_AAD, (int)sizeof(APP_AAD)-1, mem_read, &in, mem_write, &out,
+                                  rekey ? &rk : NULL));
+        CHECK(digest_is(k_what[rekey], out.buf, out.len, k_want[rekey]));
+
+        // 受信側で元に戻る
+        aead_ctx b;
+        unsigned m = 0;
+        aead_rekey rb = { kat_rekey, &m, {0}, 0 };
+        memcpy(rb.chain, k_secret, APP_CHAIN_LEN);
+        mem_io sealed = { out.buf, out.len, 0, 0 }, back = { 0 };
+        CHECK(ctx_open(&b, APP_SUITE_AES_256_GCM));
+        CHECK(aead_decrypt_stream(&b, APP_AAD, (int)sizeof(APP_AAD)-1, mem_read, &sealed, mem_write, &back,
+                                  rekey ? &rb : NULL));
+        CHECK(back.len == KAT_PT_LEN && memcmp(back.buf, k_pt, KAT_PT_LEN) == 0);
+        free(out.buf);
+        free(back.buf);
+        aead_ctx_free(&a);
+        aead_ctx_free(&b);
+    }
+#endif
+}
+
+// ---- 性質テスト -----------------------------------------------------------
+// nonce はレコード番号から: seal_next の n 番目 = iv XOR n で aead_ctx_seal
+static void test_counter_nonce(void)
+{
+    aead_ctx a, b;
+    unsigned char c1[64 + APP_TAG_LEN], c2[sizeof(c1)], nonce[APP_IV_LEN];
+    int n1 = 0, n2 = 0;
+    CHECK(ctx_open(&a, APP_SUITE) && ctx_open(&b, APP_SUITE));
+    for (uint64_t i = 0; i < 5; i++) {
+        CHECK(aead_ctx_seal_next(&a, APP_AAD, 5, k_pt, 64, c1, &n1));
+        aead_nonce_xor(k_iv, i, nonce);
+        CHECK(aead_ctx_seal(&b, APP_AAD, 5, nonce, k_pt, 64, c2, &n2));
+        CHECK(n1 == n2 && memcmp(c1, c2, (size_t)n1) == 0);
+        unsigned char one[sizeof(c1)];
+        int n3 = 0;
+        CHECK(aead_encrypt(k_key, APP_AAD, 5, nonce, k_pt, 64, one, &n3));   // 鍵展開し直しでも同じ
+        CHECK(APP_SUITE != crypto_rt_best_suite() || (n3 == n1 && memcmp(one, c1, (size_t)n1) == 0));
+    }
+    CHECK(a.seq == 5);
+    aead_ctx_free(&a);
+    aead_ctx_free(&b);
+}
+
+// 一括封印（1 バッファに詰めてその場で）= 1 チャンクずつの封印、一括で開く
+static void test_batch(void)
+{
+    static const int lens[] = { 64, 0, 1024, 1, APP_STREAM_CHUNK, 300 };
+    enum { N = sizeof(lens) / sizeof(lens[0]) };
+    int total = 0;
+    for (int i = 0; i < N; i++) total += aead_rec_frame_len(lens[i]);
+    unsigned char *buf = malloc((size_t)total), *ref = malloc((size_t)total);
+    if (!buf || !ref) { perror("malloc"); exit(1); }
+
+    aead_ctx a, b;
+    aead_stream s, t;
+    aead_rec recs[N];
+    CHECK(ctx_open(&a, APP_SUITE) && ctx_open(&b, APP_SUITE));
+    CHECK(aead_stream_init(&s, &a, APP_RPC_AAD, (int)sizeof(APP_RPC_AAD)-1));
+    CHECK(aead_stream_init(&t, &b, APP_RPC_AAD, (int)sizeof(APP_RPC_AAD)-1));
+    int off = 0, roff = 0;
+    for (int i = 0; i < N; i++) {
+        recs[i].base = buf + off;
+        recs[i].len = lens[i];
+        memcpy(APP_REC_PAYLOAD(recs[i].base), k_pt, (size_t)lens[i]);
+        off += aead_rec_frame_len(lens[i]);
+        int flen = 0;
+        CHECK(aead_stream_seal_chunk(&t, k_pt, lens[i], i == N - 1, ref + roff, &flen));
+        roff += flen;
+    }
+    int sum = 0;
+    CHECK(aead_stream_seal_batch(&s, recs, N, 1, &sum));
+    CHECK(sum == total && roff == total && memcmp(buf, ref, (size_t)total) == 0);
+    aead_stream_free(&s);
+    aead_ctx_free(&a);
+
+    // 開く: 途中で切れた入力は部分レコードで止まり、続きを足せば全部開く
+    aead_ctx r;
+    aead_stream o;
+    aead_rec got[N];
+    int used = 0;
+    CHECK(ctx_open(&r, APP_SUITE));
+    CHECK(aead_stream_init(&o, &r, APP_RPC_AAD, (int)sizeof(APP_RPC_AAD)-1));
+    int cut = aead_rec_frame_len(lens[0]) + 3;
+    CHECK(aead_stream_open_batch(&o, buf, cut, got, N, &used) == 1 && used == aead_rec_frame_len(lens[0]));
+    int n = aead_stream_open_batch(&o, buf + used, total - used, got + 1, N - 1, &off);
+    CHECK(n == N - 1 && used + off == total && o.done);
+    for (int i = 1; i < N && n == N - 1; i++) {
+        CHECK(got[i].len == lens[i] && memcmp(APP_REC_PAYLOAD(got[i].base), k_pt, (size_t)lens[i]) == 0);
+    }
+    aead_stream_free(&o);
+    aead_ctx_free(&r);
+
+    // 同じ aead_ctx を使い回しても新しく作ったものと同じ暗号文
+    aead_ctx u, v;
+    unsigned char c1[128 + APP_TAG_LEN], c2[sizeof(c1)];
+    int n1 = 0, n2 = 0;
+    CHECK(ctx_open(&u, APP_SUITE));
+    for (int i = 0; i < 100; i++) CHECK(aead_ctx_seal_next(&u, APP_AAD, 11, k_pt + i, 128, c1, &n1));
+    CHECK(aead_ctx_init_suite(&v, APP_SUITE, k_key));
+    aead_ctx_set_iv(&v, k_iv);
+    v.seq = 99;
+    CHECK(aead_ctx_seal_next(&v, APP_AAD, 11, k_pt + 99, 128, c2, &n2));
+    CHECK(n1 == n2 && memcmp(c1, c2, (size_t)n1) == 0);
+    aead_ctx_free(&u);
+    aead_ctx_free(&v);
+    aead_stream_free(&t);
+    aead_ctx_free(&b);
+    free(buf);
+    free(ref);
+}
+
+// 1 フレームのどの 1 ビットを反転しても開けない
+static void test_tamper(void)
+{
+    unsigned char frame[APP_REC_OVERHEAD + 40], bad[sizeof(frame)], out[sizeof(frame)];
+    aead_ctx a;
+    aead_stream s;
+    int flen = 0, rejected = 0, bits = 0;
+    CHECK(ctx_open(&a, APP_SUITE));
+    CHECK(aead_stream_init(&s, &a, APP_AAD, 11));
+    CHECK(aead_stream_seal_chunk(&s, k_pt, 40, 1, frame, &flen));
+    aead_stream_free(&s);
+    aead_ctx_free(&a);
+    for (int i = 0; i < flen; i++) {
+        for (int b = 0; b < 8; b++, bits++) {
+            aead_ctx r;
+            aead_stream o;
+            int n = 0, ctlen = 0;
+            unsigned char fl = 0;
+            memcpy(bad, frame, (size_t)flen);
+            bad[i] ^= (unsigned char)(1 << b);
+            CHECK(ctx_open(&r, APP_SUITE));
+            CHECK(aead_stream_init(&o, &r, APP_AAD, 11));
+            rejected += !aead_rec_get_hdr(bad, &ctlen, &fl) || APP_REC_HDR_LEN + ctlen != flen ||
+                        !aead_stream_open_chunk(&o, bad, bad + APP_REC_HDR_LEN, ctlen, out, &n, NULL);
+            aead_stream_free(&o);
+            aead_ctx_free(&r);
+        }
+    }
+    CHECK(rejected == bits);
+}
+
+// マルチバッファ封印 = EVP の逐次封印（ホスト CPU が対応していれば）
+static void test_mb(void)
+{
+    enum { N = 11 };
+    aead_ctx mb, ref;
+    aead_mb_job j[N];
+    unsigned char ct[N][256 + APP_TAG_LEN], c2[256 + APP_TAG_LEN];
+    memset(j, 0, sizeof(j));
+    CHECK(ctx_open(&mb, APP_SUITE) && aead_ctx_mb_init(&mb, k_key) && ctx_open(&ref, APP_SUITE));
+    for (int i = 0; i < N; i++) {
+        j[i].a = &mb;
+        j[i].aad = APP_AAD;
+        j[i].aadlen = i;
+        j[i].in = k_pt + i;
+        j[i].inlen = i * 23;
+        j[i].out = ct[i];
+    }
+    CHECK(aead_mb_seal(j, N) == N);
+    for (int i = 0; i < N; i++) {
+        int n = 0;
+        CHECK(aead_ctx_seal_next(&ref, APP_AAD, i, k_pt + i, i * 23, c2, &n));
+        CHECK(j[i].outlen == n && memcmp(ct[i], c2, (size_t)n) == 0);
+    }
+    aead_ctx_free(&mb);
+    aead_ctx_free(&ref);
+}
+
+// 1 ストリームの複数チャンクを 1 回の aead_mb_open / aead_mb_seal で
+// （サーバーのリクエスト応答と同じ使い方）= aead_stream_open_chunk / seal_chunk
+static int mb_stream_open_all(aead_stream *s, unsigned char *wire, const int *lens, int n, aead_mb_job *j)
+{
+    int off = 0;
+    for (int i = 0; i < n; i++) {
+        if (!aead_mb_job_open_chunk(&j[i], s, wire + off, lens[i] + APP_TAG_LEN)) return 0;
+        off += APP_REC_OVERHEAD + lens[i];
+    }
+    return 1;
+}
+
+static void test_mb_stream(void)
+{
+    static const int lens[] = { 64, 0, 200, 1024, 2000, 64 };
+    enum { N = sizeof(lens) / sizeof(lens[0]) };
+    unsigned char wire[N * (APP_REC_OVERHEAD + 2000)], ref[sizeof(wire)];
+    aead_ctx ca, cr, cb, cc, ct;
+    aead_stream sa, sr, sb, sc, st;
+    aead_mb_job j[N], extra;
+    int off = 0, roff = 0;
+    CHECK(ctx_open(&ca, APP_SUITE) && ctx_open(&cr, APP_SUITE) && ctx_open(&cb, APP_SUITE) &&
+          ctx_open(&cc, APP_SUITE) && ctx_open(&ct, APP_SUITE));
+    CHECK(aead_ctx_mb_init(&cr, k_key) && aead_ctx_mb_init(&cb, k_key) && aead_ctx_mb_init(&ct, k_key));
+    CHECK(aead_stream_init(&sa, &ca, APP_RPC_AAD, (int)sizeof(APP_RPC_AAD)-1) &&
+          aead_stream_init(&sr, &cr, APP_RPC_AAD, (int)sizeof(APP_RPC_AAD)-1) &&
+          aead_stream_init(&sb, &cb, APP_AAD, (int)sizeof(APP_AAD)-1) &&
+          aead_stream_init(&sc, &cc, APP_AAD, (int)sizeof(APP_AAD)-1) &&
+          aead_stream_init(&st, &ct, APP_AAD, (int)sizeof(APP_AAD)-1));
+
+    // 封印は逐次、開封は 1 回で。FINAL の後は積めない
+    for (int i = 0; i < N; i++) {
+        int flen = 0;
+        CHECK(aead_stream_seal_chunk(&sa, k_pt + i, lens[i], i == N - 1, wire + off, &flen));
+        off += flen;
+    }
+    CHECK(mb_stream_open_all(&sr, wire, lens, N, j));
+    CHECK(sr.done && !aead_mb_job_open_chunk(&extra, &sr, wire, lens[0] + APP_TAG_LEN));
+    CHECK(aead_mb_open(j, N) == N);
+    for (int i = 0; i < N; i++) {
+        CHECK(j[i].outlen == lens[i] && memcmp(APP_REC_PAYLOAD(j[i].frame), k_pt + i, (size_t)lens[i]) == 0);
+    }
+
+    // 開いた場所にそのまま 1 回で封印し直す = 逐次封印
+    for (int i = 0; i < N; i++) {
+        unsigned char *frame = j[i].frame;
+        int len = j[i].outlen, flen = 0;
+        CHECK(aead_mb_job_chunk(&j[i], &sb, frame, len, i == N - 1));
+        CHECK(aead_stream_seal_chunk(&sc, k_pt + i, lens[i], i == N - 1, ref + roff, &flen));
+        roff += flen;
+    }
+    CHECK(aead_mb_seal(j, N) == N && roff == off && memcmp(wire, ref, (size_t)off) == 0);
+
+    // 3 件目を改ざん: 前の 2 件だけ開き、同じストリームの後続はすべて失敗
+    ref[3 * APP_REC_HDR_LEN + 2 * APP_TAG_LEN + lens[0] + lens[1]] ^= 1;
+    CHECK(mb_stream_open_all(&st, ref, lens, N, j));
+    CHECK(aead_mb_open(j, N) == 2 && j[1].ok && !j[2].ok && !j[5].ok && ct.seq == 2);
+
+    aead_stream_free(&sa); aead_stream_free(&sr); aead_stream_free(&sb);
+    aead_stream_free(&sc); aead_stream_free(&st);
+    aead_ctx_free(&ca); aead_ctx_free(&cr); aead_ctx_free(&cb); aead_ctx_free(&cc); aead_ctx_free(&ct);
+}
+
+// 並列封印ストリーム = 直列の aead_encrypt_stream。共有プールに同時に何本流しても同じ
+typedef struct {
+    mem_io out;
+    int ok;
+} pstream_job;
+
+static void *pstream_one(void *arg)
+{
+    pstream_job *j = (pstream_job *)arg;
+    aead_ctx a;
+    mem_io in = { k_pt, KAT_PT_LEN, 0, 0 };
+    j->ok = ctx_open(&a, APP_SUITE) &&
+            aead_encrypt_stream_mt(&a, APP_AAD, 11, mem_read, &in, mem_write, &j->out, 4);
+    aead_ctx_free(&a);
+    return NULL;
+}
+
+static void test_pstream(void)
+{
+    enum { NSTREAM = 4 };
+    mem_io ref = { 0 };
+    aead_ctx a;
+    mem_io in = { k_pt, KAT_PT_LEN, 0, 0 };
+    CHECK(ctx_open(&a, APP_SUITE));
+    CHECK(aead_encrypt_stream(&a, APP_AAD, 11, mem_read, &in, mem_write, &ref, NULL));
+    aead_ctx_free(&a);
+
+    CHECK(aead_spool_start(3));
+    pstream_job j[NSTREAM];
+    pthread_t th[NSTREAM];
+    memset(j, 0, sizeof(j));
+    for (int i = 0; i < NSTREAM; i++) CHECK(pthread_create(&th[i], NULL, pstream_one, &j[i]) == 0);
+    for (int i = 0; i < NSTREAM; i++) {
+        pthread_join(th[i], NULL);
+        CHECK(j[i].ok && j[i].out.len == ref.len && memcmp(j[i].out.buf, ref.buf, ref.len) == 0);
+        free(j[i].out.buf);
+    }
+    CHECK(g_aead_spool.nthreads == 3 && g_aead_spool.streams == NULL);
+    aead_spool_stop();
+    free(ref.buf);
+}
+
+// 再送検出: 同じ番号は 1 回だけ、ウィンドウより古いものは拒否、偽造は窓を動かさない
+static void test_replay(void)
+{
+    aead_replay r;
+    aead_replay_reset(&r);
+    static const uint64_t order[] = { 0, 2, 1, 5, 3, 100, 4, 1000, 999 };
+    for (size_t i = 0; i < sizeof(order) / sizeof(order[0]); i++) {
+        CHECK(aead_replay_check(&r, order[i]));
+        aead_replay_update(&r, order[i]);
+        CHECK(!aead_replay_check(&r, order[i]));
+    }
+    CHECK(!aead_replay_check(&r, 2) && aead_replay_check(&r, 998) && aead_replay_check(&r, 1001));
+    aead_replay_update(&r, 5000);
+    CHECK(!aead_replay_check(&r, 999));                                  // 古すぎる
+    CHECK(aead_replay_check(&r, 5000 - (APP_REPLAY_WINDOW - 64)));       // 保証された幅の内側
+    CHECK(!aead_replay_check(&r, UINT64_MAX));
+
+    // aead_ctx_open_at: 順不同で開け、同じものは二度開けず、改ざんは窓を汚さない
+    aead_ctx s, o;
+    unsigned char ct[8][32 + APP_TAG_LEN], pt[32];
+    int n = 0;
+    CHECK(ctx_open(&s, APP_SUITE) && ctx_open(&o, APP_SUITE));
+    for (int i = 0; i < 8; i++) CHECK(aead_ctx_seal_next(&s, APP_AAD, 11, k_pt + i, 32, ct[i], &n));
+    aead_replay_reset(&r);
+    ct[6][0] ^= 1;
+    CHECK(!aead_ctx_open_at(&o, &r, 6, APP_AAD, 11, ct[6], n, pt, &n) && aead_replay_check(&r, 6));
+    ct[6][0] ^= 1;
+    static const int seq[] = { 3, 0, 7, 6, 1 };
+    for (size_t i = 0; i < sizeof(seq) / sizeof(seq[0]); i++) {
+        int m = 0;
+        CHECK(aead_ctx_open_at(&o, &r, (uint64_t)seq[i], APP_AAD, 11, ct[seq[i]], 32 + APP_TAG_LEN, pt, &m));
+        CHECK(m == 32 && memcmp(pt, k_pt + seq[i], 32) == 0);
+        CHECK(!aead_ctx_open_at(&o, &r, (uint64_t)seq[i], APP_AAD, 11, ct[seq[i]], 32 + APP_TAG_LEN, pt, &m));
+    }
+    aead_ctx_free(&s);
+    aead_ctx_free(&o);
+}
+
+// ALPN: client の並びで申し出を作り、server の優先順で選ばせる。
+// 選ばれたスイート id、選べなければ 0、並びが使えなければ -1。
+static int alpn_pick(const char *client, const char *server)
+{
+    unsigned char list[APP_ALPN_MAX], outlen = 0;
+    const unsigned char *out = NULL;
+    if (!crypto_rt_set_prefer(client)) return -1;
+    int n = app_suite_alpn_list(list, sizeof(list));
+    if (n <= 0 || !crypto_rt_set_prefer(server)) return -1;
+    if (app_suite_alpn_select(NULL, &out, &outlen, list, (unsigned int)n, NULL) != SSL_TLSEXT_ERR_OK) return 0;
+    return app_suite_from_alpn(out, outlen);
+}
+
+static void test_alpn(void)
+{
+    int saved[APP_SUITE_COUNT], nsaved = g_crypto_rt.nprefer, aes = 0;
+    memcpy(saved, g_crypto_rt.prefer, sizeof(saved));
+    for (int i = 0; i < nsaved && !aes; i++)
+        if (saved[i] != APP_SUITE_CHACHA20_POLY1305) aes = saved[i];
+    if (!aes || !crypto_rt_has_suite(APP_SUITE_CHACHA20_POLY1305)) {
+        printf("[T]   needs ChaCha20-Poly1305 and one other suite, skipped\n");
+        return;
+    }
+    const char *t = app_suite_get(aes)->tag;
+    char ca[64], ac[64];
+    snprintf(ca, sizeof(ca), "chacha20,%s", t);
+    snprintf(ac, sizeof(ac), "%s,chacha20", t);
+
+    CHECK(alpn_pick(ca, t) == aes);                               // 外したスイートは先頭でも選ばない
+    CHECK(alpn_pick("chacha20", t) == 0);
+    CHECK(alpn_pick(ca, ac) == APP_SUITE_CHACHA20_POLY1305);     // 許していれば ChaCha20 先頭が勝つ
+    CHECK(alpn_pick(ac, ca) == APP_SUITE_CHACHA20_POLY1305);     // それ以外はサーバーの順
+    CHECK(alpn_pick(ac, ac) == aes);
+
+    memcpy(g_crypto_rt.prefer, saved, sizeof(saved));
+    g_crypto_rt.nprefer = nsaved;
+}
+
+// 封印レコードログ: シンク経由で書いたフレームがそのまま読める
+typedef struct {
+    const unsigned char *frames;
+    uint64_t n;
+    int bad;
+} log_walk;
+
+static int log_visit(void *arg, const app_reclog_entry *e, const unsigned char *frame, int ok)
+{
+    log_walk *w = (log_walk *)arg;
+    int flen = 0;
+    unsigned char fl = 0;
+    aead_rec_get_hdr(w->frames, &flen, &fl);
+    flen += APP_REC_HDR_LEN;
+    w->bad += !ok || e->stream != 1 || e->epoch != 0 || e->counter != w->n ||
+              (int)e->len != flen || memcmp(frame, w->frames, (size_t)flen) != 0;
+    w->frames += flen;
+    w->n++;
+    return 1;
+}
+
+static void test_reclog(void)
+{
+    char path[] = "/tmp/qkd69-test-log-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) { perror("mkstemp"); g_fails++; return; }
+    close(fd);
+    unlink(path);
+
+    app_reclog l;
+    CHECK(app_reclog_open(&l, path, 1 << 20, 1));
+    app_reclog_install(&l);
+    aead_ctx a;
+    mem_io in = { k_pt, KAT_PT_LEN, 0, 0 }, out = { 0 };
+    CHECK(ctx_open(&a, APP_SUITE));
+    a.log_id = app_reclog_stream(&l);
+    CHECK(aead_encrypt_stream(&a, APP_AAD, 11, mem_read, &in, mem_write, &out, NULL));
+    uint64_t records = a.seq;
+    aead_ctx_free(&a);
+    app_reclog_install(NULL);
+    CHECK(app_reclog_close(&l));
+
+    app_reclog_stats st;
+    log_walk w = { out.buf, 0, 0 };
+    CHECK(app_reclog_scan(path, log_visit, &w, &st));
+    CHECK(st.entries == records && st.bad == 0 && w.bad == 0 && st.bytes == out.len && st.streams == 1);
+    unlink(path);
+    free(out.buf);
+}
+
+// 終了したスレッドのシャードは累計に足されて解放され、合計は変わらない
+static void *metrics_one(void *arg)
+{
+    (void)arg;
+    app_metric_add(APP_M_CONNECTIONS, 1);
+    app_metric_observe(APP_H_HANDSHAKE, 1500);
+    return NULL;
+}
+
+static int metrics_live_shards(void)
+{
+    int n = 0;
+    pthread_mutex_lock(&g_app_metrics.mu);
+    for (app_metrics_shard *s = g_app_metrics.shards.next; s; s = s->next) n++;
+    pthread_mutex_unlock(&g_app_metrics.mu);
+    return n;
+}
+
+static void test_metrics(void)
+{
+    enum { NTH = 50 };
+    app_metrics_enable(NULL, NULL);
+    int live = metrics_live_shards();
+    for (int i = 0; i < NTH; i++) {
+        pthread_t th;
+        CHECK(pthread_create(&th, NULL, metrics_one, NULL) == 0);
+        pthread_join(th, NULL);
+    }
+    CHECK(metrics_live_shards() == live);
+
+    char *text = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&text, &len);
+    CHECK(f != NULL);
+    if (!f) return;
+    app_metrics_write(f);
+    fclose(f);
+    CHECK(strstr(text, "\nstage69_connections_total 50\n") != NULL);
+    CHECK(strstr(text, "\nstage69_handshake_seconds_count 50\n") != NULL);
+    free(text);
+    g_app_metrics.enabled = 0;
+    g_aead_observer = NULL;
+}
+
+// ---- メイン -----------------------------------------------------------------
+typedef struct {
+    const char *name;
+    void (*fn)(void);
+} test_case;
+
+static const test_case k_tests[] = {
+    { "kat_derive",    test_kat_derive },
+    { "kat_seal",      test_kat_seal },
+    { "kat_stream",    test_kat_stream },
+    { "counter_nonce", test_counter_nonce },
+    { "batch",         test_batch },
+    { "tamper",        test_tamper },
+    { "mb",            test_mb },
+    { "mb_stream",     test_mb_stream },
+    { "pstream",       test_pstream },
+    { "replay",        test_replay },
+    { "alpn",          test_alpn },
+    { "reclog",        test_reclog },
+    { "metrics",       test_metrics },
+};
+
+int main(int argc, char **argv)
+{
+    const char *only = argc > 1 ? argv[1] : NULL;
+    if (!crypto_rt_init()) { ERR_print_errors_fp(stderr); return 1; }
+    kat_inputs();
+    printf("[T] %s key=%d iv=%d tag=%d%s\n", APP_AEAD_NAME, APP_KEY_LEN, APP_IV_LEN, APP_TAG_LEN,
+           KAT_BUILD ? "" : " (known answers need the default sizes, skipped)");
+    int failed = 0, run = 0;
+    for (size_t i = 0; i < sizeof(k_tests) / sizeof(k_tests[0]); i++) {
+        if (only && strcmp(only, k_tests[i].name) != 0) continue;
+        int before = g_fails;
+        k_tests[i].fn();
+        run++;
+        printf("[T] %-14s %s\n", k_tests[i].name, g_fails == before ? "ok" : "FAILED");
+        failed += g_fails != before;
+    }
+    printf("[T] %d of %d tests passed\n", run - failed, run);
+    free(k_pt);
+    crypto_rt_cleanup();
+    return failed || !run ? 1 : 0;
+}
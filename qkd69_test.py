@@ -0,0 +1,211 @@
+# -*- coding: utf-8 -*-
+# Stage69 test runner for the C record layer.
+#
+#   python3 qkd69_test.py kat            known answers + properties, every suite of qkd69_h.py
+#   python3 qkd69_test.py fuzz [-n N]    both fuzz targets
+#   python3 qkd69_test.py perf [--update] [--threshold 0.15] [--baseline FILE]
+#   python3 qkd69_test.py                kat and fuzz (perf only when asked for)
+#
+# kat builds qkd69_test.c once per -D flag set (known answers only apply to
+# the default sizes, the other builds run the property tests).
+# fuzz builds qkd69_fuzz.c with clang -fsanitize=fuzzer when clang is there
+# and runs each target for a fixed number of iterations; otherwise it builds
+# the standalone driver with gcc and the address/undefined sanitizers and
+# replays its generated inputs.
+# perf runs "qkd69_bench -m micro" for the standard sizes. Absolute records/s
+# depend on the machine and its load, so each op is scored as its records/s
+# over that of aead_ctx_seal_next (reused context, one EVP call per record) at
+# the same size in the same bench run; ops without a size use the 64 byte
+# row. The sizes take turns over PERF_RUNS short runs, the gate takes the
+# median ratio per op and flags any that dropped by more than the threshold
+# against the baseline. Flagged sizes are measured once more and only a drop
+# seen both times fails. The baseline is local and not committed: write it
+# with --update on an unchanged tree first (default .qkd69_perf.json).
+# --update measures PERF_BASE_SETS times and keeps each op's median and the
+# spread between the sets; an op whose spread on the unchanged tree is more
+# than half the threshold is gated at twice its spread instead (the range of
+# a few sets underestimates the noise).
+# A regression of aead_ctx_seal_next itself shows as the other ops getting
+# relatively faster, not as a failure.
+
+import argparse
+import json
+import os
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+
+from qkd69_h import SUITES
+
+CFLAGS = ["-O2", "-pthread", "-I."]
+LIBS = ["-lssl", "-lcrypto"]
+PERF_FILE = ".qkd69_perf.json"
+PERF_SIZES = [64, 1024, 16384]
+PERF_RUNS = 9
+PERF_SECS = 0.5
+PERF_REF = "aead_ctx_seal_next"
+PERF_BASE_SETS = 3
+
+def build(cc, src, out, flags):
+    r = subprocess.run([cc, *flags, "-o", out, src, *LIBS], capture_output=True, text=True)
+    if r.returncode != 0:
+        print(f"[Stage69] build {src} {' '.join(flags)}: FAILED")
+        print(r.stderr)
+    return r.returncode == 0
+
+def run_kat(tmp):
+    ok = True
+    for flag in SUITES:
+        exe = os.path.join(tmp, "qkd69_test")
+        if not build("cc", "qkd69_test.c", exe, CFLAGS + [flag]):
+            ok = False
+            continue
+        r = subprocess.run([exe], capture_output=True, text=True)
+        print(f"[Stage69] kat {flag}: {'ok' if r.returncode == 0 else 'FAILED'}")
+        if r.returncode != 0:
+            print(r.stdout + r.stderr)
+            ok = False
+    return ok
+
+def run_fuzz(tmp, iters):
+    ok = True
+    libfuzzer = shutil.which("clang") is not None
+    for target in ["FUZZ_DECRYPT", "FUZZ_RECORD"]:
+        exe = os.path.join(tmp, target.lower())
+        if libfuzzer:
+            flags = ["-O1", "-g", "-fsanitize=fuzzer,address,undefined", f"-DFUZZ_TARGET={target}", "-I."]
+            if not build("clang", "qkd69_fuzz.c", exe, flags):
+                return False
+            cmd = [exe, f"-runs={iters}", "-max_len=4096"]
+        else:
+            flags = ["-O1", "-g", "-fsanitize=address,undefined", "-fno-sanitize-recover=undefined",
+                     "-DFUZZ_STANDALONE", f"-DFUZZ_TARGET={target}", "-pthread", "-I."]
+            if not build("cc", "qkd69_fuzz.c", exe, flags):
+                return False
+            cmd = [exe, "-n", str(iters)]
+        r = subprocess.run(cmd, capture_output=True, text=True, cwd=tmp)
+        how = "libFuzzer" if libfuzzer else "standalone"
+        print(f"[Stage69] fuzz {target} ({how}, {iters} runs): {'ok' if r.returncode == 0 else 'FAILED'}")
+        if r.returncode != 0:
+            print(r.stdout[-4000:] + r.stderr[-4000:])
+            ok = False
+    return ok
+
+def bench_rows(exe, size):
+    r = subprocess.run([exe, "-m", "micro", "-s", str(size), "-d", str(PERF_SECS)],
+                       capture_output=True, text=True)
+    if r.returncode != 0:
+        raise RuntimeError(f"qkd69_bench -s {size} failed: {r.stderr.strip()}")
+    rows = {}
+    for line in r.stdout.splitlines():
+        if line.startswith("#") or line.startswith("op "):
+            continue
+        # the op name may contain a space ("aead_mb_seal x8"); the last 6 columns are numbers
+        cols = line.split()
+        if len(cols) < 7:
+            continue
+        op = " ".join(cols[:-6])
+        rows[f"{op}/{cols[-6]}"] = float(cols[-5])
+    return rows
+
+def ratios(rows, size):
+    # op/size -> records/s relative to the reference op of the same run
+    ref = rows.get(f"{PERF_REF}/{size}")
+    if not ref:
+        raise RuntimeError(f"qkd69_bench -s {size}: no {PERF_REF} row")
+    return {key: rps / ref for key, rps in rows.items() if not key.startswith(PERF_REF + "/")}
+
+def measure(exe, sizes):
+    runs = {}
+    for _ in range(PERF_RUNS):
+        for size in sizes:
+            for key, r in ratios(bench_rows(exe, size), size).items():
+                # the size-less ops are in every run; score them with the first size only
+                if key.endswith("/0") and size != PERF_SIZES[0]:
+                    continue
+                runs.setdefault(key, []).append(r)
+    return {key: statistics.median(v) for key, v in runs.items()}
+
+def key_size(key):
+    size = int(key.rsplit("/", 1)[1])
+    return size or PERF_SIZES[0]
+
+def run_perf(tmp, update, threshold, path):
+    exe = os.path.join(tmp, "qkd69_bench")
+    if not build("cc", "qkd69_bench.c", exe, CFLAGS):
+        return False
+    cur = measure(exe, PERF_SIZES)
+    if update:
+        sets = [cur] + [measure(exe, PERF_SIZES) for _ in range(PERF_BASE_SETS - 1)]
+        ratio = {k: statistics.median(m[k] for m in sets) for k in cur}
+        noise = {k: (max(m[k] for m in sets) - min(m[k] for m in sets)) / ratio[k] for k in cur}
+        base = {"threshold": threshold if threshold is not None else 0.15, "sizes": PERF_SIZES,
+                "reference": PERF_REF, "ratio": {k: round(v, 4) for k, v in sorted(ratio.items())},
+                "noise": {k: round(v, 4) for k, v in sorted(noise.items())}}
+        with open(path, "w", encoding="ascii") as f:
+            json.dump(base, f, indent=2)
+            f.write("\n")
+        print(f"[Stage69] perf baseline written to {path} ({len(cur)} ops)")
+        return True
+    try:
+        with open(path, encoding="ascii") as f:
+            base = json.load(f)
+    except OSError as e:
+        print(f"[Stage69] perf: no baseline ({e}); run with --update first")
+        return False
+    if base.get("reference") != PERF_REF or "ratio" not in base:
+        print(f"[Stage69] perf: {path} is not a {PERF_REF} ratio baseline; run with --update")
+        return False
+    limit = threshold if threshold is not None else base.get("threshold", 0.15)
+    noise = base.get("noise", {})
+    allow = {key: max(limit, 2 * noise.get(key, 0.0)) for key in base["ratio"]}
+    missing = [key for key in base["ratio"] if key not in cur]
+    flagged = [key for key, want in base["ratio"].items() if key in cur and cur[key] / want - 1.0 < -allow[key]]
+    again = measure(exe, sorted({key_size(key) for key in flagged})) if flagged else {}
+    ok = not missing
+    for key, want in sorted(base["ratio"].items()):
+        if key in missing:
+            print(f"[Stage69] perf {key}: missing from qkd69_bench output")
+            continue
+        got = cur[key]
+        note = ""
+        if key in flagged:
+            got = max(got, again.get(key, 0.0))
+            bad = got / want - 1.0 < -allow[key]
+            note = "  REGRESSION" if bad else "  (recheck ok)"
+            ok = ok and not bad
+        if allow[key] > limit:
+            note += f"  (noise, gated at -{allow[key]:.0%})"
+        print(f"[Stage69] perf {key:28s} {got:8.3f} x {PERF_REF} ({got / want - 1.0:+6.1%}){note}")
+    print(f"[Stage69] perf threshold -{limit:.0%}: {'ok' if ok else 'FAILED'}")
+    return ok
+
+def main():
+    p = argparse.ArgumentParser(description="Stage69 record layer tests")
+    # no choices= here: Python before 3.12 checks the empty default against them
+    p.add_argument("what", nargs="*", metavar="{kat,fuzz,perf}", default=[])
+    p.add_argument("-n", type=int, default=20000, help="fuzz iterations per target")
+    p.add_argument("--update", action="store_true", help="write the perf baseline instead of checking it")
+    p.add_argument("--threshold", type=float, help=f"allowed drop of the ratio to {PERF_REF} (0.15 = 15%%)")
+    p.add_argument("--baseline", default=PERF_FILE, help=f"local perf baseline (default {PERF_FILE})")
+    a = p.parse_args()
+    what = a.what or (["perf"] if a.update else ["kat", "fuzz"])
+    for w in what:
+        if w not in ("kat", "fuzz", "perf"):
+            p.error(f"unknown test set {w!r} (choose from kat, fuzz, perf)")
+
+    ok = True
+    with tempfile.TemporaryDirectory() as tmp:
+        if "kat" in what:
+            ok = run_kat(tmp) and ok
+        if "fuzz" in what:
+            ok = run_fuzz(tmp, a.n) and ok
+        if "perf" in what:
+            ok = run_perf(tmp, a.update, a.threshold, a.baseline) and ok
+    print(f"[Stage69] tests {'ok' if ok else 'FAILED'}")
+    return 0 if ok else 1
+
+if __name__ == "__main__":
+    sys.exit(main())